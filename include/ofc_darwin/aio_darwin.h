@@ -0,0 +1,154 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_AIO_DARWIN_H__)
+#define __OFC_AIO_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+
+#include "ofc_darwin/socket_darwin.h"
+
+/**
+ * \defgroup aio_darwin Darwin Overlapped Socket Engine
+ * \ingroup darwin
+ *
+ * Completion based socket I/O.  The caller posts a send or receive with
+ * its buffer and later collects the request once the data has moved.
+ * An engine thread polls the sockets with outstanding requests and
+ * retries them as they become ready.  Finished requests are queued
+ * behind a single event, so a scheduler adds that event to its wait set
+ * and sees only completed I/O, a batch at a time.
+ */
+
+/** \{ */
+
+/**
+ * Overlapped operations
+ */
+typedef enum {
+    OFC_AIO_SEND,               /**< Send the whole buffer */
+    OFC_AIO_RECV                /**< Receive into the buffer */
+} OFC_AIO_OP;
+
+/**
+ * An overlapped request
+ *
+ * Owned by the caller and left alone by it from post until the engine
+ * hands it back.  The fields above done are the caller's to set.
+ */
+typedef struct _OFC_AIO_REQUEST {
+    OFC_AIO_OP op;              /**< Operation */
+    OFC_VOID *buf;              /**< Data to send, or room to receive */
+    OFC_SIZET len;              /**< Bytes to send, or size of buf */
+    OFC_SIZET min;              /**< Receive completes once this many bytes
+                                     are in.  Zero means len. */
+    OFC_VOID *context;          /**< Caller's */
+    OFC_SIZET done;             /**< Bytes moved */
+    OFC_INT error;              /**< 0, or the errno that ended the request.
+                                     A receive that completes short with no
+                                     error hit end of stream. */
+    OFC_SOCKET_REF *ref;        /**< Private */
+    struct _OFC_AIO_REQUEST *next; /**< Private */
+} OFC_AIO_REQUEST;
+
+/**
+ * Opaque engine
+ */
+typedef struct _OFC_AIO_ENGINE OFC_AIO_ENGINE;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create an engine and start its thread
+ *
+ * \returns
+ * The engine or OFC_NULL
+ */
+OFC_AIO_ENGINE *ofc_aio_impl_create(OFC_VOID);
+
+/**
+ * Stop an engine
+ *
+ * Requests still outstanding or uncollected are dropped without being
+ * completed.  Their memory is the caller's as soon as this returns.
+ */
+OFC_VOID ofc_aio_impl_destroy(OFC_AIO_ENGINE *engine);
+
+/**
+ * Return the engine's completion event
+ *
+ * An auto reset event, set when completed requests are waiting.  Add it
+ * to a wait set and call ofc_aio_impl_complete when it fires.  The event
+ * belongs to the engine.
+ */
+OFC_HANDLE ofc_aio_impl_event(OFC_AIO_ENGINE *engine);
+
+/**
+ * Post a request on a socket
+ *
+ * The socket is switched to non-blocking mode.  Requests in the same
+ * direction on a socket complete in the order posted.  A request that
+ * can be satisfied at once is done on the caller's thread and queued as
+ * complete without waking the engine.  While a socket has requests
+ * outstanding, the engine owns its I/O; don't also send, receive or wait
+ * on it directly.
+ *
+ * \param engine
+ * The engine
+ *
+ * \param hSocket
+ * Socket to send or receive on
+ *
+ * \param request
+ * The request
+ *
+ * \returns
+ * OFC_TRUE if the request was accepted.  It then always comes back
+ * through ofc_aio_impl_complete.  OFC_FALSE if the handle isn't a socket
+ * or the engine couldn't grow to track it.
+ */
+OFC_BOOL ofc_aio_impl_post(OFC_AIO_ENGINE *engine, OFC_HANDLE hSocket,
+                           OFC_AIO_REQUEST *request);
+
+/**
+ * Fail every outstanding request on a socket with ECANCELED
+ *
+ * The requests come back through ofc_aio_impl_complete like any other.
+ * A request whose data is being moved at the time finishes that attempt
+ * first, and keeps its result if the attempt completed it.  Call before
+ * destroying a socket with requests outstanding.
+ */
+OFC_VOID ofc_aio_impl_cancel(OFC_AIO_ENGINE *engine, OFC_HANDLE hSocket);
+
+/**
+ * Collect completed requests
+ *
+ * \param engine
+ * The engine
+ *
+ * \param requests
+ * Where to return the requests, oldest first
+ *
+ * \param max
+ * Room in requests
+ *
+ * \returns
+ * Number of requests returned.  If more are waiting, the event is set
+ * again.
+ */
+OFC_INT ofc_aio_impl_complete(OFC_AIO_ENGINE *engine,
+                              OFC_AIO_REQUEST **requests, OFC_INT max);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,113 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_CONNECT_DARWIN_H__)
+#define __OFC_CONNECT_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/net.h"
+
+#include "ofc_darwin/socket_darwin.h"
+
+/**
+ * \defgroup connect_darwin Darwin Parallel Connect
+ * \ingroup darwin
+ *
+ * Connect to a peer with several resolved addresses by racing them
+ * (RFC 8305 "Happy Eyeballs").  Attempts start one after another with a
+ * short stagger, alternating address families, and the first to
+ * complete wins.  The time each address took to connect is remembered
+ * so the next race starts with the fastest address and family.
+ * Addresses an ICMP probe engine (probe_darwin) reports down are left
+ * out of the race unless every address is down.
+ */
+
+/** \{ */
+
+/**
+ * Maximum number of addresses raced in one connect
+ */
+#define OFC_CONNECT_MAX_ADDRS 16
+/**
+ * Delay before starting the next attempt, in milliseconds
+ */
+#define OFC_CONNECT_ATTEMPT_DELAY 250
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Connect to the fastest of a list of addresses
+ *
+ * Attempts are ordered by remembered latency with the preferred family
+ * first and the families interleaved.  An attempt that fails immediately
+ * starts the next one without waiting out the stagger.  Attempts still
+ * pending when one completes are closed.
+ *
+ * The race runs its own poll loop and blocks the calling thread until a
+ * connect completes, every attempt has failed or timeout has passed.
+ * Don't call it from a scheduler or wait set thread.
+ *
+ * \param addrs
+ * Addresses of the peer, typically from ofc_net_resolve_dns_name
+ *
+ * \param count
+ * Number of addresses.  Only the first OFC_CONNECT_MAX_ADDRS are used.
+ *
+ * \param port
+ * Port of the peer
+ *
+ * \param profile
+ * Tuning profile for the sockets.  May be OFC_NULL.
+ *
+ * \param timeout
+ * Milliseconds to allow for the whole race.  Zero waits until every
+ * attempt has resolved.
+ *
+ * \param index
+ * Where to return the index in addrs of the address that connected.
+ * May be OFC_NULL.
+ *
+ * \returns
+ * A connected, non-blocking stream socket or OFC_HANDLE_NULL if no
+ * address could be reached
+ */
+OFC_HANDLE ofc_connect_impl_race(const OFC_IPADDR *addrs, OFC_INT count,
+                                 OFC_UINT16 port,
+                                 const OFC_SOCKET_PROFILE *profile,
+                                 OFC_MSTIME timeout, OFC_INT *index);
+
+/**
+ * Return the remembered connect latency of an address
+ *
+ * \param ip
+ * Address to look up
+ *
+ * \param srtt
+ * Where to return the smoothed connect time in milliseconds
+ *
+ * \returns
+ * OFC_TRUE if the address has connected before
+ */
+OFC_BOOL ofc_connect_impl_latency(const OFC_IPADDR *ip, OFC_MSTIME *srtt);
+
+/**
+ * Return the family of the address that won the most recent race
+ *
+ * \returns
+ * OFC_FAMILY_IPV6 until a race has been won
+ */
+OFC_FAMILY_TYPE ofc_connect_impl_preferred_family(OFC_VOID);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
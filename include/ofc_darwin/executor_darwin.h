@@ -0,0 +1,102 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_EXECUTOR_DARWIN_H__)
+#define __OFC_EXECUTOR_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+
+/**
+ * \defgroup executor_darwin Darwin Work Stealing Task Executor
+ * \ingroup darwin
+ *
+ * A fixed pool of worker threads, each with its own task deque.  Workers
+ * run their own tasks newest first and steal the oldest tasks from their
+ * peers when they run dry.  Tasks submitted with a completion event can
+ * have that event added to a wait set like any other event.
+ */
+
+/** \{ */
+
+/**
+ * Signature of a task routine
+ */
+typedef OFC_VOID (OFC_EXECUTOR_TASK)(OFC_VOID *context);
+
+/**
+ * Opaque executor
+ */
+typedef struct _OFC_EXECUTOR OFC_EXECUTOR;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create an executor
+ *
+ * \param workers
+ * Number of worker threads.  Zero sizes the pool to the online core count.
+ *
+ * \returns
+ * The executor or OFC_NULL on failure
+ */
+OFC_EXECUTOR *ofc_executor_impl_create(OFC_INT workers);
+
+/**
+ * Destroy an executor
+ *
+ * Tasks already submitted are run before the workers exit.
+ *
+ * \param executor
+ * The executor to destroy
+ */
+OFC_VOID ofc_executor_impl_destroy(OFC_EXECUTOR *executor);
+
+/**
+ * Return the number of workers in the executor
+ */
+OFC_INT ofc_executor_impl_workers(OFC_EXECUTOR *executor);
+
+/**
+ * Submit a task and get a completion event
+ *
+ * \param executor
+ * The executor to run the task on
+ *
+ * \param task
+ * The routine to run
+ *
+ * \param context
+ * Argument passed to the routine
+ *
+ * \returns
+ * A manual reset event that is set once the task has returned.  The
+ * caller owns the event and must destroy it with ofc_event_destroy.
+ * OFC_HANDLE_NULL on failure.
+ */
+OFC_HANDLE ofc_executor_impl_submit(OFC_EXECUTOR *executor,
+                                    OFC_EXECUTOR_TASK *task,
+                                    OFC_VOID *context);
+
+/**
+ * Submit a task without a completion event
+ *
+ * \returns
+ * OFC_TRUE if the task was queued
+ */
+OFC_BOOL ofc_executor_impl_post(OFC_EXECUTOR *executor,
+                                OFC_EXECUTOR_TASK *task,
+                                OFC_VOID *context);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,154 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_FIBER_DARWIN_H__)
+#define __OFC_FIBER_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+
+/**
+ * \defgroup fiber_darwin Darwin Fiber Scheduler
+ * \ingroup darwin
+ *
+ * Cooperative fibers multiplexed on a single thread.  A fiber that
+ * waits on a handle (socket, event, timer, wait queue) is parked and the
+ * handle is added to the scheduler's wait set.  When the wait set
+ * reports the handle, the fiber is resumed.  Stacks are pooled per
+ * scheduler so spawning a fiber in the steady state does not allocate.
+ */
+
+/** \{ */
+
+/**
+ * Default fiber stack size
+ */
+#define OFC_FIBER_STACK_DEFAULT (64 * 1024)
+/**
+ * Maximum number of handles a fiber can wait on at once
+ */
+#define OFC_FIBER_MAX_WAIT 4
+
+/**
+ * Signature of a fiber routine
+ */
+typedef OFC_VOID (OFC_FIBER_ROUTINE)(OFC_VOID *context);
+
+/**
+ * Opaque fiber scheduler
+ */
+typedef struct _OFC_FIBER_SCHED OFC_FIBER_SCHED;
+/**
+ * Opaque fiber
+ */
+typedef struct _OFC_FIBER OFC_FIBER;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create a fiber scheduler
+ *
+ * The scheduler must be run and used from a single thread.
+ *
+ * \param stack_size
+ * Stack size of each fiber.  Zero selects OFC_FIBER_STACK_DEFAULT.
+ *
+ * \returns
+ * The scheduler or OFC_NULL
+ */
+OFC_FIBER_SCHED *ofc_fiber_impl_sched_create(OFC_SIZET stack_size);
+
+/**
+ * Destroy a fiber scheduler
+ *
+ * The scheduler must not be running.  Fibers that have not finished are
+ * discarded without being resumed.
+ */
+OFC_VOID ofc_fiber_impl_sched_destroy(OFC_FIBER_SCHED *sched);
+
+/**
+ * Return the wait set the scheduler sleeps on
+ *
+ * Other threads can use this to wake the scheduler with ofc_waitset_wake.
+ */
+OFC_HANDLE ofc_fiber_impl_sched_waitset(OFC_FIBER_SCHED *sched);
+
+/**
+ * Run fibers until none are left or the scheduler is stopped
+ */
+OFC_VOID ofc_fiber_impl_sched_run(OFC_FIBER_SCHED *sched);
+
+/**
+ * Ask a running scheduler to return from ofc_fiber_impl_sched_run
+ */
+OFC_VOID ofc_fiber_impl_sched_stop(OFC_FIBER_SCHED *sched);
+
+/**
+ * Create a fiber and make it runnable
+ *
+ * \param sched
+ * Scheduler to run the fiber on
+ *
+ * \param routine
+ * Entry point of the fiber.  The fiber finishes when it returns.
+ *
+ * \param context
+ * Argument passed to the routine
+ *
+ * \returns
+ * The fiber or OFC_NULL
+ */
+OFC_FIBER *ofc_fiber_impl_spawn(OFC_FIBER_SCHED *sched,
+                                OFC_FIBER_ROUTINE *routine,
+                                OFC_VOID *context);
+
+/**
+ * Return the fiber currently running on this thread, or OFC_NULL
+ */
+OFC_FIBER *ofc_fiber_impl_self(OFC_VOID);
+
+/**
+ * Let other runnable fibers run
+ */
+OFC_VOID ofc_fiber_impl_yield(OFC_VOID);
+
+/**
+ * Block the current fiber until a handle fires
+ *
+ * \param hHandle
+ * Handle to wait for.  Sockets must have their events enabled.
+ *
+ * \returns
+ * The handle, or OFC_HANDLE_NULL when not called from a fiber
+ */
+OFC_HANDLE ofc_fiber_impl_wait(OFC_HANDLE hHandle);
+
+/**
+ * Block the current fiber until one of several handles fires
+ *
+ * Typically a socket and a timer, to bound the wait.
+ *
+ * \param handles
+ * Array of handles to wait on
+ *
+ * \param count
+ * Number of handles, no more than OFC_FIBER_MAX_WAIT
+ *
+ * \returns
+ * The handle that fired, or OFC_HANDLE_NULL on bad arguments
+ */
+OFC_HANDLE ofc_fiber_impl_wait_multiple(const OFC_HANDLE *handles,
+                                        OFC_INT count);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,127 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_FRAME_DARWIN_H__)
+#define __OFC_FRAME_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+
+/**
+ * \defgroup frame_darwin Darwin Framed Stream Reader
+ * \ingroup darwin
+ *
+ * Splits a stream socket into length-prefixed frames.  The reader
+ * receives in large chunks and hands back every complete frame in the
+ * chunk, so a run of small PDUs costs one system call.  Between reads
+ * it sets the socket's receive low-water mark to the bytes still needed,
+ * so the wait set doesn't wake the reader for a partial frame.
+ */
+
+/** \{ */
+
+/**
+ * Layout of a frame header
+ */
+typedef struct {
+    OFC_INT header_len;         /**< Bytes in the header, 1 to 16 */
+    OFC_INT length_offset;      /**< Offset of the length in the header */
+    OFC_INT length_size;        /**< Bytes in the length, 1 to 4 */
+    OFC_BOOL big_endian;        /**< Byte order of the length */
+    OFC_BOOL includes_header;   /**< Length counts the header too */
+    OFC_SIZET max_frame;        /**< Largest frame accepted, header included */
+} OFC_FRAME_FORMAT;
+
+/**
+ * NetBIOS session / direct TCP framing: a type byte and a 24 bit
+ * big-endian length of the body
+ */
+#define OFC_FRAME_FORMAT_NBSS \
+  { 4, 1, 3, OFC_TRUE, OFC_FALSE, 16 * 1024 * 1024 }
+
+/**
+ * Default size of the reader's buffer
+ */
+#define OFC_FRAME_BUFFER_DEFAULT (64 * 1024)
+
+/**
+ * Opaque framed reader
+ */
+typedef struct _OFC_FRAME_READER OFC_FRAME_READER;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create a framed reader on a stream socket
+ *
+ * The reader holds a direct reference to the socket for its lifetime
+ * and is meant to be driven from one thread.
+ *
+ * \param hSocket
+ * Connected stream socket
+ *
+ * \param format
+ * Header layout
+ *
+ * \param buffer_size
+ * Initial buffer size.  Zero selects OFC_FRAME_BUFFER_DEFAULT.  The
+ * buffer grows to hold a larger frame, up to format->max_frame.
+ *
+ * \returns
+ * The reader or OFC_NULL
+ */
+OFC_FRAME_READER *ofc_frame_impl_create(OFC_HANDLE hSocket,
+                                        const OFC_FRAME_FORMAT *format,
+                                        OFC_SIZET buffer_size);
+
+/**
+ * Destroy a framed reader
+ *
+ * Buffered data is discarded and the socket's low-water mark restored.
+ * The socket itself is left open.
+ */
+OFC_VOID ofc_frame_impl_destroy(OFC_FRAME_READER *reader);
+
+/**
+ * Receive as much as fits in the reader's buffer
+ *
+ * Frames returned by ofc_frame_impl_next before this call are no longer
+ * valid after it.
+ *
+ * \returns
+ * Bytes received, 0 if the socket would block, -1 on error or when a
+ * frame longer than max_frame was seen
+ */
+OFC_SIZET ofc_frame_impl_fill(OFC_FRAME_READER *reader);
+
+/**
+ * Take the next complete frame from the buffer
+ *
+ * \param reader
+ * The reader
+ *
+ * \param frame
+ * Where to return the start of the frame, header included.  The frame
+ * stays valid until the next call to ofc_frame_impl_fill.
+ *
+ * \param len
+ * Where to return the length of the frame, header included
+ *
+ * \returns
+ * OFC_TRUE if a frame was returned, OFC_FALSE if more data is needed
+ */
+OFC_BOOL ofc_frame_impl_next(OFC_FRAME_READER *reader,
+                             const OFC_CHAR **frame, OFC_SIZET *len);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,143 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_LISTEN_DARWIN_H__)
+#define __OFC_LISTEN_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/net.h"
+
+#include "ofc_darwin/socket_darwin.h"
+
+/**
+ * \defgroup listen_darwin Darwin Listener Groups
+ * \ingroup darwin
+ *
+ * A group of listening sockets on one address, one per worker thread,
+ * so accepts are spread across cores rather than funnelled through one
+ * scheduler.  Each member is an ordinary non-blocking listener handle
+ * for a worker to add to its own wait set and accept from.
+ *
+ * Where the kernel balances SO_REUSEPORT listeners (Linux, and FreeBSD
+ * with SO_REUSEPORT_LB) each member is its own socket.  Darwin's
+ * SO_REUSEPORT hands every connection to one socket, so there the
+ * members are handles on a single shared listener; whichever worker
+ * wakes first takes the connection.
+ */
+
+/** \{ */
+
+/**
+ * Most members in a group
+ */
+#define OFC_LISTEN_GROUP_MAX 64
+
+/**
+ * Opaque listener group
+ */
+typedef struct _OFC_LISTEN_GROUP OFC_LISTEN_GROUP;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create a listener group
+ *
+ * \param ip
+ * Address to listen on
+ *
+ * \param port
+ * Port to listen on.  Zero picks one, the same for every member.
+ *
+ * \param backlog
+ * Listen backlog of each member
+ *
+ * \param profile
+ * Tuning profile for members and the connections they accept, or
+ * OFC_NULL
+ *
+ * \returns
+ * The group, or OFC_NULL if the address can't be listened on
+ */
+OFC_LISTEN_GROUP *ofc_listen_impl_create(const OFC_IPADDR *ip,
+                                         OFC_UINT16 port, OFC_INT backlog,
+                                         const OFC_SOCKET_PROFILE *profile);
+
+/**
+ * Close every member and destroy the group
+ *
+ * Handles returned by ofc_listen_impl_add are destroyed too.  Remove them
+ * from their wait sets first.
+ */
+OFC_VOID ofc_listen_impl_destroy(OFC_LISTEN_GROUP *group);
+
+/**
+ * Return OFC_TRUE if the kernel spreads connections across members
+ */
+OFC_BOOL ofc_listen_impl_balanced(OFC_VOID);
+
+/**
+ * Add a member
+ *
+ * \returns
+ * The member's listener handle, owned by the group, or OFC_HANDLE_NULL
+ */
+OFC_HANDLE ofc_listen_impl_add(OFC_LISTEN_GROUP *group);
+
+/**
+ * Remove a member and close it
+ *
+ * Remove the handle from its wait set first.  Connections already queued
+ * on the member are accepted and returned for the caller to pass to the
+ * remaining members' workers.  A connection that completes its handshake
+ * in the instant between the drain and the close may still be reset
+ * unless the kernel migrates it (Linux net.ipv4.tcp_migrate_req).
+ * Members sharing one listener have nothing of their own queued.
+ *
+ * \param group
+ * The group
+ *
+ * \param hListener
+ * Member to remove
+ *
+ * \param sockets
+ * Where to return drained connections
+ *
+ * \param ips
+ * Where to return their peer addresses, or OFC_NULL
+ *
+ * \param ports
+ * Where to return their peer ports, or OFC_NULL
+ *
+ * \param max
+ * Room in the arrays.  Connections beyond it are reset.
+ *
+ * \returns
+ * Number of connections returned, or -1 if hListener isn't a member
+ */
+OFC_INT ofc_listen_impl_remove(OFC_LISTEN_GROUP *group, OFC_HANDLE hListener,
+                               OFC_HANDLE *sockets, OFC_IPADDR *ips,
+                               OFC_UINT16 *ports, OFC_INT max);
+
+/**
+ * Return the number of members in a group
+ */
+OFC_INT ofc_listen_impl_count(OFC_LISTEN_GROUP *group);
+
+/**
+ * Return the port the group listens on
+ */
+OFC_UINT16 ofc_listen_impl_port(OFC_LISTEN_GROUP *group);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,144 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_POOL_DARWIN_H__)
+#define __OFC_POOL_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/net.h"
+
+#include "ofc_darwin/socket_darwin.h"
+
+/**
+ * \defgroup pool_darwin Darwin Outbound Connection Pool
+ * \ingroup darwin
+ *
+ * Keeps connected stream sockets to remote servers open between uses,
+ * keyed by address family, address and port, so a client that talks to
+ * the same server again skips the handshake.  Idle sockets are checked
+ * before being handed out, closed after sitting idle too long, and the
+ * least recently used is closed to make room when the pool is full.
+ */
+
+/** \{ */
+
+/**
+ * Pool limits
+ */
+typedef struct {
+    OFC_INT max_per_key;        /**< Open connections to one server */
+    OFC_INT max_total;          /**< Open connections in all */
+    OFC_MSTIME idle_timeout;    /**< Close a socket idle this long */
+    OFC_MSTIME connect_timeout; /**< Time allowed for a new connection */
+} OFC_POOL_CONFIG;
+
+/**
+ * Pool counters
+ */
+typedef struct {
+    OFC_INT open;               /**< Connections open, idle or in use */
+    OFC_INT idle;               /**< Connections waiting in the pool */
+    OFC_UINT64 hits;            /**< Requests served from the pool */
+    OFC_UINT64 misses;          /**< Requests that opened a connection */
+    OFC_UINT64 stale;           /**< Idle connections found dead */
+    OFC_UINT64 evicted;         /**< Idle connections closed by the pool */
+    OFC_UINT64 refused;         /**< Requests refused at a limit */
+    OFC_UINT64 failed;          /**< Connects that failed */
+} OFC_POOL_STATS;
+
+/**
+ * Opaque pool
+ */
+typedef struct _OFC_CONN_POOL OFC_CONN_POOL;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create a connection pool
+ *
+ * \param config
+ * Limits.  Zero in a field selects a default.
+ *
+ * \param profile
+ * Tuning profile for the connections, or OFC_NULL
+ *
+ * \returns
+ * The pool or OFC_NULL
+ */
+OFC_CONN_POOL *ofc_pool_impl_create(const OFC_POOL_CONFIG *config,
+                                    const OFC_SOCKET_PROFILE *profile);
+
+/**
+ * Close the idle connections and destroy the pool
+ *
+ * Connections still checked out are the caller's to destroy.
+ */
+OFC_VOID ofc_pool_impl_destroy(OFC_CONN_POOL *pool);
+
+/**
+ * Get a connection to a server
+ *
+ * Hands out the most recently used idle connection that is still sound,
+ * or opens a new one.  Opening a connection blocks the calling thread in
+ * ofc_connect_impl_race for up to the pool's connect_timeout.
+ *
+ * \param pool
+ * The pool
+ *
+ * \param ip
+ * Address of the server
+ *
+ * \param port
+ * Port of the server
+ *
+ * \returns
+ * A connected, non-blocking stream socket, or OFC_HANDLE_NULL if the
+ * server can't be reached or a limit has been hit
+ */
+OFC_HANDLE ofc_pool_impl_get(OFC_CONN_POOL *pool, const OFC_IPADDR *ip,
+                             OFC_UINT16 port);
+
+/**
+ * Give a connection back
+ *
+ * \param pool
+ * The pool
+ *
+ * \param hSocket
+ * Connection from ofc_pool_impl_get.  Nothing may be left unread on it.
+ * Any other socket is destroyed.
+ *
+ * \param reusable
+ * OFC_FALSE to close it, say after a protocol error
+ */
+OFC_VOID ofc_pool_impl_put(OFC_CONN_POOL *pool, OFC_HANDLE hSocket,
+                           OFC_BOOL reusable);
+
+/**
+ * Close connections idle longer than the idle timeout
+ *
+ * Call from a timer.  ofc_pool_impl_get also evicts as it goes.
+ *
+ * \returns
+ * Number of connections closed
+ */
+OFC_INT ofc_pool_impl_evict(OFC_CONN_POOL *pool);
+
+/**
+ * Return the pool's counters
+ */
+OFC_VOID ofc_pool_impl_stats(OFC_CONN_POOL *pool, OFC_POOL_STATS *stats);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,144 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_PROBE_DARWIN_H__)
+#define __OFC_PROBE_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/net.h"
+
+/**
+ * \defgroup probe_darwin Darwin ICMP Probe Engine
+ * \ingroup darwin
+ *
+ * Pings a set of hosts from one ICMP socket per address family and keeps
+ * round trip time and loss estimates for each, so a dead server is known
+ * before a connect to it has to time out.  Raw sockets are used where we
+ * have the privilege, datagram ICMP sockets otherwise.  Replies are
+ * matched to hosts by sequence number and a per-engine cookie carried in
+ * the payload, which works whether or not the kernel rewrites the echo
+ * identifier.
+ *
+ * A host is only declared down once it has answered before and then
+ * missed several probes in a row, or the network reported it
+ * unreachable.  A host that never answers, say behind a firewall that
+ * drops ICMP, stays unknown rather than down.  ofc_connect_impl_race
+ * consults every live engine and skips addresses that are down.
+ */
+
+/** \{ */
+
+/**
+ * Most hosts one engine probes
+ */
+#define OFC_PROBE_MAX_HOSTS 256
+/**
+ * Consecutive lost probes that take a host that has answered down
+ */
+#define OFC_PROBE_DOWN_LOSSES 3
+
+/**
+ * What the probes say about a host
+ */
+typedef enum {
+    OFC_PROBE_UNKNOWN,          /**< Not probed, or never answered */
+    OFC_PROBE_UP,               /**< Answering */
+    OFC_PROBE_DOWN              /**< Stopped answering, or unreachable */
+} OFC_PROBE_STATE;
+
+/**
+ * Estimates for one host
+ */
+typedef struct {
+    OFC_PROBE_STATE state;
+    OFC_UINT32 srtt_us;         /**< Smoothed round trip time */
+    OFC_UINT32 rttvar_us;       /**< Round trip time variation */
+    OFC_UINT32 min_us;          /**< Shortest round trip seen */
+    OFC_UINT32 loss;            /**< Smoothed loss, in thousandths */
+    OFC_UINT32 sent;            /**< Probes sent */
+    OFC_UINT32 received;        /**< Replies matched */
+    OFC_UINT32 lost;            /**< Consecutive probes lost */
+    OFC_MSTIME last_reply;      /**< When the last reply arrived */
+} OFC_PROBE_STATS;
+
+/**
+ * Opaque probe engine
+ */
+typedef struct _OFC_PROBE_ENGINE OFC_PROBE_ENGINE;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Create a probe engine and start its thread
+ *
+ * \param interval
+ * Time between probes to one host
+ *
+ * \param timeout
+ * Time after which an unanswered probe counts as lost.  Capped at the
+ * interval.
+ *
+ * \returns
+ * The engine, or OFC_NULL if no ICMP socket could be opened
+ */
+OFC_PROBE_ENGINE *ofc_probe_impl_create(OFC_MSTIME interval,
+                                        OFC_MSTIME timeout);
+
+/**
+ * Stop the engine's thread and destroy it
+ */
+OFC_VOID ofc_probe_impl_destroy(OFC_PROBE_ENGINE *engine);
+
+/**
+ * Start probing a host
+ *
+ * The first probe goes out straight away.
+ *
+ * \returns
+ * OFC_TRUE if the host is now being probed, OFC_FALSE if the engine is
+ * full or has no socket for the host's family
+ */
+OFC_BOOL ofc_probe_impl_add(OFC_PROBE_ENGINE *engine, const OFC_IPADDR *ip);
+
+/**
+ * Stop probing a host and forget its estimates
+ */
+OFC_VOID ofc_probe_impl_remove(OFC_PROBE_ENGINE *engine,
+                               const OFC_IPADDR *ip);
+
+/**
+ * Probe every host now rather than waiting for the interval
+ */
+OFC_VOID ofc_probe_impl_kick(OFC_PROBE_ENGINE *engine);
+
+/**
+ * Return the estimates for a host
+ *
+ * \returns
+ * OFC_FALSE if the engine isn't probing the host
+ */
+OFC_BOOL ofc_probe_impl_stats(OFC_PROBE_ENGINE *engine, const OFC_IPADDR *ip,
+                              OFC_PROBE_STATS *stats);
+
+/**
+ * Return what the live engines say about a host
+ *
+ * \returns
+ * OFC_PROBE_UP if any engine hears from it, OFC_PROBE_DOWN if one
+ * considers it down and none hears from it, OFC_PROBE_UNKNOWN otherwise
+ */
+OFC_PROBE_STATE ofc_probe_impl_state(const OFC_IPADDR *ip);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,120 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_RXBUF_DARWIN_H__)
+#define __OFC_RXBUF_DARWIN_H__
+
+#include "ofc/types.h"
+
+/**
+ * \defgroup rxbuf_darwin Darwin Receive Buffer Pool
+ * \ingroup darwin
+ *
+ * Page aligned, reference counted buffers for socket receives.  A
+ * receive fills a pooled buffer and the buffer is passed up the stack by
+ * reference rather than copied.  Buffers come in fixed size classes,
+ * from a page up to a large MTU SMB read, and are carved from slabs
+ * that are mapped as the pool grows, up to a global limit.  Each thread
+ * keeps a small cache per class, so getting and releasing a buffer in
+ * the steady state takes no locks and never touches the heap.
+ */
+
+/** \{ */
+
+/**
+ * Number of buffer size classes
+ */
+#define OFC_RXBUF_CLASSES 6
+/**
+ * Largest buffer the pool hands out: an 8MB read plus room for headers
+ */
+#define OFC_RXBUF_MAX_SIZE (8 * 1024 * 1024 + 64 * 1024)
+/**
+ * Default limit on memory mapped for buffers
+ */
+#define OFC_RXBUF_DEFAULT_LIMIT (256 * 1024 * 1024)
+
+/**
+ * A pooled receive buffer
+ *
+ * data, size and len are the caller's.  The rest belong to the pool.
+ */
+typedef struct _OFC_RXBUF {
+    OFC_CHAR *data;             /**< Page aligned start of the buffer */
+    OFC_SIZET size;             /**< Capacity */
+    OFC_SIZET len;              /**< Bytes of valid data */
+    OFC_INT refcount;           /**< Private */
+    OFC_INT sclass;             /**< Private */
+    struct _OFC_RXBUF *next;    /**< Private */
+} OFC_RXBUF;
+
+/**
+ * Pool usage
+ */
+typedef struct {
+    OFC_SIZET limit;            /**< Most memory the pool may map */
+    OFC_SIZET mapped;           /**< Memory mapped for buffers */
+    OFC_SIZET in_use;           /**< Memory in buffers handed out */
+} OFC_RXBUF_USAGE;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Get a buffer
+ *
+ * \param size
+ * Bytes needed.  The buffer returned is from the smallest class that
+ * holds them, so size may be larger than asked.
+ *
+ * \returns
+ * An empty buffer with one reference, or OFC_NULL if size is beyond
+ * OFC_RXBUF_MAX_SIZE or the pool is at its limit
+ */
+OFC_RXBUF *ofc_rxbuf_impl_get(OFC_SIZET size);
+
+/**
+ * Take another reference to a buffer
+ *
+ * Use when handing the buffer to a second owner.  Each reference is
+ * dropped with ofc_rxbuf_impl_release.
+ */
+OFC_VOID ofc_rxbuf_impl_ref(OFC_RXBUF *buf);
+
+/**
+ * Drop a reference to a buffer
+ *
+ * The buffer goes back to the pool when the last reference is dropped.
+ */
+OFC_VOID ofc_rxbuf_impl_release(OFC_RXBUF *buf);
+
+/**
+ * Set the most memory the pool may map
+ *
+ * Lowering the limit doesn't unmap anything.  It stops further growth.
+ */
+OFC_VOID ofc_rxbuf_impl_set_limit(OFC_SIZET limit);
+
+/**
+ * Return the pool's memory usage
+ */
+OFC_VOID ofc_rxbuf_impl_usage(OFC_RXBUF_USAGE *usage);
+
+/**
+ * Return this thread's cached buffers to the shared pool
+ *
+ * Called automatically when a thread exits.
+ */
+OFC_VOID ofc_rxbuf_impl_flush(OFC_VOID);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
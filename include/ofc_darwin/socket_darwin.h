@@ -0,0 +1,1191 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__OFC_SOCKET_DARWIN_H__)
+#define __OFC_SOCKET_DARWIN_H__
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/net.h"
+
+#include "ofc_darwin/rxbuf_darwin.h"
+
+/**
+ * \defgroup socket_darwin Darwin Socket Extensions
+ * \ingroup darwin
+ *
+ * Platform socket calls beyond the portable socketimpl interface.  They
+ * operate on the same OFC_HANDLE_SOCKET_IMPL handles and follow the same
+ * return conventions: a byte count, zero when the call would block, and
+ * -1 on error.
+ */
+
+/** \{ */
+
+/**
+ * Maximum number of segments passed to the kernel in one call
+ */
+#define OFC_SOCKET_IOV_MAX 64
+
+/**
+ * A buffer segment for scatter/gather I/O
+ */
+typedef struct {
+    OFC_VOID *base;             /**< Start of the segment */
+    OFC_SIZET len;              /**< Length of the segment */
+} OFC_IOVEC;
+
+/**
+ * Maximum number of datagrams handed to the kernel in one batch call
+ */
+#define OFC_SOCKET_BATCH_MAX 64
+
+/**
+ * One datagram in a batch send or receive
+ */
+typedef struct {
+    OFC_VOID *buf;              /**< Datagram payload */
+    OFC_SIZET len;              /**< Payload length, or buffer size on receive */
+    OFC_IPADDR ip;              /**< Destination, or source on receive */
+    OFC_UINT16 port;            /**< Destination, or source on receive */
+    OFC_SIZET status;           /**< Bytes moved, 0 would block, -1 error */
+} OFC_SOCKET_DATAGRAM;
+
+/**
+ * State of a file to socket transfer
+ *
+ * Initialise with ofc_socket_impl_sendfile_init and pass to
+ * ofc_socket_impl_sendfile until ofc_socket_impl_sendfile_done says the
+ * header, file range and trailer have all gone out.  The header and
+ * trailer segment arrays are consumed in place.
+ */
+typedef struct {
+    int fd;                     /**< Source file descriptor */
+    OFC_OFFT offset;            /**< Next file byte to send */
+    OFC_OFFT remaining;         /**< File bytes still to send */
+    OFC_IOVEC *header;          /**< Segments sent before the file data */
+    OFC_INT header_count;       /**< Number of header segments */
+    OFC_IOVEC *trailer;         /**< Segments sent after the file data */
+    OFC_INT trailer_count;      /**< Number of trailer segments */
+    OFC_VOID *map;              /**< Mapped window of the file, if any */
+    OFC_OFFT map_offset;        /**< File offset of the mapped window */
+    OFC_SIZET map_len;          /**< Length of the mapped window */
+} OFC_SOCKET_SENDFILE;
+
+/**
+ * Socket tuning profile
+ *
+ * Zero in a numeric field leaves the system default alone.  TCP options
+ * are ignored on datagram sockets.
+ */
+typedef struct {
+    OFC_BOOL nodelay;           /**< Disable Nagle */
+    OFC_BOOL keepalive;         /**< Enable keepalive probes */
+    OFC_INT keepalive_idle;     /**< Idle seconds before the first probe */
+    OFC_INT keepalive_interval; /**< Seconds between probes */
+    OFC_INT keepalive_count;    /**< Unanswered probes before reset */
+    OFC_INT notsent_lowat;      /**< Unsent bytes before write is ready */
+    OFC_BOOL cork;              /**< Hold partial segments until uncorked */
+    OFC_INT recv_lowat;         /**< Bytes queued before read is ready */
+} OFC_SOCKET_PROFILE;
+
+/**
+ * Socket event reported by ofc_socket_impl_test when an asynchronous
+ * connect completes, fails or times out
+ *
+ * Chosen clear of the portable OFC_SOCKET_EVENT bits.  Use
+ * ofc_socket_impl_connect_state to find out which way it went.
+ */
+#define OFC_SOCKET_EVENT_CONNECT 0x8000
+
+/**
+ * Directions for ofc_socket_impl_shutdown
+ */
+typedef enum {
+    OFC_SOCKET_SHUTDOWN_READ,    /**< No more receives */
+    OFC_SOCKET_SHUTDOWN_WRITE,   /**< Send FIN after queued data */
+    OFC_SOCKET_SHUTDOWN_BOTH     /**< Both */
+} OFC_SOCKET_SHUTDOWN;
+
+/**
+ * Progress of a graceful close
+ */
+typedef enum {
+    OFC_SOCKET_DRAIN_NONE,       /**< No graceful close started */
+    OFC_SOCKET_DRAIN_PENDING,    /**< FIN sent, waiting for the peer's */
+    OFC_SOCKET_DRAIN_DONE,       /**< Peer closed its side */
+    OFC_SOCKET_DRAIN_TIMEDOUT    /**< Deadline passed, will be reset */
+} OFC_SOCKET_DRAIN_STATE;
+
+/**
+ * Progress of an asynchronous connect
+ */
+typedef enum {
+    OFC_SOCKET_CONNECT_NONE,     /**< No asynchronous connect started */
+    OFC_SOCKET_CONNECT_PENDING,  /**< Handshake in progress */
+    OFC_SOCKET_CONNECT_DONE,     /**< Connected */
+    OFC_SOCKET_CONNECT_FAILED,   /**< Refused or unreachable */
+    OFC_SOCKET_CONNECT_TIMEDOUT  /**< Deadline passed before completion */
+} OFC_SOCKET_CONNECT_STATE;
+
+/**
+ * Limits for socket buffer autotuning
+ */
+typedef struct {
+    OFC_INT min_buffer;         /**< Smallest buffer a socket is given */
+    OFC_INT max_buffer;         /**< Largest buffer a socket is given */
+    OFC_SIZET memory_limit;     /**< Total of all tuned buffers */
+    OFC_MSTIME interval;        /**< Milliseconds between samples */
+} OFC_SOCKET_AUTOTUNE_CONFIG;
+
+/**
+ * What the autotuner last measured and decided for a socket
+ */
+typedef struct {
+    OFC_BOOL enabled;           /**< Socket is being tuned */
+    OFC_UINT32 rtt_us;          /**< Smoothed round trip, microseconds */
+    OFC_UINT64 throughput;      /**< Bytes per second */
+    OFC_UINT64 bdp;             /**< Bandwidth-delay product, bytes */
+    OFC_INT send_size;          /**< Send buffer size in force */
+    OFC_INT recv_size;          /**< Receive buffer size in force */
+    OFC_BOOL limited;           /**< Growth held back by memory_limit */
+    OFC_MSTIME sampled;         /**< Time of the last sample */
+} OFC_SOCKET_AUTOTUNE;
+
+/**
+ * I/O counters for a socket, or for all sockets on a local port
+ */
+typedef struct {
+    OFC_UINT16 local_port;      /**< Local port the socket is bound to */
+    OFC_INT count;              /**< Number of sockets counted */
+    OFC_UINT64 bytes_out;       /**< Bytes sent */
+    OFC_UINT64 bytes_in;        /**< Bytes received */
+    OFC_UINT64 sends;           /**< Send system calls */
+    OFC_UINT64 recvs;           /**< Receive system calls */
+    OFC_UINT64 send_again;      /**< Sends that would have blocked */
+    OFC_UINT64 recv_again;      /**< Receives that found nothing */
+    OFC_UINT64 short_writes;    /**< Sends the kernel only partly took */
+    OFC_UINT64 errors;          /**< Calls that failed outright */
+    OFC_UINT64 write_blocked_ms; /**< Time from a blocked send to the
+                                      next one that went through */
+    OFC_UINT32 rtt_us;          /**< Kernel smoothed RTT, microseconds */
+    OFC_UINT64 retransmits;     /**< Kernel retransmit count */
+} OFC_SOCKET_STATS;
+
+/**
+ * Buckets in a receive delay histogram
+ */
+#define OFC_SOCKET_DELAY_BUCKETS 24
+
+/**
+ * How long received data waited between the kernel stamping it and the
+ * receive call that took it
+ *
+ * buckets[0] counts delays under a microsecond, buckets[i] delays from
+ * 2^(i-1) up to 2^i microseconds, and the last bucket everything longer.
+ */
+typedef struct {
+    OFC_UINT64 count;           /**< Receives that carried a timestamp */
+    OFC_UINT64 total_us;        /**< Sum of their delays */
+    OFC_UINT64 max_us;          /**< Longest delay */
+    OFC_UINT64 buckets[OFC_SOCKET_DELAY_BUCKETS]; /**< Delays by power of
+                                                       two microseconds */
+} OFC_SOCKET_DELAY;
+
+/**
+ * Most descriptors passed in one message on a local socket
+ */
+#define OFC_SOCKET_FDS_MAX 16
+
+/**
+ * Identity of the process at the other end of a local socket
+ */
+typedef struct {
+    OFC_INT pid;                /**< Process id, -1 if the platform can't say */
+    OFC_UINT32 uid;             /**< Effective user id */
+    OFC_UINT32 gid;             /**< Effective group id */
+} OFC_SOCKET_PEER_CRED;
+
+/**
+ * A pinned reference to a socket
+ *
+ * Holds the socket open without going through the handle table.
+ */
+typedef struct _OFC_SOCKET_IMPL OFC_SOCKET_REF;
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Send a gathered buffer on a stream socket with one system call
+ *
+ * The kernel may accept only part of the data.  Use
+ * ofc_socket_impl_iov_advance to step past what was sent and call again.
+ * Segments beyond OFC_SOCKET_IOV_MAX are left for a following call.
+ *
+ * \param hSocket
+ * Socket to send on
+ *
+ * \param iov
+ * Segments to send, in order
+ *
+ * \param iovcnt
+ * Number of segments
+ *
+ * \returns
+ * Bytes sent, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_sendv(OFC_HANDLE hSocket,
+                                const OFC_IOVEC *iov, OFC_INT iovcnt);
+
+/**
+ * Receive into a scattered buffer on a stream socket
+ *
+ * \returns
+ * Bytes received, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_recvv(OFC_HANDLE hSocket,
+                                const OFC_IOVEC *iov, OFC_INT iovcnt);
+
+/**
+ * Send one datagram gathered from several segments
+ *
+ * \param hSocket
+ * Datagram socket to send on
+ *
+ * \param iov
+ * Segments making up the datagram
+ *
+ * \param iovcnt
+ * Number of segments, no more than OFC_SOCKET_IOV_MAX
+ *
+ * \param ip
+ * Destination address
+ *
+ * \param port
+ * Destination port
+ *
+ * \returns
+ * Bytes sent, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_sendtov(OFC_HANDLE hSocket,
+                                  const OFC_IOVEC *iov, OFC_INT iovcnt,
+                                  const OFC_IPADDR *ip, OFC_UINT16 port);
+
+/**
+ * Receive one datagram scattered into several segments
+ *
+ * \param ip
+ * Where to return the source address.  May be OFC_NULL.
+ *
+ * \param port
+ * Where to return the source port.  May be OFC_NULL.
+ *
+ * \returns
+ * Bytes received, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_recv_fromv(OFC_HANDLE hSocket,
+                                     const OFC_IOVEC *iov, OFC_INT iovcnt,
+                                     OFC_IPADDR *ip, OFC_UINT16 *port);
+
+/**
+ * Consume bytes from the front of a segment array
+ *
+ * Used after a partial send or receive.  Fully consumed segments are
+ * zeroed and the first partially consumed segment is trimmed.
+ *
+ * \param iov
+ * Segment array to update
+ *
+ * \param iovcnt
+ * Number of segments
+ *
+ * \param count
+ * Number of bytes consumed
+ *
+ * \returns
+ * Index of the first segment with data remaining, iovcnt when all of
+ * the data has been consumed
+ */
+OFC_INT ofc_socket_impl_iov_advance(OFC_IOVEC *iov, OFC_INT iovcnt,
+                                    OFC_SIZET count);
+
+/**
+ * Compare two addresses
+ *
+ * \param a
+ * First address
+ *
+ * \param b
+ * Second address
+ *
+ * \param scope
+ * Whether IPv6 addresses must also have the same scope
+ *
+ * 
+eturns
+ * OFC_TRUE if they are the same family and address
+ */
+OFC_BOOL ofc_socket_impl_ip_equal(const OFC_IPADDR *a, const OFC_IPADDR *b,
+                                  OFC_BOOL scope);
+
+/**
+ * Send a batch of datagrams
+ *
+ * Each datagram carries its own destination.  Sending stops at the first
+ * datagram that would block or fails; its status says which, and the
+ * status of datagrams after it is set to 0.
+ *
+ * \param hSocket
+ * Datagram socket to send on
+ *
+ * \param dgrams
+ * Datagrams to send
+ *
+ * \param count
+ * Number of datagrams
+ *
+ * \returns
+ * Number of datagrams sent
+ */
+OFC_INT ofc_socket_impl_sendto_batch(OFC_HANDLE hSocket,
+                                     OFC_SOCKET_DATAGRAM *dgrams,
+                                     OFC_INT count);
+
+/**
+ * Receive a batch of datagrams
+ *
+ * Waits for the first datagram only as long as the socket's blocking mode
+ * says to, then takes whatever else is already queued without waiting.
+ * Received datagrams have their len, ip, port and status filled in.
+ *
+ * \returns
+ * Number of datagrams received
+ */
+OFC_INT ofc_socket_impl_recv_from_batch(OFC_HANDLE hSocket,
+                                        OFC_SOCKET_DATAGRAM *dgrams,
+                                        OFC_INT count);
+
+/**
+ * Set up a file to socket transfer
+ *
+ * \param xfer
+ * Transfer state to initialise
+ *
+ * \param fd
+ * File descriptor of the source file, as returned by OfcFSDarwinGetFD
+ *
+ * \param offset
+ * First byte of the file to send
+ *
+ * \param length
+ * Number of file bytes to send
+ *
+ * \param header
+ * Segments to send before the file data.  May be OFC_NULL.
+ *
+ * \param header_count
+ * Number of header segments
+ *
+ * \param trailer
+ * Segments to send after the file data.  May be OFC_NULL.
+ *
+ * \param trailer_count
+ * Number of trailer segments
+ */
+OFC_VOID ofc_socket_impl_sendfile_init(OFC_SOCKET_SENDFILE *xfer, int fd,
+                                       OFC_OFFT offset, OFC_OFFT length,
+                                       OFC_IOVEC *header,
+                                       OFC_INT header_count,
+                                       OFC_IOVEC *trailer,
+                                       OFC_INT trailer_count);
+
+/**
+ * Move as much of a file transfer as the socket will take
+ *
+ * Uses the kernel's sendfile where available so file data never passes
+ * through user space.  Otherwise the file is mapped a window at a time
+ * and sent with one gathered send per call; the window is kept between
+ * calls.  On a non-blocking socket, enable write events and call again
+ * when the socket is writable.
+ *
+ * \param hSocket
+ * Connected stream socket
+ *
+ * \param xfer
+ * Transfer state
+ *
+ * \returns
+ * Bytes sent by this call, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_sendfile(OFC_HANDLE hSocket,
+                                   OFC_SOCKET_SENDFILE *xfer);
+
+/**
+ * Test whether a file transfer has completed
+ */
+OFC_BOOL ofc_socket_impl_sendfile_done(OFC_SOCKET_SENDFILE *xfer);
+
+/**
+ * Release resources held by a file transfer
+ *
+ * Call once the transfer is done or abandoned.  Does not close the file.
+ */
+OFC_VOID ofc_socket_impl_sendfile_cleanup(OFC_SOCKET_SENDFILE *xfer);
+
+/**
+ * Look up a named tuning profile
+ *
+ * \param name
+ * "interactive", "bulk" or "discovery"
+ *
+ * \returns
+ * The profile or OFC_NULL if the name is unknown
+ */
+const OFC_SOCKET_PROFILE *ofc_socket_impl_profile(OFC_CCHAR *name);
+
+/**
+ * Create a socket with a tuning profile applied
+ *
+ * The options are set before the handle is created, so no one can use
+ * the socket untuned.  The profile is remembered and applied to every
+ * socket accepted from this one.
+ *
+ * \param family
+ * Network family
+ *
+ * \param socktype
+ * Socket type
+ *
+ * \param profile
+ * Profile to apply.  OFC_NULL behaves like ofc_socket_impl_create.
+ *
+ * \returns
+ * Socket handle or OFC_HANDLE_NULL
+ */
+OFC_HANDLE ofc_socket_impl_create_profile(OFC_FAMILY_TYPE family,
+                                          OFC_SOCKET_TYPE socktype,
+                                          const OFC_SOCKET_PROFILE *profile);
+
+/**
+ * Apply a tuning profile to an existing socket
+ *
+ * \returns
+ * OFC_TRUE if every option the platform supports was set
+ */
+OFC_BOOL ofc_socket_impl_set_profile(OFC_HANDLE hSocket,
+                                     const OFC_SOCKET_PROFILE *profile);
+
+/**
+ * Cork or uncork a stream socket
+ *
+ * Uncorking pushes out anything held back.
+ */
+OFC_BOOL ofc_socket_impl_cork(OFC_HANDLE hSocket, OFC_BOOL onoff);
+
+/**
+ * Accept every pending connection, up to a limit
+ *
+ * Drains the backlog in one call rather than one connection per wait
+ * set wakeup.  Accepted sockets are non-blocking and close-on-exec from
+ * the start and have the listener's tuning profile applied.  On a
+ * blocking listener only the first accept waits.
+ *
+ * \param hSocket
+ * Listening socket
+ *
+ * \param sockets
+ * Array to return the accepted sockets in
+ *
+ * \param ips
+ * Array to return the peer addresses in.  May be OFC_NULL.
+ *
+ * \param ports
+ * Array to return the peer ports in.  May be OFC_NULL.
+ *
+ * \param max
+ * Size of the arrays
+ *
+ * \returns
+ * Number of connections accepted
+ */
+OFC_INT ofc_socket_impl_accept_many(OFC_HANDLE hSocket, OFC_HANDLE *sockets,
+                                    OFC_IPADDR *ips, OFC_UINT16 *ports,
+                                    OFC_INT max);
+
+/**
+ * Receive into the free space at the end of a pooled buffer
+ *
+ * Data is appended after buf->len and buf->len is advanced, so partial
+ * PDUs can be completed over several calls.
+ *
+ * \returns
+ * Bytes received, 0 if the socket would block or the buffer is full,
+ * -1 on error
+ */
+OFC_SIZET ofc_socket_impl_recv_buf(OFC_HANDLE hSocket, OFC_RXBUF *buf);
+
+/**
+ * Receive a datagram into a pooled buffer
+ *
+ * The datagram replaces anything already in the buffer.
+ *
+ * \returns
+ * Bytes received, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_recv_from_buf(OFC_HANDLE hSocket, OFC_RXBUF *buf,
+                                        OFC_IPADDR *ip, OFC_UINT16 *port);
+
+/**
+ * Start a connect without waiting for it to complete
+ *
+ * The socket is made non-blocking.  While the connect is pending the
+ * socket is polled for write by the wait set, and ofc_socket_impl_test
+ * reports OFC_SOCKET_EVENT_CONNECT once it completes, fails or runs
+ * past its deadline.  A socket that timed out is still connecting in
+ * the kernel and should be destroyed.
+ *
+ * \param hSocket
+ * Stream socket to connect
+ *
+ * \param ip
+ * Address of the peer
+ *
+ * \param port
+ * Port of the peer
+ *
+ * \param timeout
+ * Milliseconds to allow for the connect.  Zero waits indefinitely.
+ *
+ * \returns
+ * OFC_TRUE if the connect is pending or already complete, OFC_FALSE if
+ * it failed immediately
+ */
+OFC_BOOL ofc_socket_impl_connect_async(OFC_HANDLE hSocket,
+                                       const OFC_IPADDR *ip,
+                                       OFC_UINT16 port,
+                                       OFC_MSTIME timeout);
+
+/**
+ * Start a connect that carries the first data with it
+ *
+ * Uses TCP Fast Open where the system supports it, so a server that
+ * has been connected to before receives the data in the SYN and can
+ * answer a round trip sooner.  The data must be safe to deliver twice:
+ * a SYN can be replayed.  Elsewhere, or when fast open is turned off,
+ * this is an ordinary asynchronous connect, and the data is sent only
+ * if the connect completes at once.  Completion is reported as for
+ * ofc_socket_impl_connect_async.
+ *
+ * \param hSocket
+ * Stream socket to connect
+ *
+ * \param ip
+ * Address of the peer
+ *
+ * \param port
+ * Port of the peer
+ *
+ * \param data
+ * Data to send
+ *
+ * \param len
+ * Size of data
+ *
+ * \param timeout
+ * Milliseconds to allow for the connect.  Zero waits indefinitely.
+ *
+ * \returns
+ * Bytes of data taken, which may be none, or -1 if the connect failed
+ * immediately.  Send whatever is left once the connect completes.
+ */
+OFC_SIZET ofc_socket_impl_connect_data(OFC_HANDLE hSocket,
+                                       const OFC_IPADDR *ip,
+                                       OFC_UINT16 port,
+                                       const OFC_VOID *data,
+                                       OFC_SIZET len,
+                                       OFC_MSTIME timeout);
+
+/**
+ * Listen, handing over connections only once they have data
+ *
+ * Saves the scheduler a wakeup, and a connection slot, per client that
+ * connects and then says nothing.  Uses TCP_DEFER_ACCEPT on Linux and
+ * the dataready accept filter where the BSDs provide one.  Darwin has
+ * neither, and the socket then listens as usual.
+ *
+ * \param hSocket
+ * Bound stream socket
+ *
+ * \param backlog
+ * Listen backlog
+ *
+ * \param seconds
+ * How long Linux holds a silent connection before handing it over
+ * anyway.  Accept filters hold it until data comes or it closes.
+ *
+ * \param deferred
+ * Where to return whether accepts are deferred.  May be OFC_NULL.
+ *
+ * \returns
+ * OFC_TRUE if the socket is listening
+ */
+OFC_BOOL ofc_socket_impl_listen_defer(OFC_HANDLE hSocket, OFC_INT backlog,
+                                      OFC_INT seconds,
+                                      OFC_BOOL *deferred);
+
+/**
+ * Accept TCP Fast Open connections on a listener
+ *
+ * Call before listening.  Clients then get a cookie on their first
+ * connect and may send data in the SYN of later ones.
+ *
+ * \param hSocket
+ * Stream socket to listen on
+ *
+ * \param qlen
+ * Most fast open connections waiting to be accepted.  Darwin treats any
+ * value as on.
+ *
+ * \returns
+ * OFC_TRUE if the system supports it
+ */
+OFC_BOOL ofc_socket_impl_fastopen(OFC_HANDLE hSocket, OFC_INT qlen);
+
+/**
+ * Return the progress of an asynchronous connect
+ *
+ * A pending connect is checked without blocking.  Once the connect has
+ * resolved, ofc_socket_impl_test no longer reports
+ * OFC_SOCKET_EVENT_CONNECT for it.
+ *
+ * \param hSocket
+ * Socket passed to ofc_socket_impl_connect_async
+ *
+ * \param error
+ * Where to return the errno of a failed or timed out connect.  May be
+ * OFC_NULL.
+ *
+ * \returns
+ * The connect state
+ */
+OFC_SOCKET_CONNECT_STATE ofc_socket_impl_connect_state(OFC_HANDLE hSocket,
+                                                       OFC_INT *error);
+
+/**
+ * Return how long the wait set may sleep on behalf of this socket
+ *
+ * \returns
+ * Milliseconds until the pending connect deadline, 0 if it has passed,
+ * OFC_MAX_SCHED_WAIT when the socket has no deadline
+ */
+OFC_MSTIME ofc_socket_impl_get_wait_time(OFC_HANDLE hSocket);
+
+/**
+ * Set the limits used by buffer autotuning
+ *
+ * Applies to all tuned sockets from their next sample.  The defaults are
+ * 16KB to 4MB per buffer, 64MB in total, sampled once a second.
+ */
+OFC_VOID
+ofc_socket_impl_autotune_config(const OFC_SOCKET_AUTOTUNE_CONFIG *config);
+
+/**
+ * Return the total of the buffers granted to tuned sockets
+ */
+OFC_SIZET ofc_socket_impl_autotune_memory(OFC_VOID);
+
+/**
+ * Turn buffer autotuning on or off for a stream socket
+ *
+ * A tuned socket samples its round trip time and throughput from the
+ * kernel whenever its events are tested, at most once per interval, and
+ * sizes its send and receive buffers to the bandwidth-delay product.
+ * Buffers grow while the connection fills them and shrink once they are
+ * more than twice what the path needs, by at most half per sample.  An
+ * idle connection needs nothing, so its buffers decay to the minimum.
+ * Turning tuning off leaves the buffers at their last size.
+ *
+ * \returns
+ * OFC_FALSE if the platform can't report connection statistics
+ */
+OFC_BOOL ofc_socket_impl_autotune(OFC_HANDLE hSocket, OFC_BOOL onoff);
+
+/**
+ * Sample a tuned socket now rather than waiting for its next event
+ *
+ * Still limited to once per interval.
+ *
+ * \returns
+ * OFC_TRUE if the buffers were resized
+ */
+OFC_BOOL ofc_socket_impl_autotune_sample(OFC_HANDLE hSocket);
+
+/**
+ * Return the autotuner's view of a socket
+ *
+ * \returns
+ * OFC_FALSE if the socket isn't being tuned
+ */
+OFC_BOOL ofc_socket_impl_autotune_state(OFC_HANDLE hSocket,
+                                        OFC_SOCKET_AUTOTUNE *state);
+
+/**
+ * Return the counters for one socket
+ *
+ * The RTT, retransmits and local port are read from the kernel at the
+ * time of the call.
+ *
+ * \returns
+ * OFC_FALSE if the handle is not a socket
+ */
+OFC_BOOL ofc_socket_impl_stats(OFC_HANDLE hSocket, OFC_SOCKET_STATS *stats);
+
+/**
+ * Return the counters for every live socket
+ *
+ * Counters are read without stopping I/O on the sockets, so a snapshot
+ * is consistent per field rather than across fields.
+ *
+ * \param stats
+ * Array to fill in
+ *
+ * \param max
+ * Size of the array
+ *
+ * \returns
+ * Number of live sockets, which may be more than max
+ */
+OFC_INT ofc_socket_impl_stats_snapshot(OFC_SOCKET_STATS *stats, OFC_INT max);
+
+/**
+ * Return the counters of all live sockets summed by local port
+ *
+ * count in each entry says how many sockets were summed.  rtt_us is the
+ * mean over the sockets that report one.
+ *
+ * \returns
+ * Number of entries filled in.  Ports beyond max are left out.
+ */
+OFC_INT ofc_socket_impl_stats_by_port(OFC_SOCKET_STATS *stats, OFC_INT max);
+
+/**
+ * Turn kernel receive timestamps on or off
+ *
+ * With timestamps on, every receive on the socket reads the time the
+ * kernel took the data off the network and adds the wait to the
+ * socket's delay histogram.  Darwin stamps with the monotonic clock,
+ * other systems with the time of day.  Some kernels stamp only
+ * datagrams.  Connections accepted from a listener with timestamps on
+ * start with them on.
+ *
+ * \returns
+ * OFC_TRUE on success
+ */
+OFC_BOOL ofc_socket_impl_timestamps(OFC_HANDLE hSocket, OFC_BOOL onoff);
+
+/**
+ * Receive data along with the time it arrived
+ *
+ * \param hSocket
+ * Socket to receive on
+ *
+ * \param buf
+ * Where to put the data
+ *
+ * \param len
+ * Size of buf
+ *
+ * \param ip
+ * Where to return the sender's address, or OFC_NULL
+ *
+ * \param port
+ * Where to return the sender's port, or OFC_NULL
+ *
+ * \param arrival
+ * Where to return the arrival time in microseconds on the clock of
+ * ofc_socket_impl_stamp_now, or 0 if the kernel didn't stamp the data.
+ * With several packets in one read, the time is that of the last.
+ *
+ * \returns
+ * Bytes received, 0 if nothing was waiting, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_recv_stamped(OFC_HANDLE hSocket,
+                                       OFC_VOID *buf, OFC_SIZET len,
+                                       OFC_IPADDR *ip, OFC_UINT16 *port,
+                                       OFC_UINT64 *arrival);
+
+/**
+ * Return the time on the clock of receive timestamps
+ *
+ * Subtract an arrival time from it to find how long a request has been
+ * waiting, say when it is finally dispatched.
+ *
+ * \returns
+ * Microseconds
+ */
+OFC_UINT64 ofc_socket_impl_stamp_now(OFC_VOID);
+
+/**
+ * Return a socket's receive delay histogram
+ *
+ * \param hSocket
+ * Socket with timestamps on
+ *
+ * \param delay
+ * Where to return the histogram.  May be OFC_NULL to just reset.
+ *
+ * \param reset
+ * OFC_TRUE to start the histogram over
+ *
+ * \returns
+ * OFC_FALSE if the socket doesn't have timestamps on
+ */
+OFC_BOOL ofc_socket_impl_delay(OFC_HANDLE hSocket, OFC_SOCKET_DELAY *delay,
+                               OFC_BOOL reset);
+
+/**
+ * Take a direct reference to a socket
+ *
+ * Looks the handle up once.  Calls made through the reference don't
+ * touch the handle table, so a thread driving a socket can use it for
+ * many operations at the cost of one lookup.  Sends and stamped
+ * receives are serialized with those through the handle, so the two can
+ * be mixed.  Closing or destroying the handle lets the socket's endpoint
+ * go at once and fails further I/O through the reference, but the
+ * descriptor number stays taken until every reference has been
+ * released.
+ *
+ * \returns
+ * The reference, or OFC_NULL if the handle is not a socket
+ */
+OFC_SOCKET_REF *ofc_socket_impl_ref(OFC_HANDLE hSocket);
+
+/**
+ * Release a reference taken with ofc_socket_impl_ref
+ */
+OFC_VOID ofc_socket_impl_ref_release(OFC_SOCKET_REF *ref);
+
+/**
+ * Send through a reference.  Same results as ofc_socket_impl_send.
+ */
+OFC_SIZET ofc_socket_impl_ref_send(OFC_SOCKET_REF *ref, const OFC_VOID *buf,
+                                   OFC_SIZET len);
+
+/**
+ * Receive through a reference.  Same results as ofc_socket_impl_recv.
+ */
+OFC_SIZET ofc_socket_impl_ref_recv(OFC_SOCKET_REF *ref, OFC_VOID *buf,
+                                   OFC_SIZET len);
+
+/**
+ * Return the socket's descriptor, or -1 once the socket is closed
+ */
+int ofc_socket_impl_ref_fd(OFC_SOCKET_REF *ref);
+
+/**
+ * Return the poll events the socket is waiting for, without locking
+ */
+OFC_UINT16 ofc_socket_impl_ref_get_event(OFC_SOCKET_REF *ref);
+
+/**
+ * Record the poll events that fired, without locking
+ */
+OFC_VOID ofc_socket_impl_ref_set_event(OFC_SOCKET_REF *ref,
+                                       OFC_UINT16 revents);
+
+/**
+ * Same as ofc_socket_impl_get_wait_time, through a reference
+ */
+OFC_MSTIME ofc_socket_impl_ref_wait_time(OFC_SOCKET_REF *ref);
+
+/**
+ * Return the bytes a socket is holding back for coalescing, without
+ * locking
+ *
+ * For the wait set, which flushes sockets that have some before it
+ * sleeps.
+ */
+OFC_SIZET ofc_socket_impl_ref_pending(OFC_SOCKET_REF *ref);
+
+/**
+ * Same as ofc_socket_impl_flush, through a reference
+ */
+OFC_BOOL ofc_socket_impl_ref_flush(OFC_SOCKET_REF *ref);
+
+/**
+ * Create a local (AF_UNIX) socket
+ *
+ * The handle works with the rest of the socket calls and the wait set.
+ * Addresses reported for it are IPv4 loopback, port 0.
+ *
+ * \param socktype
+ * SOCKET_TYPE_STREAM or SOCKET_TYPE_DGRAM
+ *
+ * \returns
+ * The socket handle or OFC_HANDLE_NULL
+ */
+OFC_HANDLE ofc_socket_impl_create_local(OFC_SOCKET_TYPE socktype);
+
+/**
+ * Create a pair of connected local sockets
+ *
+ * \param socktype
+ * SOCKET_TYPE_STREAM or SOCKET_TYPE_DGRAM
+ *
+ * \param hSockets
+ * Where to return the two handles
+ *
+ * \returns
+ * OFC_TRUE on success
+ */
+OFC_BOOL ofc_socket_impl_pair(OFC_SOCKET_TYPE socktype,
+                              OFC_HANDLE hSockets[2]);
+
+/**
+ * Bind a local socket to a path
+ *
+ * A socket file left at the path by an earlier run is removed first.
+ * Any other kind of file there makes the bind fail.
+ */
+OFC_BOOL ofc_socket_impl_bind_local(OFC_HANDLE hSocket, OFC_CCHAR *path);
+
+/**
+ * Connect a local socket to the socket bound at a path
+ */
+OFC_BOOL ofc_socket_impl_connect_local(OFC_HANDLE hSocket, OFC_CCHAR *path);
+
+/**
+ * Send a datagram on a local socket to the socket bound at a path
+ */
+OFC_SIZET ofc_socket_impl_sendto_local(OFC_HANDLE hSocket,
+                                       const OFC_VOID *buf, OFC_SIZET len,
+                                       OFC_CCHAR *path);
+
+/**
+ * Return the identity of the peer of a connected local socket
+ *
+ * Taken by the kernel when the connection was made, so it can't be
+ * forged by the peer.
+ *
+ * \returns
+ * OFC_TRUE if cred was filled in
+ */
+OFC_BOOL ofc_socket_impl_peer_cred(OFC_HANDLE hSocket,
+                                   OFC_SOCKET_PEER_CRED *cred);
+
+/**
+ * Send data and pass descriptors on a local socket
+ *
+ * The receiver gets its own copies of the descriptors.  On a stream
+ * socket at least one byte of data must go with them.
+ *
+ * \param hSocket
+ * Socket to send on
+ *
+ * \param buf
+ * Data to send
+ *
+ * \param len
+ * Length of the data
+ *
+ * \param fds
+ * Descriptors to pass
+ *
+ * \param nfds
+ * Number of descriptors, up to OFC_SOCKET_FDS_MAX
+ *
+ * \returns
+ * Bytes sent, 0 if the socket would block, -1 on error.  The descriptors
+ * went out if any bytes did.
+ */
+OFC_SIZET ofc_socket_impl_send_fds(OFC_HANDLE hSocket,
+                                   const OFC_VOID *buf, OFC_SIZET len,
+                                   const int *fds, OFC_INT nfds);
+
+/**
+ * Receive data and any descriptors passed with it on a local socket
+ *
+ * Descriptors received are close-on-exec and belong to the caller.
+ * Descriptors beyond the room in fds are closed.
+ *
+ * \param hSocket
+ * Socket to receive on
+ *
+ * \param buf
+ * Where to receive the data
+ *
+ * \param len
+ * Size of buf
+ *
+ * \param fds
+ * Where to return descriptors
+ *
+ * \param nfds
+ * Room in fds on entry, descriptors returned on exit
+ *
+ * \returns
+ * Bytes received, 0 if the socket would block, -1 on error
+ */
+OFC_SIZET ofc_socket_impl_recv_fds(OFC_HANDLE hSocket,
+                                   OFC_VOID *buf, OFC_SIZET len,
+                                   int *fds, OFC_INT *nfds);
+
+/**
+ * Create a socket for both IPv4 and IPv6
+ *
+ * One AF_INET6 socket with IPV6_V6ONLY off, so a single listener or
+ * datagram socket, and a single wait set entry, serves both families.
+ * IPv4 addresses are taken and returned as OFC_FAMILY_IP throughout;
+ * the mapping to ::ffff:a.b.c.d is internal.  Binding the IPv4 or IPv6
+ * wildcard listens on both.  IPv4 broadcast can't be sent through it;
+ * keep an IPv4 socket for discovery broadcasts.
+ *
+ * \param socktype
+ * SOCKET_TYPE_STREAM or SOCKET_TYPE_DGRAM
+ *
+ * \param profile
+ * Tuning profile, or OFC_NULL
+ *
+ * \returns
+ * The socket, or OFC_HANDLE_NULL if the system has no dual stack
+ */
+OFC_HANDLE ofc_socket_impl_create_dual(OFC_SOCKET_TYPE socktype,
+                                       const OFC_SOCKET_PROFILE *profile);
+
+/**
+ * Open a second handle on the same socket
+ *
+ * The new handle has its own descriptor, events and statistics but shares
+ * the underlying socket, so the socket stays open until every handle on
+ * it is destroyed.  Lets several wait sets watch one listener.
+ *
+ * \returns
+ * The new handle, or OFC_HANDLE_NULL
+ */
+OFC_HANDLE ofc_socket_impl_dup(OFC_HANDLE hSocket);
+
+/**
+ * Coalesce small sends on a stream socket
+ *
+ * Sends that fit in the buffer are held, and go out together in one
+ * system call when the buffer would overflow, on
+ * ofc_socket_impl_flush, or just before the wait set the socket is in
+ * goes to sleep.  Small responses written back to back then share a
+ * segment without waiting on Nagle.  A send that doesn't fit is written
+ * behind the held data with writev.  Other ways of sending on the socket
+ * flush first, and report nothing sent while held data is waiting for
+ * room.  Closing or destroying the socket waits up to the SO_LINGER time,
+ * or a second without it, for held data to go.  Data still held then is
+ * lost, counted as an error, and the close fails with ETIMEDOUT.
+ *
+ * \param hSocket
+ * Stream socket
+ *
+ * \param threshold
+ * Bytes to hold.  Zero turns coalescing off.
+ *
+ * \returns
+ * OFC_TRUE on success.  OFC_FALSE if held data couldn't be flushed
+ * first; try again once the socket is writable.
+ */
+OFC_BOOL ofc_socket_impl_coalesce(OFC_HANDLE hSocket, OFC_SIZET threshold);
+
+/**
+ * Send data held back for coalescing
+ *
+ * Data the kernel has no room for stays held, and the socket is polled
+ * for write until it has gone.  If a write failed and held data was
+ * lost, here or in the background, the flush fails with the write's
+ * error in errno until the next send reports it.
+ *
+ * \returns
+ * OFC_TRUE if nothing is held any longer
+ */
+OFC_BOOL ofc_socket_impl_flush(OFC_HANDLE hSocket);
+
+/**
+ * Half close a socket
+ *
+ * \param hSocket
+ * Connected socket
+ *
+ * \param how
+ * Direction to close
+ *
+ * \returns
+ * OFC_TRUE on success.  Closing for write fails with EAGAIN while
+ * coalesced data is waiting for room.
+ */
+OFC_BOOL ofc_socket_impl_shutdown(OFC_HANDLE hSocket,
+                                  OFC_SOCKET_SHUTDOWN how);
+
+/**
+ * Set how a close treats unsent data
+ *
+ * \param hSocket
+ * Socket to set
+ *
+ * \param onoff
+ * OFC_FALSE for the default: close returns at once and the kernel keeps
+ * sending in the background.  OFC_TRUE to linger.
+ *
+ * \param seconds
+ * With onoff, how long a close may wait for unsent data to go.  Zero
+ * discards it and resets the connection on close.
+ *
+ * \returns
+ * OFC_TRUE on success
+ */
+OFC_BOOL ofc_socket_impl_linger(OFC_HANDLE hSocket, OFC_BOOL onoff,
+                                OFC_INT seconds);
+
+/**
+ * Reset a connection and destroy the handle
+ *
+ * Unsent data is discarded and no TIME_WAIT state is left behind.  For
+ * peers known to be dead, where a graceful close would only wait.
+ */
+OFC_VOID ofc_socket_impl_abort(OFC_HANDLE hSocket);
+
+/**
+ * Start a graceful close
+ *
+ * Sends FIN behind any queued data and waits for the peer to close its
+ * side, discarding whatever it still sends.  The socket is made
+ * non-blocking and polled for read by the wait set.
+ * ofc_socket_impl_test reports OFC_SOCKET_EVENT_CLOSE once the peer has
+ * closed or the deadline has passed; a connection that runs out of time
+ * is set to reset when destroyed.  Destroy the handle after the event.
+ *
+ * \param hSocket
+ * Connected stream socket
+ *
+ * \param timeout
+ * Milliseconds to wait for the peer.  Zero waits indefinitely.
+ *
+ * \returns
+ * OFC_TRUE if the close was started.  Fails with EAGAIN while coalesced
+ * data is waiting for room.
+ */
+OFC_BOOL ofc_socket_impl_close_graceful(OFC_HANDLE hSocket,
+                                        OFC_MSTIME timeout);
+
+/**
+ * Return the progress of a graceful close
+ *
+ * A pending close is checked without blocking.
+ */
+OFC_SOCKET_DRAIN_STATE ofc_socket_impl_drain_state(OFC_HANDLE hSocket);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/** \} */
+
+#endif
@@ -0,0 +1,625 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/event.h"
+#include "ofc/libc.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/socket_darwin.h"
+#include "ofc_darwin/aio_darwin.h"
+
+/**
+ * \defgroup aio_darwin Darwin Overlapped Socket Engine
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+#define AIO_BUCKETS 256
+/*
+ * Poll slots added each time the engine runs out
+ */
+#define AIO_GROW 16
+
+/*
+ * Requests outstanding in one direction.  The queue is busy while a
+ * thread moves data for the request at its head with the lock dropped.
+ * Only that thread advances the queue, and a cancel meanwhile leaves its
+ * error for it to apply to that request.
+ */
+typedef struct {
+    OFC_AIO_REQUEST *head;
+    OFC_AIO_REQUEST *tail;
+    OFC_BOOL busy;
+    OFC_INT error;
+} AIO_QUEUE;
+
+/*
+ * A socket with requests outstanding.  Only the engine thread frees one
+ * it has polled, since it may be looking at it outside the lock.  One
+ * the engine hasn't picked up yet can be freed by whoever empties it.
+ */
+typedef struct _AIO_SOCKET {
+    OFC_SOCKET_REF *ref;
+    int fd;
+    OFC_BOOL polled;
+    AIO_QUEUE send;
+    AIO_QUEUE recv;
+    struct _AIO_SOCKET *hash_next;
+    struct _AIO_SOCKET *prev;
+    struct _AIO_SOCKET *next;
+} AIO_SOCKET;
+
+struct _OFC_AIO_ENGINE {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int wake[2];
+    OFC_BOOL woken;
+    OFC_BOOL shutdown;
+    AIO_SOCKET *buckets[AIO_BUCKETS];
+    AIO_SOCKET *active;
+    OFC_INT active_count;
+    /*
+     * Poll arrays, one slot for the wake pipe and one per active socket.
+     * The engine thread reads them outside the lock, so larger ones are
+     * allocated by the add that needs them, letting a failure fail the
+     * add, and left in grow_socks and grow_pfds for the engine to swap
+     * in.
+     */
+    AIO_SOCKET **socks;
+    struct pollfd *pfds;
+    OFC_INT cap;
+    AIO_SOCKET **grow_socks;
+    struct pollfd *grow_pfds;
+    OFC_INT grow_cap;
+    OFC_AIO_REQUEST *done_head;
+    OFC_AIO_REQUEST *done_tail;
+    OFC_HANDLE hEvent;
+};
+
+static OFC_INT aio_bucket(OFC_SOCKET_REF *ref) {
+    return ((OFC_INT) (((unsigned long) ref >> 4) % AIO_BUCKETS));
+}
+
+static AIO_SOCKET *aio_socket_find(OFC_AIO_ENGINE *engine,
+                                   OFC_SOCKET_REF *ref) {
+    AIO_SOCKET *as;
+
+    for (as = engine->buckets[aio_bucket(ref)];
+         as != OFC_NULL && as->ref != ref; as = as->hash_next);
+    return (as);
+}
+
+/*
+ * Make sure the poll arrays will have room for one more socket
+ */
+static OFC_BOOL aio_reserve(OFC_AIO_ENGINE *engine) {
+    AIO_SOCKET **socks;
+    struct pollfd *pfds;
+    OFC_INT need;
+    OFC_INT cap;
+    OFC_BOOL ret;
+
+    ret = OFC_TRUE;
+    need = engine->active_count + 2;
+    cap = engine->grow_socks != OFC_NULL ? engine->grow_cap : engine->cap;
+    if (need > cap) {
+        cap = need + AIO_GROW;
+        socks = ofc_malloc(sizeof(AIO_SOCKET *) * cap);
+        pfds = ofc_malloc(sizeof(struct pollfd) * cap);
+        if (socks == OFC_NULL || pfds == OFC_NULL) {
+            ofc_free(socks);
+            ofc_free(pfds);
+            ret = OFC_FALSE;
+        } else {
+            ofc_free(engine->grow_socks);
+            ofc_free(engine->grow_pfds);
+            engine->grow_socks = socks;
+            engine->grow_pfds = pfds;
+            engine->grow_cap = cap;
+        }
+    }
+    return (ret);
+}
+
+/*
+ * Track a socket, taking over the caller's reference to it
+ */
+static AIO_SOCKET *aio_socket_add(OFC_AIO_ENGINE *engine,
+                                  OFC_SOCKET_REF *ref) {
+    AIO_SOCKET *as;
+    OFC_INT bucket;
+    int flags;
+
+    as = OFC_NULL;
+    if (aio_reserve(engine))
+        as = ofc_malloc(sizeof(AIO_SOCKET));
+    if (as != OFC_NULL) {
+        as->ref = ref;
+        as->fd = ofc_socket_impl_ref_fd(ref);
+        as->polled = OFC_FALSE;
+        as->send.head = OFC_NULL;
+        as->send.tail = OFC_NULL;
+        as->send.busy = OFC_FALSE;
+        as->send.error = 0;
+        as->recv.head = OFC_NULL;
+        as->recv.tail = OFC_NULL;
+        as->recv.busy = OFC_FALSE;
+        as->recv.error = 0;
+
+        flags = fcntl(as->fd, F_GETFL);
+        if (flags >= 0 && !(flags & O_NONBLOCK))
+            fcntl(as->fd, F_SETFL, flags | O_NONBLOCK);
+
+        bucket = aio_bucket(ref);
+        as->hash_next = engine->buckets[bucket];
+        engine->buckets[bucket] = as;
+        as->prev = OFC_NULL;
+        as->next = engine->active;
+        if (engine->active != OFC_NULL)
+            engine->active->prev = as;
+        engine->active = as;
+        engine->active_count++;
+    }
+    return (as);
+}
+
+static OFC_VOID aio_socket_remove(OFC_AIO_ENGINE *engine, AIO_SOCKET *as) {
+    AIO_SOCKET **pp;
+
+    for (pp = &engine->buckets[aio_bucket(as->ref)]; *pp != as;
+         pp = &(*pp)->hash_next);
+    *pp = as->hash_next;
+
+    if (as->prev != OFC_NULL)
+        as->prev->next = as->next;
+    else
+        engine->active = as->next;
+    if (as->next != OFC_NULL)
+        as->next->prev = as->prev;
+    engine->active_count--;
+
+    ofc_socket_impl_ref_release(as->ref);
+    ofc_free(as);
+}
+
+static OFC_VOID aio_wake(OFC_AIO_ENGINE *engine) {
+    OFC_CHAR c;
+
+    if (!engine->woken) {
+        engine->woken = OFC_TRUE;
+        c = 0;
+        write(engine->wake[1], &c, 1);
+    }
+}
+
+/*
+ * Queue a finished request for collection.  Returns OFC_TRUE if the
+ * queue was empty, meaning the event needs setting.
+ */
+static OFC_BOOL aio_done(OFC_AIO_ENGINE *engine, OFC_AIO_REQUEST *request) {
+    OFC_BOOL ret;
+
+    ret = (engine->done_head == OFC_NULL);
+    request->next = OFC_NULL;
+    if (engine->done_tail != OFC_NULL)
+        engine->done_tail->next = request;
+    else
+        engine->done_head = request;
+    engine->done_tail = request;
+    return (ret);
+}
+
+/*
+ * Move as much of a request as the socket will take.  readable says the
+ * socket polled readable and nothing has been read from it since, so a
+ * receive of nothing is end of stream rather than an empty buffer.
+ *
+ * Returns OFC_TRUE once the request is finished.
+ */
+static OFC_BOOL aio_attempt(OFC_AIO_REQUEST *request, OFC_BOOL *readable) {
+    OFC_SIZET want;
+    OFC_SIZET n;
+    OFC_BOOL ret;
+
+    want = request->len;
+    if (request->op == OFC_AIO_RECV && request->min != 0 &&
+        request->min < request->len)
+        want = request->min;
+
+    ret = OFC_FALSE;
+    while (!ret && request->done < want) {
+        if (request->op == OFC_AIO_SEND)
+            n = ofc_socket_impl_ref_send(request->ref,
+                                         (OFC_CHAR *) request->buf +
+                                         request->done,
+                                         request->len - request->done);
+        else
+            n = ofc_socket_impl_ref_recv(request->ref,
+                                         (OFC_CHAR *) request->buf +
+                                         request->done,
+                                         request->len - request->done);
+        if (n == (OFC_SIZET) -1) {
+            request->error = errno;
+            ret = OFC_TRUE;
+        } else if (n == 0) {
+            if (request->op == OFC_AIO_RECV && *readable)
+                ret = OFC_TRUE;
+            break;
+        } else {
+            request->done += n;
+            if (request->op == OFC_AIO_RECV)
+                *readable = OFC_FALSE;
+        }
+    }
+    if (request->done >= want)
+        ret = OFC_TRUE;
+    return (ret);
+}
+
+/*
+ * Run the requests at the head of a queue until one has to wait.  Called
+ * with the lock held.  The lock is dropped around the I/O with the queue
+ * marked busy, so other sockets and posts aren't held up behind it.
+ * Returns OFC_TRUE if the event needs setting.
+ */
+static OFC_BOOL aio_run(OFC_AIO_ENGINE *engine, AIO_QUEUE *queue,
+                        OFC_BOOL readable) {
+    OFC_AIO_REQUEST *request;
+    OFC_BOOL ret;
+    OFC_BOOL finished;
+
+    ret = OFC_FALSE;
+    if (!queue->busy) {
+        queue->busy = OFC_TRUE;
+        finished = OFC_TRUE;
+        while (queue->head != OFC_NULL && finished) {
+            request = queue->head;
+            pthread_mutex_unlock(&engine->mutex);
+            finished = aio_attempt(request, &readable);
+            pthread_mutex_lock(&engine->mutex);
+            if (!finished && queue->error != 0) {
+                request->error = queue->error;
+                finished = OFC_TRUE;
+            }
+            if (finished) {
+                queue->error = 0;
+                queue->head = request->next;
+                if (queue->head == OFC_NULL)
+                    queue->tail = OFC_NULL;
+                if (aio_done(engine, request))
+                    ret = OFC_TRUE;
+            }
+        }
+        queue->busy = OFC_FALSE;
+    }
+    return (ret);
+}
+
+/*
+ * Fail the requests in a queue.  A request being run is left to the
+ * thread running it, which fails it if it doesn't finish.  Returns
+ * OFC_TRUE if the event needs setting.
+ */
+static OFC_BOOL aio_fail(OFC_AIO_ENGINE *engine, AIO_QUEUE *queue,
+                         OFC_INT error) {
+    OFC_AIO_REQUEST *request;
+    OFC_AIO_REQUEST *keep;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    keep = OFC_NULL;
+    if (queue->busy) {
+        keep = queue->head;
+        queue->head = keep->next;
+        queue->error = error;
+    }
+    while (queue->head != OFC_NULL) {
+        request = queue->head;
+        queue->head = request->next;
+        request->error = error;
+        if (aio_done(engine, request))
+            ret = OFC_TRUE;
+    }
+    if (keep != OFC_NULL)
+        keep->next = OFC_NULL;
+    queue->head = keep;
+    queue->tail = keep;
+    return (ret);
+}
+
+static void *aio_engine(void *arg) {
+    OFC_AIO_ENGINE *engine;
+    AIO_SOCKET *as;
+    AIO_SOCKET *next;
+    AIO_SOCKET **socks;
+    struct pollfd *pfds;
+    OFC_INT count;
+    OFC_INT i;
+    OFC_BOOL signal;
+    OFC_UINT16 revents;
+    OFC_UINT16 events;
+    OFC_CHAR drain[64];
+
+    engine = arg;
+
+    pthread_mutex_lock(&engine->mutex);
+    while (!engine->shutdown) {
+        /*
+         * Drop sockets with nothing outstanding, then poll the rest for
+         * the directions that have requests queued and aren't being run
+         * by a post
+         */
+        for (as = engine->active; as != OFC_NULL; as = next) {
+            next = as->next;
+            if (as->send.head == OFC_NULL && as->recv.head == OFC_NULL)
+                aio_socket_remove(engine, as);
+        }
+
+        if (engine->grow_socks != OFC_NULL) {
+            ofc_free(engine->socks);
+            ofc_free(engine->pfds);
+            engine->socks = engine->grow_socks;
+            engine->pfds = engine->grow_pfds;
+            engine->cap = engine->grow_cap;
+            engine->grow_socks = OFC_NULL;
+            engine->grow_pfds = OFC_NULL;
+        }
+        socks = engine->socks;
+        pfds = engine->pfds;
+
+        count = 0;
+        pfds[count].fd = engine->wake[0];
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+        socks[count++] = OFC_NULL;
+        for (as = engine->active; as != OFC_NULL; as = as->next) {
+            events = 0;
+            if (as->send.head != OFC_NULL && !as->send.busy)
+                events |= POLLOUT;
+            if (as->recv.head != OFC_NULL && !as->recv.busy)
+                events |= POLLIN;
+            if (events != 0) {
+                as->polled = OFC_TRUE;
+                pfds[count].fd = as->fd;
+                pfds[count].events = events;
+                pfds[count].revents = 0;
+                socks[count++] = as;
+            }
+        }
+        engine->woken = OFC_FALSE;
+        pthread_mutex_unlock(&engine->mutex);
+
+        poll(pfds, count, -1);
+
+        pthread_mutex_lock(&engine->mutex);
+        if (pfds[0].revents & POLLIN)
+            while (read(engine->wake[0], drain, sizeof(drain)) > 0);
+
+        signal = OFC_FALSE;
+        for (i = 1; i < count; i++) {
+            revents = pfds[i].revents;
+            if (revents == 0)
+                continue;
+            as = socks[i];
+            if (revents & POLLNVAL) {
+                if (aio_fail(engine, &as->send, EBADF))
+                    signal = OFC_TRUE;
+                if (aio_fail(engine, &as->recv, EBADF))
+                    signal = OFC_TRUE;
+            } else {
+                if (revents & (POLLOUT | POLLERR | POLLHUP))
+                    if (aio_run(engine, &as->send, OFC_FALSE))
+                        signal = OFC_TRUE;
+                if (revents & (POLLIN | POLLERR | POLLHUP))
+                    if (aio_run(engine, &as->recv, OFC_TRUE))
+                        signal = OFC_TRUE;
+            }
+        }
+        if (signal)
+            ofc_event_set(engine->hEvent);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+
+    return (OFC_NULL);
+}
+
+OFC_AIO_ENGINE *ofc_aio_impl_create(OFC_VOID) {
+    OFC_AIO_ENGINE *engine;
+    OFC_INT i;
+
+    engine = ofc_malloc(sizeof(OFC_AIO_ENGINE));
+    if (engine != OFC_NULL) {
+        engine->woken = OFC_FALSE;
+        engine->shutdown = OFC_FALSE;
+        for (i = 0; i < AIO_BUCKETS; i++)
+            engine->buckets[i] = OFC_NULL;
+        engine->active = OFC_NULL;
+        engine->active_count = 0;
+        engine->done_head = OFC_NULL;
+        engine->done_tail = OFC_NULL;
+        engine->cap = 1 + AIO_GROW;
+        engine->socks = ofc_malloc(sizeof(AIO_SOCKET *) * engine->cap);
+        engine->pfds = ofc_malloc(sizeof(struct pollfd) * engine->cap);
+        engine->grow_socks = OFC_NULL;
+        engine->grow_pfds = OFC_NULL;
+        engine->grow_cap = 0;
+        pthread_mutex_init(&engine->mutex, NULL);
+
+        engine->hEvent = OFC_HANDLE_NULL;
+        if (engine->socks != OFC_NULL && engine->pfds != OFC_NULL)
+            engine->hEvent = ofc_event_create(OFC_EVENT_AUTO);
+        if (engine->hEvent == OFC_HANDLE_NULL) {
+            pthread_mutex_destroy(&engine->mutex);
+            ofc_free(engine->socks);
+            ofc_free(engine->pfds);
+            ofc_free(engine);
+            engine = OFC_NULL;
+        } else if (pipe(engine->wake) != 0) {
+            ofc_event_destroy(engine->hEvent);
+            pthread_mutex_destroy(&engine->mutex);
+            ofc_free(engine->socks);
+            ofc_free(engine->pfds);
+            ofc_free(engine);
+            engine = OFC_NULL;
+        } else {
+            fcntl(engine->wake[0], F_SETFL,
+                  fcntl(engine->wake[0], F_GETFL) | O_NONBLOCK);
+            fcntl(engine->wake[1], F_SETFL,
+                  fcntl(engine->wake[1], F_GETFL) | O_NONBLOCK);
+            if (pthread_create(&engine->thread, NULL, aio_engine,
+                               engine) != 0) {
+                close(engine->wake[0]);
+                close(engine->wake[1]);
+                ofc_event_destroy(engine->hEvent);
+                pthread_mutex_destroy(&engine->mutex);
+                ofc_free(engine->socks);
+                ofc_free(engine->pfds);
+                ofc_free(engine);
+                engine = OFC_NULL;
+            }
+        }
+    }
+    return (engine);
+}
+
+OFC_VOID ofc_aio_impl_destroy(OFC_AIO_ENGINE *engine) {
+    if (engine != OFC_NULL) {
+        pthread_mutex_lock(&engine->mutex);
+        engine->shutdown = OFC_TRUE;
+        aio_wake(engine);
+        pthread_mutex_unlock(&engine->mutex);
+        pthread_join(engine->thread, OFC_NULL);
+
+        while (engine->active != OFC_NULL)
+            aio_socket_remove(engine, engine->active);
+
+        close(engine->wake[0]);
+        close(engine->wake[1]);
+        ofc_event_destroy(engine->hEvent);
+        pthread_mutex_destroy(&engine->mutex);
+        ofc_free(engine->socks);
+        ofc_free(engine->pfds);
+        ofc_free(engine->grow_socks);
+        ofc_free(engine->grow_pfds);
+        ofc_free(engine);
+    }
+}
+
+OFC_HANDLE ofc_aio_impl_event(OFC_AIO_ENGINE *engine) {
+    return (engine->hEvent);
+}
+
+OFC_BOOL ofc_aio_impl_post(OFC_AIO_ENGINE *engine, OFC_HANDLE hSocket,
+                           OFC_AIO_REQUEST *request) {
+    OFC_SOCKET_REF *ref;
+    AIO_SOCKET *as;
+    AIO_QUEUE *queue;
+    OFC_BOOL signal;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    ref = ofc_socket_impl_ref(hSocket);
+    if (ref != OFC_NULL) {
+        pthread_mutex_lock(&engine->mutex);
+        as = aio_socket_find(engine, ref);
+        if (as != OFC_NULL)
+            ofc_socket_impl_ref_release(ref);
+        else {
+            as = aio_socket_add(engine, ref);
+            if (as == OFC_NULL)
+                ofc_socket_impl_ref_release(ref);
+        }
+
+        if (as != OFC_NULL) {
+            request->ref = as->ref;
+            request->done = 0;
+            request->error = 0;
+            request->next = OFC_NULL;
+
+            queue = request->op == OFC_AIO_SEND ? &as->send : &as->recv;
+
+            signal = OFC_FALSE;
+            if (queue->head == OFC_NULL) {
+                /*
+                 * Nothing ahead of it.  Try it now, and only involve the
+                 * engine if the socket isn't ready.
+                 */
+                queue->head = request;
+                queue->tail = request;
+                signal = aio_run(engine, queue, OFC_FALSE);
+                if (queue->head != OFC_NULL)
+                    aio_wake(engine);
+            } else {
+                queue->tail->next = request;
+                queue->tail = request;
+            }
+
+            if (as->send.head == OFC_NULL && as->recv.head == OFC_NULL &&
+                !as->polled)
+                aio_socket_remove(engine, as);
+            if (signal)
+                ofc_event_set(engine->hEvent);
+            ret = OFC_TRUE;
+        }
+        pthread_mutex_unlock(&engine->mutex);
+    }
+    return (ret);
+}
+
+OFC_VOID ofc_aio_impl_cancel(OFC_AIO_ENGINE *engine, OFC_HANDLE hSocket) {
+    OFC_SOCKET_REF *ref;
+    AIO_SOCKET *as;
+    OFC_BOOL signal;
+
+    ref = ofc_socket_impl_ref(hSocket);
+    if (ref != OFC_NULL) {
+        pthread_mutex_lock(&engine->mutex);
+        as = aio_socket_find(engine, ref);
+        if (as != OFC_NULL) {
+            signal = aio_fail(engine, &as->send, ECANCELED);
+            if (aio_fail(engine, &as->recv, ECANCELED))
+                signal = OFC_TRUE;
+            if (!as->polled && as->send.head == OFC_NULL &&
+                as->recv.head == OFC_NULL)
+                aio_socket_remove(engine, as);
+            else
+                aio_wake(engine);
+            if (signal)
+                ofc_event_set(engine->hEvent);
+        }
+        pthread_mutex_unlock(&engine->mutex);
+        ofc_socket_impl_ref_release(ref);
+    }
+}
+
+OFC_INT ofc_aio_impl_complete(OFC_AIO_ENGINE *engine,
+                              OFC_AIO_REQUEST **requests, OFC_INT max) {
+    OFC_INT count;
+
+    count = 0;
+    pthread_mutex_lock(&engine->mutex);
+    while (count < max && engine->done_head != OFC_NULL) {
+        requests[count++] = engine->done_head;
+        engine->done_head = engine->done_head->next;
+    }
+    if (engine->done_head == OFC_NULL)
+        engine->done_tail = OFC_NULL;
+    else
+        ofc_event_set(engine->hEvent);
+    pthread_mutex_unlock(&engine->mutex);
+    return (count);
+}
+
+/** \} */
@@ -0,0 +1,391 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <pthread.h>
+#include <poll.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/libc.h"
+#include "ofc/net.h"
+#include "ofc/socket.h"
+#include "ofc/impl/socketimpl.h"
+#include "ofc/time.h"
+
+#include "ofc_darwin/socket_darwin.h"
+#include "ofc_darwin/connect_darwin.h"
+#include "ofc_darwin/probe_darwin.h"
+
+/**
+ * \defgroup connect_darwin Darwin Parallel Connect
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+/*
+ * Shortest stagger between attempts.  RFC 8305 advises against going
+ * below 100ms even when the history says the peer is close.
+ */
+#define CONNECT_ATTEMPT_DELAY_MIN 100
+#define CONNECT_LATENCY_SLOTS 64
+/*
+ * Sort key of an address we know nothing about, and the penalty added
+ * for each consecutive failure
+ */
+#define CONNECT_KEY_UNKNOWN 10000
+#define CONNECT_KEY_FAILURE 30000
+
+typedef struct {
+    OFC_BOOL valid;
+    OFC_IPADDR ip;
+    OFC_BOOL connected;         /* srtt holds at least one sample */
+    OFC_MSTIME srtt;
+    OFC_UINT32 failures;        /* since the last success */
+    OFC_MSTIME last_used;
+} CONNECT_LATENCY;
+
+typedef struct {
+    OFC_INT index;              /* position in the caller's list */
+    OFC_HANDLE hSocket;
+    OFC_MSTIME started;
+} CONNECT_ATTEMPT;
+
+static pthread_mutex_t connect_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CONNECT_LATENCY connect_latency[CONNECT_LATENCY_SLOTS];
+static OFC_FAMILY_TYPE connect_preferred = OFC_FAMILY_IPV6;
+
+/*
+ * Find the slot for an address.  With create, an unused or the least
+ * recently used slot is taken over.  Called with connect_mutex held.
+ */
+static CONNECT_LATENCY *connect_lookup(const OFC_IPADDR *ip,
+                                       OFC_BOOL create) {
+    CONNECT_LATENCY *entry;
+    CONNECT_LATENCY *victim;
+    OFC_INT i;
+
+    entry = OFC_NULL;
+    victim = OFC_NULL;
+    for (i = 0; i < CONNECT_LATENCY_SLOTS && entry == OFC_NULL; i++) {
+        if (connect_latency[i].valid) {
+            if (ofc_socket_impl_ip_equal(&connect_latency[i].ip, ip,
+                                         OFC_TRUE))
+                entry = &connect_latency[i];
+            else if (victim == OFC_NULL ||
+                     (victim->valid &&
+                      (OFC_INT) (connect_latency[i].last_used -
+                                 victim->last_used) < 0))
+                victim = &connect_latency[i];
+        } else if (victim == OFC_NULL || victim->valid)
+            victim = &connect_latency[i];
+    }
+
+    if (entry == OFC_NULL && create) {
+        entry = victim;
+        entry->valid = OFC_TRUE;
+        entry->ip = *ip;
+        entry->connected = OFC_FALSE;
+        entry->srtt = 0;
+        entry->failures = 0;
+    }
+    return (entry);
+}
+
+static OFC_VOID connect_record(const OFC_IPADDR *ip, OFC_BOOL success,
+                               OFC_MSTIME elapsed) {
+    CONNECT_LATENCY *entry;
+
+    pthread_mutex_lock(&connect_mutex);
+    entry = connect_lookup(ip, OFC_TRUE);
+    entry->last_used = ofc_time_get_now();
+    if (success) {
+        /*
+         * Same smoothing as TCP's srtt, gain of 1/8
+         */
+        if (entry->connected)
+            entry->srtt = (7 * entry->srtt + elapsed) / 8;
+        else
+            entry->srtt = elapsed;
+        entry->connected = OFC_TRUE;
+        entry->failures = 0;
+        connect_preferred = ip->ip_version;
+    } else
+        entry->failures++;
+    pthread_mutex_unlock(&connect_mutex);
+}
+
+/*
+ * Order the attempts.  Each family is sorted by remembered latency, then
+ * the families are interleaved starting with the preferred one.  Addresses
+ * the probe engines say are down go last.  Returns the number that
+ * aren't.
+ */
+static OFC_INT connect_order(const OFC_IPADDR *addrs, OFC_INT count,
+                             OFC_INT *order, OFC_MSTIME *srtt) {
+    OFC_INT keys[OFC_CONNECT_MAX_ADDRS];
+    OFC_INT first[OFC_CONNECT_MAX_ADDRS];
+    OFC_INT second[OFC_CONNECT_MAX_ADDRS];
+    OFC_INT down[OFC_CONNECT_MAX_ADDRS];
+    OFC_INT nfirst;
+    OFC_INT nsecond;
+    OFC_INT ndown;
+    OFC_INT usable;
+    OFC_INT *list;
+    OFC_INT *nlist;
+    OFC_INT *lead;
+    OFC_INT *follow;
+    OFC_INT nlead;
+    OFC_INT nfollow;
+    OFC_INT i;
+    OFC_INT j;
+    OFC_INT k;
+    OFC_FAMILY_TYPE preferred;
+    CONNECT_LATENCY *entry;
+
+    pthread_mutex_lock(&connect_mutex);
+    preferred = connect_preferred;
+    for (i = 0; i < count; i++) {
+        entry = connect_lookup(&addrs[i], OFC_FALSE);
+        srtt[i] = 0;
+        keys[i] = CONNECT_KEY_UNKNOWN;
+        if (entry != OFC_NULL) {
+            if (entry->connected) {
+                srtt[i] = entry->srtt;
+                keys[i] = entry->srtt;
+            }
+            keys[i] += entry->failures * CONNECT_KEY_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&connect_mutex);
+
+    nfirst = 0;
+    nsecond = 0;
+    ndown = 0;
+    for (i = 0; i < count; i++) {
+        if (ofc_probe_impl_state(&addrs[i]) == OFC_PROBE_DOWN) {
+            down[ndown++] = i;
+            continue;
+        }
+        if (addrs[i].ip_version == preferred) {
+            list = first;
+            nlist = &nfirst;
+        } else {
+            list = second;
+            nlist = &nsecond;
+        }
+        /*
+         * Insertion sort, stable so resolver order breaks ties
+         */
+        for (j = (*nlist)++; j > 0 && keys[list[j - 1]] > keys[i]; j--)
+            list[j] = list[j - 1];
+        list[j] = i;
+    }
+
+    /*
+     * If the other family has the single fastest address, let it lead
+     */
+    lead = first;
+    nlead = nfirst;
+    follow = second;
+    nfollow = nsecond;
+    if (nfirst > 0 && nsecond > 0 &&
+        keys[second[0]] + CONNECT_ATTEMPT_DELAY_MIN < keys[first[0]]) {
+        lead = second;
+        nlead = nsecond;
+        follow = first;
+        nfollow = nfirst;
+    }
+
+    k = 0;
+    for (i = 0, j = 0; i < nlead || j < nfollow;) {
+        if (i < nlead)
+            order[k++] = lead[i++];
+        if (j < nfollow)
+            order[k++] = follow[j++];
+    }
+
+    usable = k;
+    for (i = 0; i < ndown; i++)
+        order[k++] = down[i];
+    return (usable);
+}
+
+static OFC_MSTIME connect_delay(OFC_MSTIME srtt) {
+    OFC_MSTIME delay;
+
+    delay = OFC_CONNECT_ATTEMPT_DELAY;
+    if (srtt != 0) {
+        delay = 2 * srtt;
+        if (delay < CONNECT_ATTEMPT_DELAY_MIN)
+            delay = CONNECT_ATTEMPT_DELAY_MIN;
+        else if (delay > OFC_CONNECT_ATTEMPT_DELAY)
+            delay = OFC_CONNECT_ATTEMPT_DELAY;
+    }
+    return (delay);
+}
+
+OFC_HANDLE ofc_connect_impl_race(const OFC_IPADDR *addrs, OFC_INT count,
+                                 OFC_UINT16 port,
+                                 const OFC_SOCKET_PROFILE *profile,
+                                 OFC_MSTIME timeout, OFC_INT *index) {
+    OFC_INT order[OFC_CONNECT_MAX_ADDRS];
+    OFC_MSTIME srtt[OFC_CONNECT_MAX_ADDRS];
+    CONNECT_ATTEMPT attempts[OFC_CONNECT_MAX_ADDRS];
+    struct pollfd pfds[OFC_CONNECT_MAX_ADDRS];
+    OFC_INT active;
+    OFC_INT next;
+    OFC_INT usable;
+    OFC_INT i;
+    OFC_INT wait;
+    OFC_INT remaining;
+    OFC_MSTIME now;
+    OFC_MSTIME next_start;
+    OFC_MSTIME deadline;
+    OFC_HANDLE hSocket;
+    OFC_HANDLE hWinner;
+    OFC_INT winner;
+    OFC_SOCKET_CONNECT_STATE state;
+    OFC_BOOL expired;
+
+    if (count > OFC_CONNECT_MAX_ADDRS)
+        count = OFC_CONNECT_MAX_ADDRS;
+
+    /*
+     * Leave out addresses known to be down, unless that's all of them:
+     * the probes could be wrong and trying costs no more than failing
+     */
+    usable = connect_order(addrs, count, order, srtt);
+    if (usable > 0)
+        count = usable;
+
+    hWinner = OFC_HANDLE_NULL;
+    winner = -1;
+    active = 0;
+    next = 0;
+    expired = OFC_FALSE;
+    now = ofc_time_get_now();
+    next_start = now;
+    deadline = now + timeout;
+
+    while (hWinner == OFC_HANDLE_NULL && !expired &&
+           (active > 0 || next < count)) {
+        now = ofc_time_get_now();
+        if (next < count &&
+            (active == 0 || (OFC_INT) (next_start - now) <= 0)) {
+            i = order[next++];
+            hSocket = ofc_socket_impl_create_profile(addrs[i].ip_version,
+                                                     SOCKET_TYPE_STREAM,
+                                                     profile);
+            if (hSocket == OFC_HANDLE_NULL)
+                continue;
+            if (!ofc_socket_impl_connect_async(hSocket, &addrs[i], port, 0)) {
+                /*
+                 * Refused or unreachable straight away.  Move on without
+                 * waiting out the stagger.
+                 */
+                connect_record(&addrs[i], OFC_FALSE, 0);
+                ofc_socket_impl_destroy(hSocket);
+                continue;
+            }
+            attempts[active].index = i;
+            attempts[active].hSocket = hSocket;
+            attempts[active].started = now;
+            active++;
+            next_start = now + connect_delay(srtt[i]);
+        }
+
+        /*
+         * Sleep until an attempt resolves, it's time for the next one,
+         * or the race is over
+         */
+        wait = -1;
+        if (next < count) {
+            remaining = (OFC_INT) (next_start - now);
+            wait = remaining > 0 ? remaining : 0;
+        }
+        if (timeout != 0) {
+            remaining = (OFC_INT) (deadline - now);
+            if (remaining < 0)
+                remaining = 0;
+            if (wait < 0 || remaining < wait)
+                wait = remaining;
+        }
+
+        for (i = 0; i < active; i++) {
+            pfds[i].fd = ofc_socket_impl_get_fd(attempts[i].hSocket);
+            pfds[i].events = POLLOUT;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, active, wait) > 0) {
+            now = ofc_time_get_now();
+            for (i = 0; i < active && hWinner == OFC_HANDLE_NULL;) {
+                state = OFC_SOCKET_CONNECT_PENDING;
+                if (pfds[i].revents != 0)
+                    state = ofc_socket_impl_connect_state
+                            (attempts[i].hSocket, OFC_NULL);
+                if (state == OFC_SOCKET_CONNECT_DONE) {
+                    hWinner = attempts[i].hSocket;
+                    winner = attempts[i].index;
+                    connect_record(&addrs[winner], OFC_TRUE,
+                                   now - attempts[i].started);
+                    attempts[i] = attempts[--active];
+                } else if (state == OFC_SOCKET_CONNECT_PENDING)
+                    i++;
+                else {
+                    connect_record(&addrs[attempts[i].index], OFC_FALSE, 0);
+                    ofc_socket_impl_destroy(attempts[i].hSocket);
+                    attempts[i] = attempts[--active];
+                    pfds[i] = pfds[active];
+                }
+            }
+        }
+
+        if (timeout != 0 &&
+            (OFC_INT) (deadline - ofc_time_get_now()) <= 0)
+            expired = OFC_TRUE;
+    }
+
+    /*
+     * Close the losers.  Ones still pending at the deadline count against
+     * their address.  Ones merely beaten by the winner do not.
+     */
+    for (i = 0; i < active; i++) {
+        if (hWinner == OFC_HANDLE_NULL)
+            connect_record(&addrs[attempts[i].index], OFC_FALSE, 0);
+        ofc_socket_impl_destroy(attempts[i].hSocket);
+    }
+
+    if (index != OFC_NULL)
+        *index = winner;
+    return (hWinner);
+}
+
+OFC_BOOL ofc_connect_impl_latency(const OFC_IPADDR *ip, OFC_MSTIME *srtt) {
+    CONNECT_LATENCY *entry;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    pthread_mutex_lock(&connect_mutex);
+    entry = connect_lookup(ip, OFC_FALSE);
+    if (entry != OFC_NULL && entry->connected) {
+        if (srtt != OFC_NULL)
+            *srtt = entry->srtt;
+        ret = OFC_TRUE;
+    }
+    pthread_mutex_unlock(&connect_mutex);
+    return (ret);
+}
+
+OFC_FAMILY_TYPE ofc_connect_impl_preferred_family(OFC_VOID) {
+    OFC_FAMILY_TYPE ret;
+
+    pthread_mutex_lock(&connect_mutex);
+    ret = connect_preferred;
+    pthread_mutex_unlock(&connect_mutex);
+    return (ret);
+}
+
+/** \} */
@@ -0,0 +1,412 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/event.h"
+#include "ofc/libc.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/executor_darwin.h"
+
+/**
+ * \defgroup executor_darwin Darwin Work Stealing Task Executor
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+#define EXECUTOR_DEQUE_INITIAL 64
+#define EXECUTOR_MAX_WORKERS 256
+/*
+ * How long a worker sleeps when tasks are queued but every steal failed,
+ * in microseconds
+ */
+#define EXECUTOR_BACKOFF 1000
+
+typedef struct {
+    OFC_EXECUTOR_TASK *task;
+    OFC_VOID *context;
+    OFC_HANDLE hEvent;
+} EXECUTOR_ITEM;
+
+/*
+ * Each worker owns a ring buffer deque.  The owner pushes and pops at
+ * the bottom, thieves take from the top.  The deque is protected by its
+ * own mutex so contention is limited to a worker and whoever is
+ * stealing from it at the time.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    EXECUTOR_ITEM *items;
+    OFC_UINT32 capacity;
+    OFC_UINT32 top;
+    OFC_UINT32 bottom;
+} EXECUTOR_DEQUE;
+
+typedef struct {
+    pthread_t thread;
+    OFC_EXECUTOR *executor;
+    OFC_INT index;
+    OFC_UINT32 seed;
+    EXECUTOR_DEQUE deque;
+} EXECUTOR_WORKER;
+
+struct _OFC_EXECUTOR {
+    OFC_INT num_workers;
+    EXECUTOR_WORKER *workers;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+    volatile OFC_INT pending;
+    volatile OFC_UINT32 next;
+    OFC_BOOL shutdown;
+};
+
+/*
+ * The worker running on this thread, if any.  Tasks that submit further
+ * tasks push onto their own deque rather than someone else's.
+ */
+static __thread EXECUTOR_WORKER *executor_current_worker = OFC_NULL;
+
+static OFC_BOOL deque_init(EXECUTOR_DEQUE *deque) {
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    deque->capacity = EXECUTOR_DEQUE_INITIAL;
+    deque->items = ofc_malloc(sizeof(EXECUTOR_ITEM) * deque->capacity);
+    deque->top = 0;
+    deque->bottom = 0;
+    if (deque->items != OFC_NULL) {
+        pthread_mutex_init(&deque->mutex, NULL);
+        ret = OFC_TRUE;
+    }
+    return (ret);
+}
+
+static OFC_VOID deque_destroy(EXECUTOR_DEQUE *deque) {
+    ofc_free(deque->items);
+    pthread_mutex_destroy(&deque->mutex);
+}
+
+static OFC_BOOL deque_push(EXECUTOR_DEQUE *deque, EXECUTOR_ITEM *item) {
+    EXECUTOR_ITEM *items;
+    OFC_UINT32 count;
+    OFC_UINT32 i;
+    OFC_BOOL ret;
+
+    ret = OFC_TRUE;
+    pthread_mutex_lock(&deque->mutex);
+    count = deque->bottom - deque->top;
+    if (count == deque->capacity) {
+        /*
+         * Full.  Unwrap into a buffer twice the size
+         */
+        items = ofc_malloc(sizeof(EXECUTOR_ITEM) * deque->capacity * 2);
+        if (items == OFC_NULL)
+            ret = OFC_FALSE;
+        else {
+            for (i = 0; i < count; i++)
+                items[i] = deque->items[(deque->top + i) &
+                                        (deque->capacity - 1)];
+            ofc_free(deque->items);
+            deque->items = items;
+            deque->capacity *= 2;
+            deque->top = 0;
+            deque->bottom = count;
+        }
+    }
+    if (ret == OFC_TRUE) {
+        deque->items[deque->bottom & (deque->capacity - 1)] = *item;
+        deque->bottom++;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return (ret);
+}
+
+static OFC_BOOL deque_pop(EXECUTOR_DEQUE *deque, EXECUTOR_ITEM *item) {
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom != deque->top) {
+        deque->bottom--;
+        *item = deque->items[deque->bottom & (deque->capacity - 1)];
+        ret = OFC_TRUE;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return (ret);
+}
+
+static OFC_BOOL deque_steal(EXECUTOR_DEQUE *deque, EXECUTOR_ITEM *item) {
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    /*
+     * Don't queue up behind the owner or another thief.  If the deque is
+     * busy, move on to the next victim
+     */
+    if (pthread_mutex_trylock(&deque->mutex) == 0) {
+        if (deque->bottom != deque->top) {
+            *item = deque->items[deque->top & (deque->capacity - 1)];
+            deque->top++;
+            ret = OFC_TRUE;
+        }
+        pthread_mutex_unlock(&deque->mutex);
+    }
+    return (ret);
+}
+
+static OFC_BOOL executor_take(EXECUTOR_WORKER *worker, EXECUTOR_ITEM *item) {
+    OFC_EXECUTOR *executor;
+    OFC_INT start;
+    OFC_INT i;
+    OFC_BOOL ret;
+
+    executor = worker->executor;
+    ret = deque_pop(&worker->deque, item);
+    if (ret == OFC_FALSE && executor->num_workers > 1) {
+        /*
+         * Pick a pseudo random victim to start from so thieves
+         * don't all converge on worker zero
+         */
+        worker->seed = worker->seed * 1103515245 + 12345;
+        start = (OFC_INT) ((worker->seed >> 16) % executor->num_workers);
+        for (i = 0; i < executor->num_workers && ret == OFC_FALSE; i++) {
+            EXECUTOR_WORKER *victim;
+
+            victim = &executor->workers[(start + i) % executor->num_workers];
+            if (victim != worker)
+                ret = deque_steal(&victim->deque, item);
+        }
+    }
+    if (ret == OFC_TRUE)
+        __atomic_sub_fetch(&executor->pending, 1, __ATOMIC_SEQ_CST);
+    return (ret);
+}
+
+static void *executor_worker(void *arg) {
+    EXECUTOR_WORKER *worker;
+    OFC_EXECUTOR *executor;
+    EXECUTOR_ITEM item;
+    OFC_BOOL done;
+    struct timeval now;
+    struct timespec until;
+
+    worker = arg;
+    executor = worker->executor;
+    executor_current_worker = worker;
+
+    done = OFC_FALSE;
+    while (!done) {
+        if (executor_take(worker, &item)) {
+            (item.task)(item.context);
+            if (item.hEvent != OFC_HANDLE_NULL)
+                ofc_event_set(item.hEvent);
+        } else {
+            pthread_mutex_lock(&executor->idle_mutex);
+            if (__atomic_load_n(&executor->pending, __ATOMIC_SEQ_CST) != 0 &&
+                !executor->shutdown) {
+                /*
+                 * Tasks are queued but every deque holding one was busy,
+                 * or a task is between being counted and being pushed.
+                 * Back off rather than spin.  The push signals us, and the
+                 * timeout covers a deque that was only busy.
+                 */
+                gettimeofday(&now, NULL);
+                now.tv_usec += EXECUTOR_BACKOFF;
+                until.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+                until.tv_nsec = (now.tv_usec % 1000000) * 1000;
+                pthread_cond_timedwait(&executor->idle_cond,
+                                       &executor->idle_mutex, &until);
+            }
+            while (__atomic_load_n(&executor->pending, __ATOMIC_SEQ_CST) == 0
+                   && !executor->shutdown)
+                pthread_cond_wait(&executor->idle_cond, &executor->idle_mutex);
+            if (__atomic_load_n(&executor->pending, __ATOMIC_SEQ_CST) == 0 &&
+                executor->shutdown)
+                done = OFC_TRUE;
+            pthread_mutex_unlock(&executor->idle_mutex);
+        }
+    }
+
+    executor_current_worker = OFC_NULL;
+    return (OFC_NULL);
+}
+
+OFC_EXECUTOR *ofc_executor_impl_create(OFC_INT workers) {
+    OFC_EXECUTOR *executor;
+    OFC_INT i;
+    OFC_INT ready;
+    OFC_INT started;
+    long ncpu;
+
+    if (workers <= 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = ncpu > 0 ? (OFC_INT) ncpu : 1;
+    }
+    if (workers > EXECUTOR_MAX_WORKERS)
+        workers = EXECUTOR_MAX_WORKERS;
+
+    executor = ofc_malloc(sizeof(OFC_EXECUTOR));
+    if (executor != OFC_NULL) {
+        executor->num_workers = 0;
+        executor->pending = 0;
+        executor->next = 0;
+        executor->shutdown = OFC_FALSE;
+        pthread_mutex_init(&executor->idle_mutex, NULL);
+        pthread_cond_init(&executor->idle_cond, NULL);
+
+        executor->workers = ofc_malloc(sizeof(EXECUTOR_WORKER) * workers);
+        if (executor->workers == OFC_NULL) {
+            pthread_cond_destroy(&executor->idle_cond);
+            pthread_mutex_destroy(&executor->idle_mutex);
+            ofc_free(executor);
+            executor = OFC_NULL;
+        } else {
+            /*
+             * All deques have to exist before any worker can go
+             * looking to steal from them
+             */
+            for (i = 0; i < workers; i++) {
+                executor->workers[i].executor = executor;
+                executor->workers[i].index = i;
+                executor->workers[i].seed = (OFC_UINT32) i + 1;
+                if (!deque_init(&executor->workers[i].deque))
+                    break;
+            }
+            ready = i;
+
+            started = 0;
+            if (ready == workers) {
+                executor->num_workers = workers;
+                for (started = 0; started < workers; started++) {
+                    if (pthread_create(&executor->workers[started].thread,
+                                       NULL, executor_worker,
+                                       &executor->workers[started]) != 0)
+                        break;
+                }
+            }
+
+            if (started < workers) {
+                /*
+                 * Couldn't set them all up.  Shut down the ones that
+                 * did start and fail the create
+                 */
+                pthread_mutex_lock(&executor->idle_mutex);
+                executor->shutdown = OFC_TRUE;
+                pthread_cond_broadcast(&executor->idle_cond);
+                pthread_mutex_unlock(&executor->idle_mutex);
+
+                for (i = 0; i < started; i++)
+                    pthread_join(executor->workers[i].thread, OFC_NULL);
+                for (i = 0; i < ready; i++)
+                    deque_destroy(&executor->workers[i].deque);
+
+                ofc_free(executor->workers);
+                pthread_cond_destroy(&executor->idle_cond);
+                pthread_mutex_destroy(&executor->idle_mutex);
+                ofc_free(executor);
+                executor = OFC_NULL;
+            }
+        }
+    }
+    return (executor);
+}
+
+OFC_VOID ofc_executor_impl_destroy(OFC_EXECUTOR *executor) {
+    OFC_INT i;
+
+    if (executor != OFC_NULL) {
+        pthread_mutex_lock(&executor->idle_mutex);
+        executor->shutdown = OFC_TRUE;
+        pthread_cond_broadcast(&executor->idle_cond);
+        pthread_mutex_unlock(&executor->idle_mutex);
+
+        for (i = 0; i < executor->num_workers; i++)
+            pthread_join(executor->workers[i].thread, OFC_NULL);
+        for (i = 0; i < executor->num_workers; i++)
+            deque_destroy(&executor->workers[i].deque);
+
+        ofc_free(executor->workers);
+        pthread_cond_destroy(&executor->idle_cond);
+        pthread_mutex_destroy(&executor->idle_mutex);
+        ofc_free(executor);
+    }
+}
+
+OFC_INT ofc_executor_impl_workers(OFC_EXECUTOR *executor) {
+    return (executor == OFC_NULL ? 0 : executor->num_workers);
+}
+
+static OFC_BOOL executor_queue(OFC_EXECUTOR *executor, EXECUTOR_ITEM *item) {
+    EXECUTOR_WORKER *worker;
+    OFC_BOOL ret;
+
+    worker = executor_current_worker;
+    if (worker == OFC_NULL || worker->executor != executor) {
+        /*
+         * Submitted from outside the pool.  Spread round robin
+         */
+        worker = &executor->workers
+                [__atomic_fetch_add(&executor->next, 1, __ATOMIC_RELAXED) %
+                 executor->num_workers];
+    }
+
+    __atomic_add_fetch(&executor->pending, 1, __ATOMIC_SEQ_CST);
+    ret = deque_push(&worker->deque, item);
+    if (ret == OFC_FALSE)
+        __atomic_sub_fetch(&executor->pending, 1, __ATOMIC_SEQ_CST);
+    else {
+        pthread_mutex_lock(&executor->idle_mutex);
+        pthread_cond_signal(&executor->idle_cond);
+        pthread_mutex_unlock(&executor->idle_mutex);
+    }
+    return (ret);
+}
+
+OFC_HANDLE ofc_executor_impl_submit(OFC_EXECUTOR *executor,
+                                    OFC_EXECUTOR_TASK *task,
+                                    OFC_VOID *context) {
+    EXECUTOR_ITEM item;
+    OFC_HANDLE hEvent;
+
+    hEvent = OFC_HANDLE_NULL;
+    if (executor != OFC_NULL && executor->num_workers > 0) {
+        hEvent = ofc_event_create(OFC_EVENT_MANUAL);
+        if (hEvent != OFC_HANDLE_NULL) {
+            item.task = task;
+            item.context = context;
+            item.hEvent = hEvent;
+            if (!executor_queue(executor, &item)) {
+                ofc_event_destroy(hEvent);
+                hEvent = OFC_HANDLE_NULL;
+            }
+        }
+    }
+    return (hEvent);
+}
+
+OFC_BOOL ofc_executor_impl_post(OFC_EXECUTOR *executor,
+                                OFC_EXECUTOR_TASK *task,
+                                OFC_VOID *context) {
+    EXECUTOR_ITEM item;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    if (executor != OFC_NULL && executor->num_workers > 0) {
+        item.task = task;
+        item.context = context;
+        item.hEvent = OFC_HANDLE_NULL;
+        ret = executor_queue(executor, &item);
+    }
+    return (ret);
+}
+
+/** \} */
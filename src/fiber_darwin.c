@@ -0,0 +1,601 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#if !defined(__x86_64__) && !defined(__aarch64__) && !defined(__arm64__)
+#define OFC_FIBER_UCONTEXT
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#include <ucontext.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/waitset.h"
+#include "ofc/libc.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/fiber_darwin.h"
+
+/**
+ * \defgroup fiber_darwin Darwin Fiber Scheduler
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+#define FIBER_HASH_SIZE 4096
+#define FIBER_POOL_MAX 1024
+
+#if !defined(MAP_ANON)
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+typedef enum {
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_WAITING,
+    FIBER_DONE
+} FIBER_STATE;
+
+/*
+ * One entry per handle a fiber is parked on.  Entries are chained off
+ * the scheduler's hash table so a wakeup can find its fiber without a
+ * search, and they live in the fiber so parking never allocates.
+ */
+typedef struct _FIBER_WAIT {
+    struct _FIBER_WAIT *next;
+    OFC_HANDLE hHandle;
+    OFC_FIBER *fiber;
+} FIBER_WAIT;
+
+struct _OFC_FIBER {
+    OFC_FIBER *next;
+    OFC_FIBER_SCHED *sched;
+    FIBER_STATE state;
+    OFC_FIBER_ROUTINE *routine;
+    OFC_VOID *context;
+#if defined(OFC_FIBER_UCONTEXT)
+    ucontext_t uc;
+#else
+    OFC_VOID *sp;
+#endif
+    OFC_VOID *stack;
+    OFC_SIZET stack_size;
+    OFC_INT num_waits;
+    FIBER_WAIT waits[OFC_FIBER_MAX_WAIT];
+    OFC_HANDLE fired;
+};
+
+struct _OFC_FIBER_SCHED {
+    OFC_HANDLE wait_set;
+    OFC_SIZET stack_size;
+#if defined(OFC_FIBER_UCONTEXT)
+    ucontext_t uc;
+#else
+    OFC_VOID *sp;
+#endif
+    OFC_FIBER *current;
+    OFC_FIBER *ready_head;
+    OFC_FIBER *ready_tail;
+    OFC_FIBER *pool;
+    OFC_INT pool_count;
+    OFC_INT live;
+    OFC_INT waiting;
+    OFC_BOOL stop;
+    FIBER_WAIT *hash[FIBER_HASH_SIZE];
+};
+
+static __thread OFC_FIBER_SCHED *fiber_current_sched = OFC_NULL;
+
+OFC_VOID ofc_fiber_entry(OFC_FIBER *fiber);
+
+#if !defined(OFC_FIBER_UCONTEXT)
+/*
+ * Context switch.  Saves the callee saved registers of the current
+ * context on its own stack, stores the stack pointer through from_sp,
+ * then loads to_sp and restores the registers saved there.  A new
+ * fiber's stack is primed so the first switch "returns" into
+ * fiber_trampoline with the fiber in a callee saved register.
+ */
+OFC_VOID ofc_fiber_switch(OFC_VOID **from_sp, OFC_VOID *to_sp);
+OFC_VOID ofc_fiber_trampoline(OFC_VOID);
+
+#if defined(__APPLE__)
+#define FIBER_SYM(name) "_" #name
+#else
+#define FIBER_SYM(name) #name
+#endif
+
+#if defined(__x86_64__)
+__asm__(
+        ".text\n"
+        ".p2align 4\n"
+        FIBER_SYM(ofc_fiber_switch) ":\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".p2align 4\n"
+        FIBER_SYM(ofc_fiber_trampoline) ":\n"
+        "    movq %rbx, %rdi\n"
+        "    call " FIBER_SYM(ofc_fiber_entry) "\n"
+        "    ud2\n"
+);
+
+#define FIBER_FRAME_WORDS 10
+
+static OFC_VOID *fiber_prime(OFC_FIBER *fiber) {
+    OFC_UINT64 *sp;
+    OFC_UINT32 *csr;
+
+    /*
+     * Top of stack, 16 byte aligned.  The trampoline address sits where
+     * the switch's ret will find it, positioned so that the stack is
+     * aligned at the trampoline's call as the ABI expects.
+     */
+    sp = (OFC_UINT64 *) (((OFC_DWORD_PTR) fiber->stack + fiber->stack_size)
+                         & ~(OFC_DWORD_PTR) 15);
+    sp -= FIBER_FRAME_WORDS;
+    ofc_memset(sp, 0, FIBER_FRAME_WORDS * sizeof(OFC_UINT64));
+
+    csr = (OFC_UINT32 *) &sp[0];
+    csr[0] = 0x1F80;            /* mxcsr default */
+    csr[1] = 0x037F;            /* x87 control word default */
+    /* sp[1..4] r15, r14, r13, r12 */
+    sp[5] = (OFC_UINT64) (OFC_DWORD_PTR) fiber;          /* rbx */
+    sp[6] = 0;                                          /* rbp */
+    sp[7] = (OFC_UINT64) (OFC_DWORD_PTR) ofc_fiber_trampoline;
+    return (sp);
+}
+#else
+__asm__(
+        ".text\n"
+        ".p2align 2\n"
+        FIBER_SYM(ofc_fiber_switch) ":\n"
+        "    sub sp, sp, #160\n"
+        "    stp x19, x20, [sp, #0]\n"
+        "    stp x21, x22, [sp, #16]\n"
+        "    stp x23, x24, [sp, #32]\n"
+        "    stp x25, x26, [sp, #48]\n"
+        "    stp x27, x28, [sp, #64]\n"
+        "    stp x29, x30, [sp, #80]\n"
+        "    stp d8, d9, [sp, #96]\n"
+        "    stp d10, d11, [sp, #112]\n"
+        "    stp d12, d13, [sp, #128]\n"
+        "    stp d14, d15, [sp, #144]\n"
+        "    mov x9, sp\n"
+        "    str x9, [x0]\n"
+        "    mov sp, x1\n"
+        "    ldp x19, x20, [sp, #0]\n"
+        "    ldp x21, x22, [sp, #16]\n"
+        "    ldp x23, x24, [sp, #32]\n"
+        "    ldp x25, x26, [sp, #48]\n"
+        "    ldp x27, x28, [sp, #64]\n"
+        "    ldp x29, x30, [sp, #80]\n"
+        "    ldp d8, d9, [sp, #96]\n"
+        "    ldp d10, d11, [sp, #112]\n"
+        "    ldp d12, d13, [sp, #128]\n"
+        "    ldp d14, d15, [sp, #144]\n"
+        "    add sp, sp, #160\n"
+        "    ret\n"
+        ".p2align 2\n"
+        FIBER_SYM(ofc_fiber_trampoline) ":\n"
+        "    mov x0, x19\n"
+        "    bl " FIBER_SYM(ofc_fiber_entry) "\n"
+        "    brk #0\n"
+);
+
+#define FIBER_FRAME_WORDS 20
+
+static OFC_VOID *fiber_prime(OFC_FIBER *fiber) {
+    OFC_UINT64 *sp;
+
+    sp = (OFC_UINT64 *) (((OFC_DWORD_PTR) fiber->stack + fiber->stack_size)
+                         & ~(OFC_DWORD_PTR) 15);
+    sp -= FIBER_FRAME_WORDS;
+    ofc_memset(sp, 0, FIBER_FRAME_WORDS * sizeof(OFC_UINT64));
+
+    sp[0] = (OFC_UINT64) (OFC_DWORD_PTR) fiber;          /* x19 */
+    sp[10] = 0;                                         /* x29 */
+    sp[11] = (OFC_UINT64) (OFC_DWORD_PTR) ofc_fiber_trampoline; /* x30 */
+    return (sp);
+}
+#endif
+#endif
+
+/*
+ * First code run on a new fiber's stack.  Reached from the trampoline
+ * so it can't be static.
+ */
+__attribute__((used)) OFC_VOID ofc_fiber_entry(OFC_FIBER *fiber) {
+    OFC_FIBER_SCHED *sched;
+
+    (fiber->routine)(fiber->context);
+
+    sched = fiber->sched;
+    fiber->state = FIBER_DONE;
+#if defined(OFC_FIBER_UCONTEXT)
+    setcontext(&sched->uc);
+#else
+    ofc_fiber_switch(&fiber->sp, sched->sp);
+#endif
+}
+
+#if defined(OFC_FIBER_UCONTEXT)
+static __thread OFC_FIBER *fiber_starting = OFC_NULL;
+
+static void fiber_uc_entry(void) {
+    ofc_fiber_entry(fiber_starting);
+}
+#endif
+
+static OFC_VOID fiber_resume(OFC_FIBER_SCHED *sched, OFC_FIBER *fiber) {
+    sched->current = fiber;
+    fiber->state = FIBER_RUNNING;
+#if defined(OFC_FIBER_UCONTEXT)
+    fiber_starting = fiber;
+    swapcontext(&sched->uc, &fiber->uc);
+#else
+    ofc_fiber_switch(&sched->sp, fiber->sp);
+#endif
+    sched->current = OFC_NULL;
+}
+
+static OFC_VOID fiber_suspend(OFC_FIBER *fiber) {
+#if defined(OFC_FIBER_UCONTEXT)
+    swapcontext(&fiber->uc, &fiber->sched->uc);
+#else
+    ofc_fiber_switch(&fiber->sp, fiber->sched->sp);
+#endif
+}
+
+static OFC_VOID fiber_ready(OFC_FIBER_SCHED *sched, OFC_FIBER *fiber) {
+    fiber->state = FIBER_READY;
+    fiber->next = OFC_NULL;
+    if (sched->ready_tail == OFC_NULL)
+        sched->ready_head = fiber;
+    else
+        sched->ready_tail->next = fiber;
+    sched->ready_tail = fiber;
+}
+
+static OFC_FIBER *fiber_next_ready(OFC_FIBER_SCHED *sched) {
+    OFC_FIBER *fiber;
+
+    fiber = sched->ready_head;
+    if (fiber != OFC_NULL) {
+        sched->ready_head = fiber->next;
+        if (sched->ready_head == OFC_NULL)
+            sched->ready_tail = OFC_NULL;
+        fiber->next = OFC_NULL;
+    }
+    return (fiber);
+}
+
+static OFC_UINT fiber_hash(OFC_HANDLE hHandle) {
+    OFC_DWORD_PTR h;
+
+    h = (OFC_DWORD_PTR) hHandle;
+    h ^= h >> 12;
+    return ((OFC_UINT) (h % FIBER_HASH_SIZE));
+}
+
+static FIBER_WAIT *fiber_find(OFC_FIBER_SCHED *sched, OFC_HANDLE hHandle) {
+    FIBER_WAIT *wait;
+
+    for (wait = sched->hash[fiber_hash(hHandle)];
+         wait != OFC_NULL && wait->hHandle != hHandle;
+         wait = wait->next);
+    return (wait);
+}
+
+static OFC_VOID fiber_unpark(OFC_FIBER_SCHED *sched, OFC_FIBER *fiber) {
+    FIBER_WAIT **link;
+    OFC_INT i;
+
+    for (i = 0; i < fiber->num_waits; i++) {
+        for (link = &sched->hash[fiber_hash(fiber->waits[i].hHandle)];
+             *link != OFC_NULL && *link != &fiber->waits[i];
+             link = &(*link)->next);
+        if (*link != OFC_NULL)
+            *link = fiber->waits[i].next;
+        /*
+         * Leave the handle in the wait set if another fiber is still
+         * parked on it
+         */
+        if (fiber_find(sched, fiber->waits[i].hHandle) == OFC_NULL)
+            ofc_waitset_remove(sched->wait_set, fiber->waits[i].hHandle);
+    }
+    fiber->num_waits = 0;
+    sched->waiting--;
+}
+
+static OFC_VOID fiber_dispatch(OFC_FIBER_SCHED *sched, OFC_HANDLE hHandle) {
+    FIBER_WAIT *wait;
+
+    wait = fiber_find(sched, hHandle);
+    if (wait != OFC_NULL) {
+        OFC_FIBER *fiber;
+
+        fiber = wait->fiber;
+        fiber->fired = hHandle;
+        fiber_unpark(sched, fiber);
+        fiber_ready(sched, fiber);
+    } else {
+        /*
+         * Nobody is parked on it any more
+         */
+        ofc_waitset_remove(sched->wait_set, hHandle);
+    }
+}
+
+static OFC_VOID *fiber_stack_alloc(OFC_SIZET size) {
+    OFC_VOID *stack;
+    OFC_SIZET page;
+
+    page = (OFC_SIZET) sysconf(_SC_PAGESIZE);
+    stack = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (stack == MAP_FAILED)
+        stack = OFC_NULL;
+    else {
+        /*
+         * Guard page at the low end so an overflow faults rather than
+         * scribbling over a neighbour
+         */
+        mprotect(stack, page, PROT_NONE);
+        stack = (OFC_CHAR *) stack + page;
+    }
+    return (stack);
+}
+
+static OFC_VOID fiber_stack_free(OFC_VOID *stack, OFC_SIZET size) {
+    OFC_SIZET page;
+
+    page = (OFC_SIZET) sysconf(_SC_PAGESIZE);
+    munmap((OFC_CHAR *) stack - page, size + page);
+}
+
+static OFC_VOID fiber_free(OFC_FIBER_SCHED *sched, OFC_FIBER *fiber) {
+    if (sched->pool_count < FIBER_POOL_MAX) {
+        fiber->next = sched->pool;
+        sched->pool = fiber;
+        sched->pool_count++;
+    } else {
+        fiber_stack_free(fiber->stack, fiber->stack_size);
+        ofc_free(fiber);
+    }
+}
+
+OFC_FIBER_SCHED *ofc_fiber_impl_sched_create(OFC_SIZET stack_size) {
+    OFC_FIBER_SCHED *sched;
+    OFC_SIZET page;
+
+    if (stack_size == 0)
+        stack_size = OFC_FIBER_STACK_DEFAULT;
+    page = (OFC_SIZET) sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page - 1) & ~(page - 1);
+
+    sched = ofc_malloc(sizeof(OFC_FIBER_SCHED));
+    if (sched != OFC_NULL) {
+        ofc_memset(sched, 0, sizeof(OFC_FIBER_SCHED));
+        sched->stack_size = stack_size;
+        sched->wait_set = ofc_waitset_create();
+        if (sched->wait_set == OFC_HANDLE_NULL) {
+            ofc_free(sched);
+            sched = OFC_NULL;
+        }
+    }
+    return (sched);
+}
+
+OFC_VOID ofc_fiber_impl_sched_destroy(OFC_FIBER_SCHED *sched) {
+    OFC_FIBER *fiber;
+    OFC_INT i;
+    FIBER_WAIT *wait;
+
+    if (sched != OFC_NULL) {
+        /*
+         * Discard parked fibers.  Each parked fiber has at least one
+         * wait entry in the table
+         */
+        for (i = 0; i < FIBER_HASH_SIZE; i++) {
+            while (sched->hash[i] != OFC_NULL) {
+                wait = sched->hash[i];
+                fiber = wait->fiber;
+                fiber_unpark(sched, fiber);
+                fiber_stack_free(fiber->stack, fiber->stack_size);
+                ofc_free(fiber);
+            }
+        }
+        for (fiber = fiber_next_ready(sched); fiber != OFC_NULL;
+             fiber = fiber_next_ready(sched)) {
+            fiber_stack_free(fiber->stack, fiber->stack_size);
+            ofc_free(fiber);
+        }
+        while (sched->pool != OFC_NULL) {
+            fiber = sched->pool;
+            sched->pool = fiber->next;
+            fiber_stack_free(fiber->stack, fiber->stack_size);
+            ofc_free(fiber);
+        }
+        ofc_waitset_destroy(sched->wait_set);
+        ofc_free(sched);
+    }
+}
+
+OFC_HANDLE ofc_fiber_impl_sched_waitset(OFC_FIBER_SCHED *sched) {
+    return (sched == OFC_NULL ? OFC_HANDLE_NULL : sched->wait_set);
+}
+
+OFC_VOID ofc_fiber_impl_sched_stop(OFC_FIBER_SCHED *sched) {
+    if (sched != OFC_NULL) {
+        sched->stop = OFC_TRUE;
+        ofc_waitset_wake(sched->wait_set);
+    }
+}
+
+OFC_VOID ofc_fiber_impl_sched_run(OFC_FIBER_SCHED *sched) {
+    OFC_FIBER_SCHED *save;
+    OFC_FIBER *fiber;
+    OFC_HANDLE hFired;
+
+    save = fiber_current_sched;
+    fiber_current_sched = sched;
+    sched->stop = OFC_FALSE;
+
+    while (!sched->stop && sched->live > 0) {
+        for (fiber = fiber_next_ready(sched);
+             fiber != OFC_NULL && !sched->stop;
+             fiber = fiber_next_ready(sched)) {
+            fiber_resume(sched, fiber);
+            if (fiber->state == FIBER_DONE) {
+                sched->live--;
+                fiber_free(sched, fiber);
+            }
+        }
+        if (fiber != OFC_NULL) {
+            /*
+             * Stopped with this one pulled off the queue.  Put it back
+             * at the head so it runs first next time.
+             */
+            fiber->next = sched->ready_head;
+            sched->ready_head = fiber;
+            if (sched->ready_tail == OFC_NULL)
+                sched->ready_tail = fiber;
+        }
+
+        if (!sched->stop && sched->ready_head == OFC_NULL &&
+            sched->waiting > 0) {
+            hFired = ofc_waitset_wait(sched->wait_set);
+            if (hFired != OFC_HANDLE_NULL)
+                fiber_dispatch(sched, hFired);
+        }
+    }
+
+    fiber_current_sched = save;
+}
+
+OFC_FIBER *ofc_fiber_impl_spawn(OFC_FIBER_SCHED *sched,
+                                OFC_FIBER_ROUTINE *routine,
+                                OFC_VOID *context) {
+    OFC_FIBER *fiber;
+
+    fiber = sched->pool;
+    if (fiber != OFC_NULL) {
+        sched->pool = fiber->next;
+        sched->pool_count--;
+    } else {
+        fiber = ofc_malloc(sizeof(OFC_FIBER));
+        if (fiber != OFC_NULL) {
+            fiber->stack_size = sched->stack_size;
+            fiber->stack = fiber_stack_alloc(fiber->stack_size);
+            if (fiber->stack == OFC_NULL) {
+                ofc_free(fiber);
+                fiber = OFC_NULL;
+            }
+        }
+    }
+
+    if (fiber != OFC_NULL) {
+        fiber->sched = sched;
+        fiber->routine = routine;
+        fiber->context = context;
+        fiber->num_waits = 0;
+        fiber->fired = OFC_HANDLE_NULL;
+#if defined(OFC_FIBER_UCONTEXT)
+        getcontext(&fiber->uc);
+        fiber->uc.uc_stack.ss_sp = fiber->stack;
+        fiber->uc.uc_stack.ss_size = fiber->stack_size;
+        fiber->uc.uc_link = OFC_NULL;
+        makecontext(&fiber->uc, fiber_uc_entry, 0);
+#else
+        fiber->sp = fiber_prime(fiber);
+#endif
+        sched->live++;
+        fiber_ready(sched, fiber);
+    }
+    return (fiber);
+}
+
+OFC_FIBER *ofc_fiber_impl_self(OFC_VOID) {
+    OFC_FIBER *fiber;
+
+    fiber = OFC_NULL;
+    if (fiber_current_sched != OFC_NULL)
+        fiber = fiber_current_sched->current;
+    return (fiber);
+}
+
+OFC_VOID ofc_fiber_impl_yield(OFC_VOID) {
+    OFC_FIBER *fiber;
+
+    fiber = ofc_fiber_impl_self();
+    if (fiber != OFC_NULL) {
+        fiber_ready(fiber->sched, fiber);
+        fiber_suspend(fiber);
+    }
+}
+
+OFC_HANDLE ofc_fiber_impl_wait_multiple(const OFC_HANDLE *handles,
+                                        OFC_INT count) {
+    OFC_FIBER *fiber;
+    OFC_FIBER_SCHED *sched;
+    OFC_HANDLE ret;
+    OFC_INT i;
+    OFC_UINT bucket;
+
+    ret = OFC_HANDLE_NULL;
+    fiber = ofc_fiber_impl_self();
+    if (fiber != OFC_NULL && count > 0 && count <= OFC_FIBER_MAX_WAIT) {
+        sched = fiber->sched;
+        fiber->fired = OFC_HANDLE_NULL;
+        for (i = 0; i < count; i++) {
+            if (fiber_find(sched, handles[i]) == OFC_NULL)
+                ofc_waitset_add(sched->wait_set, OFC_HANDLE_NULL, handles[i]);
+            fiber->waits[i].hHandle = handles[i];
+            fiber->waits[i].fiber = fiber;
+            bucket = fiber_hash(handles[i]);
+            fiber->waits[i].next = sched->hash[bucket];
+            sched->hash[bucket] = &fiber->waits[i];
+        }
+        fiber->num_waits = count;
+        fiber->state = FIBER_WAITING;
+        sched->waiting++;
+
+        fiber_suspend(fiber);
+
+        ret = fiber->fired;
+    }
+    return (ret);
+}
+
+OFC_HANDLE ofc_fiber_impl_wait(OFC_HANDLE hHandle) {
+    return (ofc_fiber_impl_wait_multiple(&hHandle, 1));
+}
+
+/** \} */
@@ -0,0 +1,213 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/libc.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/socket_darwin.h"
+#include "ofc_darwin/frame_darwin.h"
+
+/**
+ * \defgroup frame_darwin Darwin Framed Stream Reader
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+struct _OFC_FRAME_READER {
+    OFC_SOCKET_REF *ref;
+    OFC_FRAME_FORMAT format;
+    OFC_CHAR *buf;
+    OFC_SIZET size;
+    OFC_SIZET start;            /* first byte not yet handed out */
+    OFC_SIZET end;              /* end of received data */
+    int lowat;                  /* SO_RCVLOWAT currently set */
+    int rcvbuf;                 /* socket receive buffer size */
+    OFC_BOOL error;
+};
+
+/*
+ * Decode the length of the frame starting at p, header included
+ */
+static OFC_SIZET frame_length(OFC_FRAME_READER *reader, const OFC_CHAR *p) {
+    const OFC_UINT8 *field;
+    OFC_SIZET len;
+    OFC_INT i;
+
+    field = (const OFC_UINT8 *) p + reader->format.length_offset;
+    len = 0;
+    for (i = 0; i < reader->format.length_size; i++) {
+        if (reader->format.big_endian)
+            len = (len << 8) | field[i];
+        else
+            len |= (OFC_SIZET) field[i] << (8 * i);
+    }
+    if (!reader->format.includes_header)
+        len += reader->format.header_len;
+    return (len);
+}
+
+/*
+ * Bytes needed beyond what's buffered to complete the frame at start,
+ * or 0 if a whole frame is buffered.  A length outside the format's
+ * bounds fails the reader, before anything is sized from it.
+ */
+static OFC_SIZET frame_needed(OFC_FRAME_READER *reader) {
+    OFC_SIZET avail;
+    OFC_SIZET total;
+
+    avail = reader->end - reader->start;
+    if (avail < (OFC_SIZET) reader->format.header_len)
+        return (reader->format.header_len - avail);
+    total = frame_length(reader, reader->buf + reader->start);
+    if (total > reader->format.max_frame ||
+        total < (OFC_SIZET) reader->format.header_len) {
+        reader->error = OFC_TRUE;
+        total = avail;
+    }
+    return (total > avail ? total - avail : 0);
+}
+
+/*
+ * Ask the kernel not to report the socket readable until the rest of
+ * the current frame is in.  The next fill grows the buffer to fit the
+ * frame, so only the socket buffer bounds the mark.  Half of it keeps
+ * the mark reachable with the window the kernel advertises.
+ */
+static OFC_VOID frame_lowat(OFC_FRAME_READER *reader, OFC_SIZET needed) {
+    int lowat;
+
+    if (reader->rcvbuf > 0 && needed > (OFC_SIZET) reader->rcvbuf / 2)
+        needed = reader->rcvbuf / 2;
+    lowat = needed > 0 ? (int) needed : 1;
+
+    if (lowat != reader->lowat &&
+        setsockopt(ofc_socket_impl_ref_fd(reader->ref), SOL_SOCKET,
+                   SO_RCVLOWAT, &lowat, sizeof(lowat)) == 0)
+        reader->lowat = lowat;
+}
+
+OFC_FRAME_READER *ofc_frame_impl_create(OFC_HANDLE hSocket,
+                                        const OFC_FRAME_FORMAT *format,
+                                        OFC_SIZET buffer_size) {
+    OFC_FRAME_READER *reader;
+    socklen_t len;
+
+    if (format->header_len < 1 || format->header_len > 16 ||
+        format->length_size < 1 || format->length_size > 4 ||
+        format->length_offset < 0 ||
+        format->length_offset + format->length_size > format->header_len)
+        return (OFC_NULL);
+
+    if (buffer_size == 0)
+        buffer_size = OFC_FRAME_BUFFER_DEFAULT;
+    if (buffer_size < (OFC_SIZET) format->header_len)
+        buffer_size = format->header_len;
+
+    reader = ofc_malloc(sizeof(OFC_FRAME_READER));
+    if (reader != OFC_NULL) {
+        reader->ref = ofc_socket_impl_ref(hSocket);
+        reader->buf = ofc_malloc(buffer_size);
+        if (reader->ref == OFC_NULL || reader->buf == OFC_NULL) {
+            if (reader->ref != OFC_NULL)
+                ofc_socket_impl_ref_release(reader->ref);
+            if (reader->buf != OFC_NULL)
+                ofc_free(reader->buf);
+            ofc_free(reader);
+            reader = OFC_NULL;
+        } else {
+            reader->format = *format;
+            reader->size = buffer_size;
+            reader->start = 0;
+            reader->end = 0;
+            reader->lowat = 1;
+            reader->error = OFC_FALSE;
+            len = sizeof(reader->rcvbuf);
+            if (getsockopt(ofc_socket_impl_ref_fd(reader->ref), SOL_SOCKET,
+                           SO_RCVBUF, &reader->rcvbuf, &len) != 0)
+                reader->rcvbuf = 0;
+            frame_lowat(reader, format->header_len);
+        }
+    }
+    return (reader);
+}
+
+OFC_VOID ofc_frame_impl_destroy(OFC_FRAME_READER *reader) {
+    frame_lowat(reader, 1);
+    ofc_socket_impl_ref_release(reader->ref);
+    ofc_free(reader->buf);
+    ofc_free(reader);
+}
+
+OFC_SIZET ofc_frame_impl_fill(OFC_FRAME_READER *reader) {
+    OFC_SIZET ret;
+    OFC_SIZET needed;
+    OFC_SIZET want;
+    OFC_CHAR *buf;
+
+    if (reader->error)
+        return ((OFC_SIZET) -1);
+
+    /*
+     * Frames handed out so far are done with.  Slide the partial frame
+     * to the front, and grow the buffer if it can't hold the whole frame.
+     */
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    needed = frame_needed(reader);
+    if (reader->error)
+        return ((OFC_SIZET) -1);
+
+    want = reader->end + needed;
+    if (want > reader->size) {
+        buf = ofc_realloc(reader->buf, want);
+        if (buf == OFC_NULL)
+            return ((OFC_SIZET) -1);
+        reader->buf = buf;
+        reader->size = want;
+    }
+
+    ret = 0;
+    if (reader->end < reader->size) {
+        ret = ofc_socket_impl_ref_recv(reader->ref, reader->buf + reader->end,
+                                       reader->size - reader->end);
+        if (ret != (OFC_SIZET) -1)
+            reader->end += ret;
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_frame_impl_next(OFC_FRAME_READER *reader,
+                             const OFC_CHAR **frame, OFC_SIZET *len) {
+    OFC_SIZET needed;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    if (!reader->error) {
+        needed = frame_needed(reader);
+        if (needed == 0 && !reader->error) {
+            *frame = reader->buf + reader->start;
+            *len = frame_length(reader, *frame);
+            reader->start += *len;
+            ret = OFC_TRUE;
+        } else if (!reader->error)
+            frame_lowat(reader, needed);
+    }
+    return (ret);
+}
+
+/** \} */
@@ -0,0 +1,221 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/libc.h"
+#include "ofc/socket.h"
+#include "ofc/impl/socketimpl.h"
+#include "ofc/net.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/socket_darwin.h"
+#include "ofc_darwin/listen_darwin.h"
+
+/**
+ * \defgroup listen_darwin Darwin Listener Groups
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+/*
+ * Whether the kernel load balances connections across SO_REUSEPORT
+ * listeners.  Darwin's doesn't: the most recently bound socket gets
+ * everything.
+ */
+#if defined(__linux__) || defined(SO_REUSEPORT_LB)
+#define LISTEN_BALANCED
+#endif
+
+struct _OFC_LISTEN_GROUP {
+    pthread_mutex_t mutex;
+    OFC_IPADDR ip;
+    OFC_UINT16 port;
+    OFC_INT backlog;
+    OFC_BOOL has_profile;
+    OFC_SOCKET_PROFILE profile;
+    /*
+     * Holds the address for the life of the group.  When balanced it is
+     * bound but not listening, so the kernel gives it no connections.
+     * Otherwise it is the one listener every member shares.
+     */
+    OFC_HANDLE hAnchor;
+    OFC_HANDLE members[OFC_LISTEN_GROUP_MAX];
+    OFC_INT count;
+};
+
+static OFC_HANDLE listen_open(OFC_LISTEN_GROUP *group, OFC_BOOL listening) {
+    OFC_HANDLE hSocket;
+    OFC_BOOL ok;
+#if defined(SO_REUSEPORT_LB)
+    int on;
+#endif
+
+    hSocket = ofc_socket_impl_create_profile(group->ip.ip_version,
+                                             SOCKET_TYPE_STREAM,
+                                             group->has_profile ?
+                                             &group->profile : OFC_NULL);
+    if (hSocket != OFC_HANDLE_NULL) {
+        ok = ofc_socket_impl_reuse_addr(hSocket, OFC_TRUE);
+#if defined(SO_REUSEPORT_LB)
+        on = 1;
+        setsockopt(ofc_socket_impl_get_fd(hSocket), SOL_SOCKET,
+                   SO_REUSEPORT_LB, &on, sizeof(on));
+#endif
+        ok = ok && ofc_socket_impl_bind(hSocket, &group->ip, group->port);
+        if (ok && listening)
+            ok = ofc_socket_impl_listen(hSocket, group->backlog);
+        ok = ok && ofc_socket_impl_no_block(hSocket, OFC_TRUE);
+        if (!ok) {
+            ofc_socket_impl_destroy(hSocket);
+            hSocket = OFC_HANDLE_NULL;
+        }
+    }
+    return (hSocket);
+}
+
+OFC_LISTEN_GROUP *ofc_listen_impl_create(const OFC_IPADDR *ip,
+                                         OFC_UINT16 port, OFC_INT backlog,
+                                         const OFC_SOCKET_PROFILE *profile) {
+    OFC_LISTEN_GROUP *group;
+    struct sockaddr_storage mysockaddr;
+    socklen_t mysocklen;
+    OFC_BOOL listening;
+
+    group = ofc_malloc(sizeof(OFC_LISTEN_GROUP));
+    if (group != OFC_NULL) {
+        pthread_mutex_init(&group->mutex, NULL);
+        group->ip = *ip;
+        group->port = port;
+        group->backlog = backlog;
+        group->has_profile = (profile != OFC_NULL);
+        if (profile != OFC_NULL)
+            group->profile = *profile;
+        group->count = 0;
+
+#if defined(LISTEN_BALANCED)
+        listening = OFC_FALSE;
+#else
+        listening = OFC_TRUE;
+#endif
+        group->hAnchor = listen_open(group, listening);
+        if (group->hAnchor == OFC_HANDLE_NULL) {
+            pthread_mutex_destroy(&group->mutex);
+            ofc_free(group);
+            group = OFC_NULL;
+        } else if (port == 0) {
+            /*
+             * Members have to bind the port the kernel picked
+             */
+            mysocklen = sizeof(mysockaddr);
+            if (getsockname(ofc_socket_impl_get_fd(group->hAnchor),
+                            (struct sockaddr *) &mysockaddr,
+                            &mysocklen) == 0)
+                group->port = ntohs(mysockaddr.ss_family == AF_INET ?
+                                    ((struct sockaddr_in *)
+                                            &mysockaddr)->sin_port :
+                                    ((struct sockaddr_in6 *)
+                                            &mysockaddr)->sin6_port);
+        }
+    }
+    return (group);
+}
+
+OFC_VOID ofc_listen_impl_destroy(OFC_LISTEN_GROUP *group) {
+    OFC_INT i;
+
+    if (group != OFC_NULL) {
+        for (i = 0; i < group->count; i++)
+            ofc_socket_impl_destroy(group->members[i]);
+        ofc_socket_impl_destroy(group->hAnchor);
+        pthread_mutex_destroy(&group->mutex);
+        ofc_free(group);
+    }
+}
+
+OFC_BOOL ofc_listen_impl_balanced(OFC_VOID) {
+#if defined(LISTEN_BALANCED)
+    return (OFC_TRUE);
+#else
+    return (OFC_FALSE);
+#endif
+}
+
+OFC_HANDLE ofc_listen_impl_add(OFC_LISTEN_GROUP *group) {
+    OFC_HANDLE hListener;
+
+    hListener = OFC_HANDLE_NULL;
+    pthread_mutex_lock(&group->mutex);
+    if (group->count < OFC_LISTEN_GROUP_MAX) {
+#if defined(LISTEN_BALANCED)
+        hListener = listen_open(group, OFC_TRUE);
+#else
+        hListener = ofc_socket_impl_dup(group->hAnchor);
+#endif
+        if (hListener != OFC_HANDLE_NULL)
+            group->members[group->count++] = hListener;
+    }
+    pthread_mutex_unlock(&group->mutex);
+    return (hListener);
+}
+
+OFC_INT ofc_listen_impl_remove(OFC_LISTEN_GROUP *group, OFC_HANDLE hListener,
+                               OFC_HANDLE *sockets, OFC_IPADDR *ips,
+                               OFC_UINT16 *ports, OFC_INT max) {
+    OFC_INT count;
+    OFC_INT i;
+#if defined(LISTEN_BALANCED)
+    OFC_INT n;
+#endif
+
+    count = -1;
+    pthread_mutex_lock(&group->mutex);
+    for (i = 0; i < group->count && group->members[i] != hListener; i++);
+    if (i < group->count) {
+        group->members[i] = group->members[--group->count];
+        count = 0;
+#if defined(LISTEN_BALANCED)
+        /*
+         * Closing a listener resets whatever is in its backlog.  Take it
+         * all first.
+         */
+        do {
+            n = ofc_socket_impl_accept_many(hListener, sockets + count,
+                                            ips == OFC_NULL ?
+                                            OFC_NULL : ips + count,
+                                            ports == OFC_NULL ?
+                                            OFC_NULL : ports + count,
+                                            max - count);
+            count += n;
+        } while (n > 0 && count < max);
+#endif
+        ofc_socket_impl_destroy(hListener);
+    }
+    pthread_mutex_unlock(&group->mutex);
+    return (count);
+}
+
+OFC_INT ofc_listen_impl_count(OFC_LISTEN_GROUP *group) {
+    OFC_INT count;
+
+    pthread_mutex_lock(&group->mutex);
+    count = group->count;
+    pthread_mutex_unlock(&group->mutex);
+    return (count);
+}
+
+OFC_UINT16 ofc_listen_impl_port(OFC_LISTEN_GROUP *group) {
+    return (group->port);
+}
+
+/** \} */
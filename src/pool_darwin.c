@@ -0,0 +1,439 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/libc.h"
+#include "ofc/socket.h"
+#include "ofc/impl/socketimpl.h"
+#include "ofc/net.h"
+#include "ofc/time.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/socket_darwin.h"
+#include "ofc_darwin/connect_darwin.h"
+#include "ofc_darwin/pool_darwin.h"
+
+/**
+ * \defgroup pool_darwin Darwin Outbound Connection Pool
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+#define POOL_BUCKETS 64
+#define POOL_DEFAULT_PER_KEY 8
+#define POOL_DEFAULT_TOTAL 256
+#define POOL_DEFAULT_IDLE (60 * 1000)
+#define POOL_DEFAULT_CONNECT (10 * 1000)
+
+struct _POOL_CONN;
+
+/*
+ * A server.  Freed once it has no connections open.
+ */
+typedef struct _POOL_KEY {
+    OFC_IPADDR ip;
+    OFC_UINT16 port;
+    OFC_INT open;
+    struct _POOL_CONN *idle;    /* most recently used first */
+    struct _POOL_KEY *next;
+} POOL_KEY;
+
+/*
+ * A connection.  While idle it is on its server's idle list and the
+ * pool's LRU list, oldest first.  While checked out it is in the busy
+ * table so put can find its server.
+ */
+typedef struct _POOL_CONN {
+    OFC_HANDLE hSocket;
+    POOL_KEY *key;
+    OFC_MSTIME since;
+    struct _POOL_CONN *next;
+    struct _POOL_CONN *lru_prev;
+    struct _POOL_CONN *lru_next;
+} POOL_CONN;
+
+struct _OFC_CONN_POOL {
+    pthread_mutex_t mutex;
+    OFC_POOL_CONFIG config;
+    OFC_BOOL has_profile;
+    OFC_SOCKET_PROFILE profile;
+    POOL_KEY *keys[POOL_BUCKETS];
+    POOL_CONN *busy[POOL_BUCKETS];
+    POOL_CONN *lru_head;
+    POOL_CONN *lru_tail;
+    OFC_POOL_STATS stats;
+};
+
+static OFC_INT pool_key_hash(const OFC_IPADDR *ip, OFC_UINT16 port) {
+    OFC_UINT32 hash;
+    OFC_INT i;
+
+    hash = port;
+    if (ip->ip_version == OFC_FAMILY_IP)
+        hash ^= ip->u.ipv4.addr;
+    else
+        for (i = 0; i < 16; i++)
+            hash = hash * 31 + ip->u.ipv6._s6_addr[i];
+    hash ^= hash >> 16;
+    return ((OFC_INT) (hash % POOL_BUCKETS));
+}
+
+static OFC_INT pool_busy_hash(OFC_HANDLE hSocket) {
+    return ((OFC_INT) (((unsigned long) hSocket >> 2) % POOL_BUCKETS));
+}
+
+static POOL_KEY *pool_key_find(OFC_CONN_POOL *pool, const OFC_IPADDR *ip,
+                               OFC_UINT16 port) {
+    POOL_KEY *key;
+    OFC_INT bucket;
+
+    bucket = pool_key_hash(ip, port);
+    for (key = pool->keys[bucket];
+         key != OFC_NULL &&
+         !(key->port == port &&
+           ofc_socket_impl_ip_equal(&key->ip, ip, OFC_TRUE));
+         key = key->next);
+
+    if (key == OFC_NULL) {
+        key = ofc_malloc(sizeof(POOL_KEY));
+        if (key != OFC_NULL) {
+            key->ip = *ip;
+            key->port = port;
+            key->open = 0;
+            key->idle = OFC_NULL;
+            key->next = pool->keys[bucket];
+            pool->keys[bucket] = key;
+        }
+    }
+    return (key);
+}
+
+static OFC_VOID pool_key_release(OFC_CONN_POOL *pool, POOL_KEY *key) {
+    POOL_KEY **pp;
+
+    if (key->open == 0) {
+        for (pp = &pool->keys[pool_key_hash(&key->ip, key->port)];
+             *pp != key; pp = &(*pp)->next);
+        *pp = key->next;
+        ofc_free(key);
+    }
+}
+
+static OFC_VOID pool_busy_add(OFC_CONN_POOL *pool, POOL_CONN *conn) {
+    OFC_INT bucket;
+
+    bucket = pool_busy_hash(conn->hSocket);
+    conn->next = pool->busy[bucket];
+    pool->busy[bucket] = conn;
+}
+
+static POOL_CONN *pool_busy_remove(OFC_CONN_POOL *pool, OFC_HANDLE hSocket) {
+    POOL_CONN **pp;
+    POOL_CONN *conn;
+
+    for (pp = &pool->busy[pool_busy_hash(hSocket)];
+         *pp != OFC_NULL && (*pp)->hSocket != hSocket; pp = &(*pp)->next);
+    conn = *pp;
+    if (conn != OFC_NULL)
+        *pp = conn->next;
+    return (conn);
+}
+
+/*
+ * Take a connection off its server's idle list and the LRU list
+ */
+static OFC_VOID pool_idle_remove(OFC_CONN_POOL *pool, POOL_CONN *conn) {
+    POOL_CONN **pp;
+
+    for (pp = &conn->key->idle; *pp != conn; pp = &(*pp)->next);
+    *pp = conn->next;
+
+    if (conn->lru_prev != OFC_NULL)
+        conn->lru_prev->lru_next = conn->lru_next;
+    else
+        pool->lru_head = conn->lru_next;
+    if (conn->lru_next != OFC_NULL)
+        conn->lru_next->lru_prev = conn->lru_prev;
+    else
+        pool->lru_tail = conn->lru_prev;
+    pool->stats.idle--;
+}
+
+/*
+ * Close a connection that is on neither list
+ */
+static OFC_VOID pool_close(OFC_CONN_POOL *pool, POOL_CONN *conn) {
+    POOL_KEY *key;
+
+    key = conn->key;
+    ofc_socket_impl_destroy(conn->hSocket);
+    ofc_free(conn);
+    key->open--;
+    pool->stats.open--;
+    pool_key_release(pool, key);
+}
+
+static OFC_INT pool_expire(OFC_CONN_POOL *pool, OFC_MSTIME now) {
+    POOL_CONN *conn;
+    OFC_INT count;
+
+    count = 0;
+    while (pool->lru_head != OFC_NULL &&
+           now - pool->lru_head->since >= pool->config.idle_timeout) {
+        conn = pool->lru_head;
+        pool_idle_remove(pool, conn);
+        pool_close(pool, conn);
+        pool->stats.evicted++;
+        count++;
+    }
+    return (count);
+}
+
+/*
+ * An idle connection is sound if the peer hasn't closed or reset it and
+ * hasn't sent anything unasked
+ */
+static OFC_BOOL pool_sound(OFC_HANDLE hSocket) {
+    struct pollfd pfd;
+    OFC_CHAR c;
+    ssize_t n;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    pfd.fd = ofc_socket_impl_get_fd(hSocket);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (pfd.fd >= 0 && poll(&pfd, 1, 0) >= 0) {
+        if (pfd.revents == 0)
+            ret = ofc_socket_impl_connected(hSocket);
+        else if (!(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+            n = recv(pfd.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            ret = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+        }
+    }
+    return (ret);
+}
+
+OFC_CONN_POOL *ofc_pool_impl_create(const OFC_POOL_CONFIG *config,
+                                    const OFC_SOCKET_PROFILE *profile) {
+    OFC_CONN_POOL *pool;
+    OFC_INT i;
+
+    pool = ofc_malloc(sizeof(OFC_CONN_POOL));
+    if (pool != OFC_NULL) {
+        pthread_mutex_init(&pool->mutex, NULL);
+        pool->config = *config;
+        if (pool->config.max_per_key <= 0)
+            pool->config.max_per_key = POOL_DEFAULT_PER_KEY;
+        if (pool->config.max_total <= 0)
+            pool->config.max_total = POOL_DEFAULT_TOTAL;
+        if (pool->config.idle_timeout <= 0)
+            pool->config.idle_timeout = POOL_DEFAULT_IDLE;
+        if (pool->config.connect_timeout <= 0)
+            pool->config.connect_timeout = POOL_DEFAULT_CONNECT;
+        pool->has_profile = (profile != OFC_NULL);
+        if (profile != OFC_NULL)
+            pool->profile = *profile;
+        for (i = 0; i < POOL_BUCKETS; i++) {
+            pool->keys[i] = OFC_NULL;
+            pool->busy[i] = OFC_NULL;
+        }
+        pool->lru_head = OFC_NULL;
+        pool->lru_tail = OFC_NULL;
+        ofc_memset(&pool->stats, 0, sizeof(pool->stats));
+    }
+    return (pool);
+}
+
+OFC_VOID ofc_pool_impl_destroy(OFC_CONN_POOL *pool) {
+    POOL_CONN *conn;
+    POOL_KEY *key;
+    OFC_INT i;
+
+    if (pool != OFC_NULL) {
+        while (pool->lru_head != OFC_NULL) {
+            conn = pool->lru_head;
+            pool_idle_remove(pool, conn);
+            pool_close(pool, conn);
+        }
+        for (i = 0; i < POOL_BUCKETS; i++) {
+            while (pool->busy[i] != OFC_NULL) {
+                conn = pool->busy[i];
+                pool->busy[i] = conn->next;
+                ofc_free(conn);
+            }
+            while (pool->keys[i] != OFC_NULL) {
+                key = pool->keys[i];
+                pool->keys[i] = key->next;
+                ofc_free(key);
+            }
+        }
+        pthread_mutex_destroy(&pool->mutex);
+        ofc_free(pool);
+    }
+}
+
+OFC_HANDLE ofc_pool_impl_get(OFC_CONN_POOL *pool, const OFC_IPADDR *ip,
+                             OFC_UINT16 port) {
+    OFC_HANDLE hSocket;
+    POOL_KEY *key;
+    POOL_CONN *conn;
+    OFC_BOOL done;
+
+    hSocket = OFC_HANDLE_NULL;
+    done = OFC_FALSE;
+    while (!done) {
+        pthread_mutex_lock(&pool->mutex);
+        pool_expire(pool, ofc_time_get_now());
+        key = pool_key_find(pool, ip, port);
+        if (key == OFC_NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            done = OFC_TRUE;
+        } else if (key->idle != OFC_NULL) {
+            /*
+             * Check it with the lock dropped.  It's in the busy table
+             * meanwhile, so it counts against the limits.
+             */
+            conn = key->idle;
+            pool_idle_remove(pool, conn);
+            pool_busy_add(pool, conn);
+            pthread_mutex_unlock(&pool->mutex);
+
+            if (pool_sound(conn->hSocket)) {
+                hSocket = conn->hSocket;
+                pthread_mutex_lock(&pool->mutex);
+                pool->stats.hits++;
+                pthread_mutex_unlock(&pool->mutex);
+                done = OFC_TRUE;
+            } else {
+                pthread_mutex_lock(&pool->mutex);
+                pool_busy_remove(pool, conn->hSocket);
+                pool_close(pool, conn);
+                pool->stats.stale++;
+                pthread_mutex_unlock(&pool->mutex);
+            }
+        } else {
+            if (key->open < pool->config.max_per_key &&
+                pool->stats.open >= pool->config.max_total &&
+                pool->lru_head != OFC_NULL) {
+                /*
+                 * Full.  Make room by closing the connection that has
+                 * been idle longest.
+                 */
+                conn = pool->lru_head;
+                pool_idle_remove(pool, conn);
+                pool_close(pool, conn);
+                pool->stats.evicted++;
+            }
+
+            if (key->open >= pool->config.max_per_key ||
+                pool->stats.open >= pool->config.max_total) {
+                pool->stats.refused++;
+                pool_key_release(pool, key);
+                pthread_mutex_unlock(&pool->mutex);
+            } else {
+                /*
+                 * Hold the slot while connecting without the lock
+                 */
+                key->open++;
+                pool->stats.open++;
+                pool->stats.misses++;
+                pthread_mutex_unlock(&pool->mutex);
+
+                hSocket = ofc_connect_impl_race(ip, 1, port,
+                                                pool->has_profile ?
+                                                &pool->profile : OFC_NULL,
+                                                pool->config.connect_timeout,
+                                                OFC_NULL);
+
+                pthread_mutex_lock(&pool->mutex);
+                conn = OFC_NULL;
+                if (hSocket != OFC_HANDLE_NULL) {
+                    conn = ofc_malloc(sizeof(POOL_CONN));
+                    if (conn == OFC_NULL) {
+                        ofc_socket_impl_destroy(hSocket);
+                        hSocket = OFC_HANDLE_NULL;
+                    }
+                }
+                if (conn != OFC_NULL) {
+                    conn->hSocket = hSocket;
+                    conn->key = key;
+                    pool_busy_add(pool, conn);
+                } else {
+                    key->open--;
+                    pool->stats.open--;
+                    pool->stats.failed++;
+                    pool_key_release(pool, key);
+                }
+                pthread_mutex_unlock(&pool->mutex);
+            }
+            done = OFC_TRUE;
+        }
+    }
+    return (hSocket);
+}
+
+OFC_VOID ofc_pool_impl_put(OFC_CONN_POOL *pool, OFC_HANDLE hSocket,
+                           OFC_BOOL reusable) {
+    POOL_CONN *conn;
+    POOL_CONN *idle;
+
+    pthread_mutex_lock(&pool->mutex);
+    conn = pool_busy_remove(pool, hSocket);
+    if (conn == OFC_NULL && hSocket != OFC_HANDLE_NULL) {
+        /*
+         * Not one of ours, or so it would leak.  One already given back
+         * is left alone.
+         */
+        for (idle = pool->lru_head;
+             idle != OFC_NULL && idle->hSocket != hSocket;
+             idle = idle->lru_next);
+        if (idle == OFC_NULL)
+            ofc_socket_impl_destroy(hSocket);
+    } else if (conn != OFC_NULL) {
+        if (!reusable)
+            pool_close(pool, conn);
+        else {
+            conn->since = ofc_time_get_now();
+            conn->next = conn->key->idle;
+            conn->key->idle = conn;
+            conn->lru_next = OFC_NULL;
+            conn->lru_prev = pool->lru_tail;
+            if (pool->lru_tail != OFC_NULL)
+                pool->lru_tail->lru_next = conn;
+            else
+                pool->lru_head = conn;
+            pool->lru_tail = conn;
+            pool->stats.idle++;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+OFC_INT ofc_pool_impl_evict(OFC_CONN_POOL *pool) {
+    OFC_INT count;
+
+    pthread_mutex_lock(&pool->mutex);
+    count = pool_expire(pool, ofc_time_get_now());
+    pthread_mutex_unlock(&pool->mutex);
+    return (count);
+}
+
+OFC_VOID ofc_pool_impl_stats(OFC_CONN_POOL *pool, OFC_POOL_STATS *stats) {
+    pthread_mutex_lock(&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/** \} */
@@ -0,0 +1,629 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ofc/types.h"
+#include "ofc/handle.h"
+#include "ofc/libc.h"
+#include "ofc/net.h"
+#include "ofc/socket.h"
+#include "ofc/impl/socketimpl.h"
+#include "ofc/time.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/socket_darwin.h"
+#include "ofc_darwin/probe_darwin.h"
+
+/**
+ * \defgroup probe_darwin Darwin ICMP Probe Engine
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+#define PROBE_INTERVAL_DEFAULT 1000
+#define PROBE_TIMEOUT_DEFAULT 1000
+
+#define PROBE_ECHO_REPLY 0
+#define PROBE_UNREACH 3
+#define PROBE_ECHO_REQUEST 8
+#define PROBE6_UNREACH 1
+#define PROBE6_ECHO_REQUEST 128
+#define PROBE6_ECHO_REPLY 129
+#define PROBE6_NEXT_ICMP 58
+
+#define PROBE_HEADER 8
+#define PROBE_COOKIE 8
+#define PROBE_PACKET (PROBE_HEADER + PROBE_COOKIE)
+#define PROBE_RECV_SIZE 1500
+
+/*
+ * Index of each family's socket
+ */
+#define PROBE_V4 0
+#define PROBE_V6 1
+#define PROBE_FAMILIES 2
+
+typedef struct {
+    OFC_BOOL valid;
+    OFC_IPADDR ip;
+    /*
+     * The low byte of a sequence number is the host's slot, so a reply
+     * finds its host without a search.  The high byte counts rounds.
+     */
+    OFC_UINT8 round;
+    OFC_BOOL outstanding;
+    OFC_UINT16 seq;
+    OFC_UINT64 sent_at;         /* ofc_socket_impl_stamp_now */
+    OFC_MSTIME next_send;
+    OFC_BOOL answered;          /* has replied at least once */
+    OFC_PROBE_STATS stats;
+} PROBE_HOST;
+
+struct _OFC_PROBE_ENGINE {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int wake[2];
+    OFC_BOOL woken;
+    OFC_BOOL shutdown;
+    OFC_MSTIME interval;
+    OFC_MSTIME timeout;
+    OFC_UINT16 ident;
+    OFC_UINT8 cookie[PROBE_COOKIE];
+    OFC_HANDLE hSocket[PROBE_FAMILIES];
+    /*
+     * Raw sockets see every ICMP message for the host and keep our echo
+     * identifier.  Datagram ones may have it rewritten by the kernel.
+     */
+    OFC_BOOL raw[PROBE_FAMILIES];
+    PROBE_HOST hosts[OFC_PROBE_MAX_HOSTS];
+    struct _OFC_PROBE_ENGINE *next;
+};
+
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OFC_PROBE_ENGINE *probe_engines = OFC_NULL;
+static OFC_UINT16 probe_count = 0;
+
+static OFC_INT probe_family(const OFC_IPADDR *ip) {
+    return (ip->ip_version == OFC_FAMILY_IP ? PROBE_V4 : PROBE_V6);
+}
+
+/*
+ * Replies to a link local target needn't carry the scope we sent with,
+ * so hosts are matched on the address alone
+ */
+static PROBE_HOST *probe_find(OFC_PROBE_ENGINE *engine,
+                              const OFC_IPADDR *ip) {
+    PROBE_HOST *host;
+    OFC_INT i;
+
+    host = OFC_NULL;
+    for (i = 0; i < OFC_PROBE_MAX_HOSTS && host == OFC_NULL; i++)
+        if (engine->hosts[i].valid &&
+            ofc_socket_impl_ip_equal(&engine->hosts[i].ip, ip, OFC_FALSE))
+            host = &engine->hosts[i];
+    return (host);
+}
+
+static OFC_VOID probe_wake(OFC_PROBE_ENGINE *engine) {
+    OFC_CHAR c;
+
+    if (!engine->woken) {
+        engine->woken = OFC_TRUE;
+        c = 0;
+        write(engine->wake[1], &c, 1);
+    }
+}
+
+static OFC_UINT16 probe_checksum(const OFC_UINT8 *buf, OFC_SIZET len) {
+    OFC_UINT32 sum;
+    OFC_SIZET i;
+
+    sum = 0;
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    if (i < len)
+        sum += buf[i] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ((OFC_UINT16) ~sum);
+}
+
+static OFC_VOID probe_lost(PROBE_HOST *host, OFC_BOOL unreachable) {
+    host->outstanding = OFC_FALSE;
+    host->stats.lost++;
+    host->stats.loss = (7 * host->stats.loss + 1000) / 8;
+    /*
+     * Silence only counts against a host that has answered before, since
+     * plenty of servers drop ICMP.  The network saying it can't get there
+     * counts regardless.
+     */
+    if (unreachable ||
+        (host->answered && host->stats.lost >= OFC_PROBE_DOWN_LOSSES))
+        host->stats.state = OFC_PROBE_DOWN;
+}
+
+static OFC_VOID probe_answered(PROBE_HOST *host, OFC_UINT64 now_us) {
+    OFC_UINT32 rtt;
+    OFC_UINT32 delta;
+
+    rtt = (OFC_UINT32) (now_us > host->sent_at ? now_us - host->sent_at : 0);
+    /*
+     * RFC 6298 smoothing
+     */
+    if (host->stats.received == 0) {
+        host->stats.srtt_us = rtt;
+        host->stats.rttvar_us = rtt / 2;
+        host->stats.min_us = rtt;
+    } else {
+        delta = host->stats.srtt_us > rtt ?
+                host->stats.srtt_us - rtt : rtt - host->stats.srtt_us;
+        host->stats.rttvar_us = (3 * host->stats.rttvar_us + delta) / 4;
+        host->stats.srtt_us = (7 * host->stats.srtt_us + rtt) / 8;
+        if (rtt < host->stats.min_us)
+            host->stats.min_us = rtt;
+    }
+    host->stats.received++;
+    host->stats.lost = 0;
+    host->stats.loss = (7 * host->stats.loss) / 8;
+    host->stats.last_reply = ofc_time_get_now();
+    host->stats.state = OFC_PROBE_UP;
+    host->answered = OFC_TRUE;
+    host->outstanding = OFC_FALSE;
+}
+
+static OFC_VOID probe_send(OFC_PROBE_ENGINE *engine, PROBE_HOST *host,
+                           OFC_MSTIME now) {
+    OFC_UINT8 packet[PROBE_PACKET];
+    OFC_INT family;
+    OFC_UINT16 csum;
+    OFC_SIZET status;
+
+    family = probe_family(&host->ip);
+    host->seq = (OFC_UINT16) ((host->round++ << 8) |
+                              (host - engine->hosts));
+
+    packet[0] = family == PROBE_V4 ? PROBE_ECHO_REQUEST : PROBE6_ECHO_REQUEST;
+    packet[1] = 0;
+    packet[2] = 0;
+    packet[3] = 0;
+    packet[4] = (OFC_UINT8) (engine->ident >> 8);
+    packet[5] = (OFC_UINT8) engine->ident;
+    packet[6] = (OFC_UINT8) (host->seq >> 8);
+    packet[7] = (OFC_UINT8) host->seq;
+    ofc_memcpy(packet + PROBE_HEADER, engine->cookie, PROBE_COOKIE);
+    /*
+     * The kernel fills in the ICMPv6 checksum, which covers a pseudo
+     * header we don't have
+     */
+    if (family == PROBE_V4) {
+        csum = probe_checksum(packet, PROBE_PACKET);
+        packet[2] = (OFC_UINT8) (csum >> 8);
+        packet[3] = (OFC_UINT8) csum;
+    }
+
+    host->next_send = now + engine->interval;
+    host->sent_at = ofc_socket_impl_stamp_now();
+    status = ofc_socket_impl_sendto(engine->hSocket[family], packet,
+                                    PROBE_PACKET, &host->ip, 0);
+    if (status == PROBE_PACKET) {
+        host->outstanding = OFC_TRUE;
+        host->stats.sent++;
+    } else if (status == (OFC_SIZET) -1 &&
+               (errno == EHOSTUNREACH || errno == ENETUNREACH ||
+                errno == EHOSTDOWN)) {
+        host->stats.sent++;
+        probe_lost(host, OFC_TRUE);
+    }
+    /*
+     * Anything else, a full send buffer say, says nothing about the
+     * host.  Try again next interval.
+     */
+}
+
+/*
+ * Send the probes that are due and expire the ones that have gone
+ * unanswered.  Returns the milliseconds until there's more to do, or -1.
+ * Called with the engine locked.
+ */
+static OFC_INT probe_run(OFC_PROBE_ENGINE *engine) {
+    PROBE_HOST *host;
+    OFC_MSTIME now;
+    OFC_UINT64 now_us;
+    OFC_INT wait;
+    OFC_INT remaining;
+    OFC_INT i;
+
+    now = ofc_time_get_now();
+    now_us = ofc_socket_impl_stamp_now();
+    wait = -1;
+    for (i = 0; i < OFC_PROBE_MAX_HOSTS; i++) {
+        host = &engine->hosts[i];
+        if (!host->valid)
+            continue;
+        if (host->outstanding &&
+            now_us - host->sent_at >= (OFC_UINT64) engine->timeout * 1000)
+            probe_lost(host, OFC_FALSE);
+        if (!host->outstanding && (OFC_INT) (host->next_send - now) <= 0)
+            probe_send(engine, host, now);
+
+        remaining = (OFC_INT) (host->next_send - now);
+        if (host->outstanding) {
+            now_us = ofc_socket_impl_stamp_now();
+            if (now_us - host->sent_at < (OFC_UINT64) engine->timeout * 1000)
+                remaining = (OFC_INT) ((engine->timeout * 1000 -
+                                        (now_us - host->sent_at) + 999) /
+                                       1000);
+            else
+                remaining = 0;
+        }
+        if (remaining < 0)
+            remaining = 0;
+        if (wait < 0 || remaining < wait)
+            wait = remaining;
+    }
+    return (wait);
+}
+
+/*
+ * Account for a reply, or an error quoting one of our requests.  Called
+ * with the engine locked.
+ */
+static OFC_VOID probe_match(OFC_PROBE_ENGINE *engine, OFC_INT family,
+                            const OFC_IPADDR *ip, const OFC_UINT8 *echo,
+                            OFC_BOOL unreachable, OFC_UINT64 now_us) {
+    PROBE_HOST *host;
+    OFC_UINT16 ident;
+    OFC_UINT16 seq;
+
+    ident = (OFC_UINT16) ((echo[4] << 8) | echo[5]);
+    seq = (OFC_UINT16) ((echo[6] << 8) | echo[7]);
+    host = &engine->hosts[seq & 0xff];
+    if (host->valid && host->outstanding && host->seq == seq &&
+        probe_family(&host->ip) == family &&
+        (!engine->raw[family] || ident == engine->ident) &&
+        ofc_socket_impl_ip_equal(&host->ip, ip, OFC_FALSE)) {
+        if (unreachable)
+            probe_lost(host, OFC_TRUE);
+        else
+            probe_answered(host, now_us);
+    }
+}
+
+/*
+ * Read everything queued on a family's socket.  Called with the engine
+ * locked.
+ */
+static OFC_VOID probe_receive(OFC_PROBE_ENGINE *engine, OFC_INT family) {
+    OFC_UINT8 buf[PROBE_RECV_SIZE];
+    OFC_SIZET len;
+    OFC_SIZET hlen;
+    OFC_UINT8 *icmp;
+    OFC_UINT8 *inner;
+    OFC_IPADDR from;
+    OFC_IPADDR target;
+    OFC_UINT64 now_us;
+
+    while ((len = ofc_socket_impl_recv_from(engine->hSocket[family], buf,
+                                            sizeof(buf), &from,
+                                            OFC_NULL)) > 0) {
+        now_us = ofc_socket_impl_stamp_now();
+        /*
+         * IPv4 raw sockets, and Darwin's datagram ones, pass up the IP
+         * header.  No ICMP type we care about looks like a version 4
+         * header.
+         */
+        icmp = buf;
+        if (family == PROBE_V4 && len >= 20 && (buf[0] >> 4) == 4) {
+            hlen = (buf[0] & 0x0f) * 4;
+            if (hlen > len)
+                continue;
+            icmp += hlen;
+            len -= hlen;
+        }
+        if (len < PROBE_HEADER)
+            continue;
+
+        if (icmp[0] == (family == PROBE_V4 ?
+                        PROBE_ECHO_REPLY : PROBE6_ECHO_REPLY)) {
+            if (len >= PROBE_PACKET &&
+                ofc_memcmp(icmp + PROBE_HEADER, engine->cookie,
+                           PROBE_COOKIE) == 0)
+                probe_match(engine, family, &from, icmp, OFC_FALSE, now_us);
+        } else if (family == PROBE_V4 && icmp[0] == PROBE_UNREACH) {
+            /*
+             * Quotes the IP header of our request and the first eight
+             * bytes of its ICMP header, enough for the sequence but not
+             * the cookie
+             */
+            inner = icmp + PROBE_HEADER;
+            len -= PROBE_HEADER;
+            if (len < 20)
+                continue;
+            hlen = (inner[0] & 0x0f) * 4;
+            if (hlen < 20 || len < hlen + PROBE_HEADER ||
+                inner[hlen] != PROBE_ECHO_REQUEST)
+                continue;
+            target.ip_version = OFC_FAMILY_IP;
+            target.u.ipv4.addr = OFC_NET_NTOL (inner, 16);
+            probe_match(engine, family, &target, inner + hlen, OFC_TRUE,
+                        now_us);
+        } else if (family == PROBE_V6 && icmp[0] == PROBE6_UNREACH) {
+            inner = icmp + PROBE_HEADER;
+            len -= PROBE_HEADER;
+            if (len < 40 + PROBE_HEADER || inner[6] != PROBE6_NEXT_ICMP ||
+                inner[40] != PROBE6_ECHO_REQUEST)
+                continue;
+            target.ip_version = OFC_FAMILY_IPV6;
+            target.u.ipv6.scope = 0;
+            ofc_memcpy(target.u.ipv6._s6_addr, inner + 24, 16);
+            probe_match(engine, family, &target, inner + 40, OFC_TRUE,
+                        now_us);
+        }
+    }
+}
+
+static OFC_VOID *probe_engine(OFC_VOID *arg) {
+    OFC_PROBE_ENGINE *engine;
+    struct pollfd pfds[1 + PROBE_FAMILIES];
+    OFC_INT families[1 + PROBE_FAMILIES];
+    OFC_INT count;
+    OFC_INT wait;
+    OFC_INT i;
+    OFC_CHAR drain[64];
+
+    engine = arg;
+
+    pthread_mutex_lock(&engine->mutex);
+    while (!engine->shutdown) {
+        wait = probe_run(engine);
+
+        count = 0;
+        pfds[count].fd = engine->wake[0];
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+        families[count++] = -1;
+        for (i = 0; i < PROBE_FAMILIES; i++) {
+            if (engine->hSocket[i] != OFC_HANDLE_NULL) {
+                pfds[count].fd = ofc_socket_impl_get_fd(engine->hSocket[i]);
+                pfds[count].events = POLLIN;
+                pfds[count].revents = 0;
+                families[count++] = i;
+            }
+        }
+        engine->woken = OFC_FALSE;
+        pthread_mutex_unlock(&engine->mutex);
+
+        poll(pfds, count, wait);
+
+        pthread_mutex_lock(&engine->mutex);
+        if (pfds[0].revents & POLLIN)
+            while (read(engine->wake[0], drain, sizeof(drain)) > 0);
+        for (i = 1; i < count; i++)
+            if (pfds[i].revents != 0)
+                probe_receive(engine, families[i]);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return (OFC_NULL);
+}
+
+static OFC_HANDLE probe_open(OFC_FAMILY_TYPE family, OFC_BOOL *raw) {
+    OFC_HANDLE hSocket;
+    int type;
+    socklen_t typelen;
+
+    hSocket = ofc_socket_impl_create(family, SOCKET_TYPE_ICMP);
+    if (hSocket != OFC_HANDLE_NULL) {
+        if (!ofc_socket_impl_no_block(hSocket, OFC_TRUE)) {
+            ofc_socket_impl_destroy(hSocket);
+            hSocket = OFC_HANDLE_NULL;
+        } else {
+            type = SOCK_DGRAM;
+            typelen = sizeof(type);
+            getsockopt(ofc_socket_impl_get_fd(hSocket), SOL_SOCKET, SO_TYPE,
+                       &type, &typelen);
+            *raw = (type == SOCK_RAW);
+        }
+    }
+    return (hSocket);
+}
+
+static OFC_VOID probe_close(OFC_PROBE_ENGINE *engine) {
+    OFC_INT i;
+
+    for (i = 0; i < PROBE_FAMILIES; i++)
+        if (engine->hSocket[i] != OFC_HANDLE_NULL)
+            ofc_socket_impl_destroy(engine->hSocket[i]);
+}
+
+OFC_PROBE_ENGINE *ofc_probe_impl_create(OFC_MSTIME interval,
+                                        OFC_MSTIME timeout) {
+    OFC_PROBE_ENGINE *engine;
+    OFC_UINT64 seed;
+    OFC_INT i;
+
+    engine = ofc_malloc(sizeof(OFC_PROBE_ENGINE));
+    if (engine != OFC_NULL) {
+        engine->woken = OFC_FALSE;
+        engine->shutdown = OFC_FALSE;
+        engine->interval = interval != 0 ? interval : PROBE_INTERVAL_DEFAULT;
+        engine->timeout = timeout != 0 ? timeout : PROBE_TIMEOUT_DEFAULT;
+        if (engine->timeout > engine->interval)
+            engine->timeout = engine->interval;
+        for (i = 0; i < OFC_PROBE_MAX_HOSTS; i++)
+            engine->hosts[i].valid = OFC_FALSE;
+        engine->next = OFC_NULL;
+
+        /*
+         * Tell our replies from those to other engines and processes
+         * sharing the raw stream
+         */
+        pthread_mutex_lock(&probe_mutex);
+        engine->ident = (OFC_UINT16) (getpid() + probe_count++);
+        pthread_mutex_unlock(&probe_mutex);
+        seed = ofc_socket_impl_stamp_now() ^
+               (OFC_UINT64) (OFC_SIZET) engine;
+        for (i = 0; i < PROBE_COOKIE; i++)
+            engine->cookie[i] = (OFC_UINT8) (seed >> (i * 8));
+
+        engine->hSocket[PROBE_V4] = probe_open(OFC_FAMILY_IP,
+                                               &engine->raw[PROBE_V4]);
+        engine->hSocket[PROBE_V6] = probe_open(OFC_FAMILY_IPV6,
+                                               &engine->raw[PROBE_V6]);
+        pthread_mutex_init(&engine->mutex, NULL);
+
+        if (engine->hSocket[PROBE_V4] == OFC_HANDLE_NULL &&
+            engine->hSocket[PROBE_V6] == OFC_HANDLE_NULL) {
+            pthread_mutex_destroy(&engine->mutex);
+            ofc_free(engine);
+            engine = OFC_NULL;
+        } else if (pipe(engine->wake) != 0) {
+            probe_close(engine);
+            pthread_mutex_destroy(&engine->mutex);
+            ofc_free(engine);
+            engine = OFC_NULL;
+        } else {
+            fcntl(engine->wake[0], F_SETFL,
+                  fcntl(engine->wake[0], F_GETFL) | O_NONBLOCK);
+            fcntl(engine->wake[1], F_SETFL,
+                  fcntl(engine->wake[1], F_GETFL) | O_NONBLOCK);
+            if (pthread_create(&engine->thread, NULL, probe_engine,
+                               engine) != 0) {
+                close(engine->wake[0]);
+                close(engine->wake[1]);
+                probe_close(engine);
+                pthread_mutex_destroy(&engine->mutex);
+                ofc_free(engine);
+                engine = OFC_NULL;
+            } else {
+                pthread_mutex_lock(&probe_mutex);
+                engine->next = probe_engines;
+                probe_engines = engine;
+                pthread_mutex_unlock(&probe_mutex);
+            }
+        }
+    }
+    return (engine);
+}
+
+OFC_VOID ofc_probe_impl_destroy(OFC_PROBE_ENGINE *engine) {
+    OFC_PROBE_ENGINE **link;
+
+    if (engine != OFC_NULL) {
+        pthread_mutex_lock(&probe_mutex);
+        for (link = &probe_engines; *link != engine; link = &(*link)->next);
+        *link = engine->next;
+        pthread_mutex_unlock(&probe_mutex);
+
+        pthread_mutex_lock(&engine->mutex);
+        engine->shutdown = OFC_TRUE;
+        probe_wake(engine);
+        pthread_mutex_unlock(&engine->mutex);
+        pthread_join(engine->thread, OFC_NULL);
+
+        close(engine->wake[0]);
+        close(engine->wake[1]);
+        probe_close(engine);
+        pthread_mutex_destroy(&engine->mutex);
+        ofc_free(engine);
+    }
+}
+
+OFC_BOOL ofc_probe_impl_add(OFC_PROBE_ENGINE *engine, const OFC_IPADDR *ip) {
+    PROBE_HOST *host;
+    OFC_INT i;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    pthread_mutex_lock(&engine->mutex);
+    if (probe_find(engine, ip) != OFC_NULL)
+        ret = OFC_TRUE;
+    else if (engine->hSocket[probe_family(ip)] != OFC_HANDLE_NULL) {
+        for (i = 0; i < OFC_PROBE_MAX_HOSTS && engine->hosts[i].valid; i++);
+        if (i < OFC_PROBE_MAX_HOSTS) {
+            host = &engine->hosts[i];
+            ofc_memset(host, '\0', sizeof(PROBE_HOST));
+            host->valid = OFC_TRUE;
+            host->ip = *ip;
+            host->next_send = ofc_time_get_now();
+            host->stats.state = OFC_PROBE_UNKNOWN;
+            probe_wake(engine);
+            ret = OFC_TRUE;
+        }
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return (ret);
+}
+
+OFC_VOID ofc_probe_impl_remove(OFC_PROBE_ENGINE *engine,
+                               const OFC_IPADDR *ip) {
+    PROBE_HOST *host;
+
+    pthread_mutex_lock(&engine->mutex);
+    host = probe_find(engine, ip);
+    if (host != OFC_NULL)
+        host->valid = OFC_FALSE;
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+OFC_VOID ofc_probe_impl_kick(OFC_PROBE_ENGINE *engine) {
+    OFC_MSTIME now;
+    OFC_INT i;
+
+    pthread_mutex_lock(&engine->mutex);
+    now = ofc_time_get_now();
+    for (i = 0; i < OFC_PROBE_MAX_HOSTS; i++)
+        if (engine->hosts[i].valid && !engine->hosts[i].outstanding)
+            engine->hosts[i].next_send = now;
+    probe_wake(engine);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+OFC_BOOL ofc_probe_impl_stats(OFC_PROBE_ENGINE *engine, const OFC_IPADDR *ip,
+                              OFC_PROBE_STATS *stats) {
+    PROBE_HOST *host;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    pthread_mutex_lock(&engine->mutex);
+    host = probe_find(engine, ip);
+    if (host != OFC_NULL) {
+        if (stats != OFC_NULL)
+            *stats = host->stats;
+        ret = OFC_TRUE;
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return (ret);
+}
+
+OFC_PROBE_STATE ofc_probe_impl_state(const OFC_IPADDR *ip) {
+    OFC_PROBE_ENGINE *engine;
+    PROBE_HOST *host;
+    OFC_PROBE_STATE ret;
+
+    ret = OFC_PROBE_UNKNOWN;
+    pthread_mutex_lock(&probe_mutex);
+    for (engine = probe_engines;
+         engine != OFC_NULL && ret != OFC_PROBE_UP; engine = engine->next) {
+        pthread_mutex_lock(&engine->mutex);
+        host = probe_find(engine, ip);
+        if (host != OFC_NULL && host->stats.state != OFC_PROBE_UNKNOWN)
+            ret = host->stats.state;
+        pthread_mutex_unlock(&engine->mutex);
+    }
+    pthread_mutex_unlock(&probe_mutex);
+    return (ret);
+}
+
+/** \} */
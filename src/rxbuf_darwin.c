@@ -0,0 +1,303 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is governed by a Creative Commons
+ * Attribution-NoDerivatives 4.0 International license that can be
+ * found in the LICENSE file.
+ */
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ofc/types.h"
+#include "ofc/libc.h"
+
+#include "ofc/heap.h"
+
+#include "ofc_darwin/rxbuf_darwin.h"
+
+/**
+ * \defgroup rxbuf_darwin Darwin Receive Buffer Pool
+ * \ingroup darwin
+ */
+
+/** \{ */
+
+/*
+ * Slabs are mapped at least this large so small classes aren't mapped a
+ * page at a time
+ */
+#define RXBUF_SLAB_BYTES (256 * 1024)
+/*
+ * Bytes a thread may cache per class.  Classes bigger than this cache a
+ * single buffer.
+ */
+#define RXBUF_CACHE_BYTES (2 * 1024 * 1024)
+
+static const OFC_SIZET rxbuf_class_size[OFC_RXBUF_CLASSES] = {
+        4 * 1024,
+        16 * 1024,
+        64 * 1024,
+        256 * 1024,
+        1024 * 1024 + 64 * 1024,
+        OFC_RXBUF_MAX_SIZE
+};
+
+typedef struct {
+    OFC_RXBUF *head[OFC_RXBUF_CLASSES];
+    OFC_INT count[OFC_RXBUF_CLASSES];
+} RXBUF_CACHE;
+
+/*
+ * Shared free lists, touched only when a thread cache runs dry or
+ * overflows, and then a batch at a time
+ */
+static pthread_mutex_t rxbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OFC_RXBUF *rxbuf_free[OFC_RXBUF_CLASSES];
+static OFC_SIZET rxbuf_limit = OFC_RXBUF_DEFAULT_LIMIT;
+static OFC_SIZET rxbuf_mapped = 0;
+static volatile OFC_SIZET rxbuf_in_use = 0;
+
+/*
+ * Each thread's cache is allocated on first use and hung off rxbuf_key,
+ * whose destructor empties and frees it.  It can't be __thread storage:
+ * Darwin frees that from its own key destructor, which may run first.
+ */
+static pthread_key_t rxbuf_key;
+static pthread_once_t rxbuf_once = PTHREAD_ONCE_INIT;
+
+static OFC_INT rxbuf_cache_max(OFC_INT sclass) {
+    OFC_INT max;
+
+    max = (OFC_INT) (RXBUF_CACHE_BYTES / rxbuf_class_size[sclass]);
+    return (max > 0 ? max : 1);
+}
+
+static OFC_INT rxbuf_class(OFC_SIZET size) {
+    OFC_INT sclass;
+
+    for (sclass = 0; sclass < OFC_RXBUF_CLASSES &&
+                     rxbuf_class_size[sclass] < size; sclass++);
+    return (sclass < OFC_RXBUF_CLASSES ? sclass : -1);
+}
+
+/*
+ * Move count buffers of a class from a thread cache to the shared list,
+ * or all of them if count is negative
+ */
+static OFC_VOID rxbuf_spill(RXBUF_CACHE *cache, OFC_INT sclass,
+                            OFC_INT count) {
+    OFC_RXBUF *buf;
+
+    pthread_mutex_lock(&rxbuf_mutex);
+    while (cache->head[sclass] != OFC_NULL && count != 0) {
+        buf = cache->head[sclass];
+        cache->head[sclass] = buf->next;
+        cache->count[sclass]--;
+        buf->next = rxbuf_free[sclass];
+        rxbuf_free[sclass] = buf;
+        if (count > 0)
+            count--;
+    }
+    pthread_mutex_unlock(&rxbuf_mutex);
+}
+
+static OFC_VOID rxbuf_cache_empty(RXBUF_CACHE *cache) {
+    OFC_INT sclass;
+
+    for (sclass = 0; sclass < OFC_RXBUF_CLASSES; sclass++)
+        rxbuf_spill(cache, sclass, -1);
+}
+
+static OFC_VOID rxbuf_thread_exit(OFC_VOID *arg) {
+    RXBUF_CACHE *cache;
+
+    cache = arg;
+    rxbuf_cache_empty(cache);
+    ofc_free(cache);
+}
+
+static OFC_VOID rxbuf_key_create(OFC_VOID) {
+    pthread_key_create(&rxbuf_key, rxbuf_thread_exit);
+}
+
+/*
+ * Map a slab for a class and put its buffers on the shared list.  Called
+ * with rxbuf_mutex held.
+ */
+static OFC_BOOL rxbuf_grow(OFC_INT sclass) {
+    OFC_SIZET size;
+    OFC_SIZET count;
+    OFC_SIZET data_len;
+    OFC_SIZET hdr_len;
+    OFC_SIZET page;
+    OFC_CHAR *data;
+    OFC_RXBUF *hdrs;
+    OFC_SIZET i;
+
+    size = rxbuf_class_size[sclass];
+    page = (OFC_SIZET) sysconf(_SC_PAGESIZE);
+
+    count = RXBUF_SLAB_BYTES / size;
+    if (count == 0)
+        count = 1;
+    if (rxbuf_mapped + count * size > rxbuf_limit)
+        count = rxbuf_mapped < rxbuf_limit ?
+                (rxbuf_limit - rxbuf_mapped) / size : 0;
+    if (count == 0)
+        return (OFC_FALSE);
+
+    data_len = count * size;
+    hdr_len = (count * sizeof(OFC_RXBUF) + page - 1) & ~(page - 1);
+
+    data = mmap(OFC_NULL, data_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (data == MAP_FAILED)
+        return (OFC_FALSE);
+    hdrs = mmap(OFC_NULL, hdr_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (hdrs == MAP_FAILED) {
+        munmap(data, data_len);
+        return (OFC_FALSE);
+    }
+
+    for (i = 0; i < count; i++) {
+        hdrs[i].data = data + i * size;
+        hdrs[i].size = size;
+        hdrs[i].len = 0;
+        hdrs[i].refcount = 0;
+        hdrs[i].sclass = sclass;
+        hdrs[i].next = rxbuf_free[sclass];
+        rxbuf_free[sclass] = &hdrs[i];
+    }
+    rxbuf_mapped += data_len;
+    return (OFC_TRUE);
+}
+
+/*
+ * Fill an empty thread cache with half its capacity from the shared list
+ */
+static OFC_VOID rxbuf_refill(RXBUF_CACHE *cache, OFC_INT sclass) {
+    OFC_RXBUF *buf;
+    OFC_INT want;
+
+    want = (rxbuf_cache_max(sclass) + 1) / 2;
+
+    pthread_mutex_lock(&rxbuf_mutex);
+    if (rxbuf_free[sclass] == OFC_NULL)
+        rxbuf_grow(sclass);
+    while (want > 0 && rxbuf_free[sclass] != OFC_NULL) {
+        buf = rxbuf_free[sclass];
+        rxbuf_free[sclass] = buf->next;
+        buf->next = cache->head[sclass];
+        cache->head[sclass] = buf;
+        cache->count[sclass]++;
+        want--;
+    }
+    pthread_mutex_unlock(&rxbuf_mutex);
+}
+
+/*
+ * Return this thread's cache, creating it on first use.  OFC_NULL if
+ * there's no memory for one.
+ */
+static RXBUF_CACHE *rxbuf_thread_cache(OFC_VOID) {
+    RXBUF_CACHE *cache;
+
+    pthread_once(&rxbuf_once, rxbuf_key_create);
+    cache = pthread_getspecific(rxbuf_key);
+    if (cache == OFC_NULL) {
+        cache = ofc_malloc(sizeof(RXBUF_CACHE));
+        if (cache != OFC_NULL) {
+            ofc_memset(cache, '\0', sizeof(RXBUF_CACHE));
+            if (pthread_setspecific(rxbuf_key, cache) != 0) {
+                ofc_free(cache);
+                cache = OFC_NULL;
+            }
+        }
+    }
+    return (cache);
+}
+
+OFC_RXBUF *ofc_rxbuf_impl_get(OFC_SIZET size) {
+    RXBUF_CACHE *cache;
+    OFC_RXBUF *buf;
+    OFC_INT sclass;
+
+    buf = OFC_NULL;
+    sclass = rxbuf_class(size);
+    if (sclass >= 0) {
+        cache = rxbuf_thread_cache();
+        if (cache != OFC_NULL && cache->head[sclass] == OFC_NULL)
+            rxbuf_refill(cache, sclass);
+
+        if (cache != OFC_NULL)
+            buf = cache->head[sclass];
+        if (buf != OFC_NULL) {
+            cache->head[sclass] = buf->next;
+            cache->count[sclass]--;
+            buf->next = OFC_NULL;
+            buf->len = 0;
+            buf->refcount = 1;
+            __atomic_add_fetch(&rxbuf_in_use, buf->size, __ATOMIC_RELAXED);
+        }
+    }
+    return (buf);
+}
+
+OFC_VOID ofc_rxbuf_impl_ref(OFC_RXBUF *buf) {
+    __atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+}
+
+OFC_VOID ofc_rxbuf_impl_release(OFC_RXBUF *buf) {
+    RXBUF_CACHE *cache;
+    OFC_INT sclass;
+    OFC_INT max;
+
+    if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_sub_fetch(&rxbuf_in_use, buf->size, __ATOMIC_RELAXED);
+
+        sclass = buf->sclass;
+        cache = rxbuf_thread_cache();
+        if (cache == OFC_NULL) {
+            /*
+             * No cache to keep it in.  Straight back to the shared list.
+             */
+            pthread_mutex_lock(&rxbuf_mutex);
+            buf->next = rxbuf_free[sclass];
+            rxbuf_free[sclass] = buf;
+            pthread_mutex_unlock(&rxbuf_mutex);
+        } else {
+            buf->next = cache->head[sclass];
+            cache->head[sclass] = buf;
+            cache->count[sclass]++;
+
+            max = rxbuf_cache_max(sclass);
+            if (cache->count[sclass] > max)
+                rxbuf_spill(cache, sclass, cache->count[sclass] - max / 2);
+        }
+    }
+}
+
+OFC_VOID ofc_rxbuf_impl_set_limit(OFC_SIZET limit) {
+    pthread_mutex_lock(&rxbuf_mutex);
+    rxbuf_limit = limit;
+    pthread_mutex_unlock(&rxbuf_mutex);
+}
+
+OFC_VOID ofc_rxbuf_impl_usage(OFC_RXBUF_USAGE *usage) {
+    pthread_mutex_lock(&rxbuf_mutex);
+    usage->limit = rxbuf_limit;
+    usage->mapped = rxbuf_mapped;
+    pthread_mutex_unlock(&rxbuf_mutex);
+    usage->in_use = __atomic_load_n(&rxbuf_in_use, __ATOMIC_RELAXED);
+}
+
+OFC_VOID ofc_rxbuf_impl_flush(OFC_VOID) {
+    RXBUF_CACHE *cache;
+
+    pthread_once(&rxbuf_once, rxbuf_key_create);
+    cache = pthread_getspecific(rxbuf_key);
+    if (cache != OFC_NULL)
+        rxbuf_cache_empty(cache);
+}
+
+/** \} */
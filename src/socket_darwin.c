@@ -5,19 +5,31 @@
  */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
 #include <net/if.h>
 
 #if defined(TARGET_OS_MAC)
 #include <net/route.h>
 #endif
 
+#if defined(SO_TIMESTAMP_MONOTONIC)
+#include <mach/mach_time.h>
+#endif
+
 #include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "ofc/types.h"
 #include "ofc/handle.h"
@@ -28,6 +40,12 @@
 #include "ofc/net_internal.h"
 
 #include "ofc/heap.h"
+#include "ofc/time.h"
+#include "ofc/config.h"
+
+#include "ofc_darwin/socket_darwin.h"
+
+#include "ofc_darwin/config.h"
 
 /*
  * PSP_Socket - Create a Network Socket.
@@ -45,16 +63,690 @@
  *    Status (STATE_SUCCESS or STATE_FAIL)
  */
 
-typedef struct {
+typedef struct _OFC_SOCKET_IMPL {
     int socket;
     OFC_FAMILY_TYPE family;
     OFC_UINT16 events;
     OFC_UINT16 revents;
+    /*
+     * What to poll for: events plus write while a connect is pending.
+     * Kept up to date whenever either changes so the wait set can read
+     * it through a reference without locking.
+     */
+    OFC_UINT16 poll_events;
+    /*
+     * The handle holds one reference and each OFC_SOCKET_REF another.
+     * Closing or destroying the handle with references left swaps a dead
+     * socket in over the descriptor, releasing the endpoint, and the
+     * descriptor itself is closed with the last reference so its number
+     * can't be reused under one.  A closed socket refuses further I/O.
+     */
+    OFC_INT refcount;
+    OFC_BOOL closed;
+    /*
+     * Serializes the state sends and stamped receives share between the
+     * handle and references: the coalescing buffer and the delay
+     * histogram.  Taken inside the handle lock, never around it.
+     */
+    pthread_mutex_t io_mutex;
+    /*
+     * AF_UNIX socket.  family and ip are kept as IPv4 loopback so code
+     * that asks for an address gets something sensible.
+     */
+    OFC_BOOL local;
+    /*
+     * AF_INET6 socket that also carries IPv4 as mapped addresses.
+     * IPv4 addresses are mapped on the way in and back on the way out.
+     */
+    OFC_BOOL dual;
     OFC_IPADDR ip;
+    /*
+     * Destination of the last sendto, already in kernel form.  Repeated
+     * sends to the same peer reuse it as is.  dest_socklen of zero means
+     * the cache is empty.
+     */
+    OFC_IPADDR dest_ip;
+    OFC_UINT16 dest_port;
+    socklen_t dest_socklen;
+    struct sockaddr_storage dest_sockaddr;
+    OFC_SOCKET_TYPE type;
+    OFC_BOOL has_profile;
+    OFC_SOCKET_PROFILE profile;
+    /*
+     * Asynchronous connect.  While pending, the socket is polled for
+     * write regardless of events and connect_deadline, if set, bounds
+     * the wait.  connect_event is set when the connect resolves and
+     * cleared once ofc_socket_impl_test or ofc_socket_impl_connect_state
+     * has reported it.
+     */
+    OFC_SOCKET_CONNECT_STATE connect_state;
+    OFC_BOOL connect_timed;
+    OFC_MSTIME connect_deadline;
+    OFC_INT connect_error;
+    OFC_BOOL connect_event;
+    /*
+     * Graceful close.  Like a connect, a pending drain has its own poll
+     * event, read, and an optional deadline.
+     */
+    OFC_SOCKET_DRAIN_STATE drain_state;
+    OFC_BOOL drain_timed;
+    OFC_MSTIME drain_deadline;
+    OFC_BOOL drain_event;
+    /*
+     * Buffer autotuning.  tune_bytes and tune_last are the byte count
+     * and time of the previous sample.  tune_size is the size last asked
+     * for, which the kernel may have rounded or doubled.
+     */
+    OFC_BOOL autotune;
+    OFC_SOCKET_AUTOTUNE tune;
+    OFC_INT tune_size;
+    OFC_UINT64 tune_bytes;
+    OFC_MSTIME tune_last;
+    /*
+     * I/O counters.  Updated by whoever does the I/O and read by
+     * snapshots without a lock, so each field is accessed atomically.
+     * blocked_since is the time of the send that first hit EAGAIN, or
+     * zero while writes are going through.
+     */
+    OFC_SOCKET_STATS stats;
+    OFC_MSTIME blocked_since;
+    /*
+     * Receive queueing delay, allocated when kernel timestamps are
+     * turned on
+     */
+    OFC_SOCKET_DELAY *delay;
+    /*
+     * Write coalescing.  Sends that fit are held in coalesce_buf until
+     * it fills, the caller flushes, or the wait set is about to sleep.
+     * coalesce_size of zero means coalescing is off.  coalesce_error is
+     * the errno of a write that lost held data.  Flushes report it and
+     * the next send reports and clears it, so the wait set's flush
+     * can't swallow it.  Guarded by io_mutex, though coalesce_len is
+     * also read without it by the wait set.
+     */
+    OFC_UINT8 *coalesce_buf;
+    OFC_SIZET coalesce_size;
+    OFC_SIZET coalesce_len;
+    OFC_INT coalesce_error;
+    /*
+     * Live socket list, for snapshots.  live says whether the socket is
+     * on it.
+     */
+    OFC_BOOL live;
+    struct _OFC_SOCKET_IMPL *live_prev;
+    struct _OFC_SOCKET_IMPL *live_next;
 } OFC_SOCKET_IMPL;
 
+static const struct {
+    OFC_CCHAR *name;
+    OFC_SOCKET_PROFILE profile;
+} socket_profiles[] = {
+        /*
+         * Request/response traffic.  No Nagle, keep the unsent queue
+         * short so replies aren't stuck behind stale data, and notice
+         * dead peers within a couple of minutes.
+         */
+        {"interactive", {OFC_TRUE, OFC_TRUE, 60, 10, 6, 16 * 1024,
+                         OFC_FALSE, 0}},
+        /*
+         * Large transfers.  Full segments only, relaxed keepalive
+         */
+        {"bulk", {OFC_FALSE, OFC_TRUE, 300, 30, 5, 0, OFC_TRUE, 0}},
+        /*
+         * Name service and browse datagrams.  Nothing TCP applies
+         */
+        {"discovery", {OFC_FALSE, OFC_FALSE, 0, 0, 0, 0, OFC_FALSE, 0}},
+};
+
+/*
+ * Set the options in a profile on a raw socket.  Options the platform
+ * doesn't have are skipped.
+ */
+static OFC_BOOL apply_profile(int fd, OFC_SOCKET_TYPE socktype,
+                              const OFC_SOCKET_PROFILE *profile) {
+    OFC_BOOL ret;
+    int val;
+
+    ret = OFC_TRUE;
+    if (profile->recv_lowat > 0) {
+        val = profile->recv_lowat;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &val, sizeof(val)) != 0)
+            ret = OFC_FALSE;
+    }
+
+    if (socktype == SOCKET_TYPE_STREAM) {
+        val = profile->nodelay;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) != 0)
+            ret = OFC_FALSE;
+
+        val = profile->keepalive;
+        if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) != 0)
+            ret = OFC_FALSE;
+        if (profile->keepalive) {
+            if (profile->keepalive_idle > 0) {
+                val = profile->keepalive_idle;
+#if defined(TCP_KEEPALIVE)
+                if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE,
+                               &val, sizeof(val)) != 0)
+                    ret = OFC_FALSE;
+#elif defined(TCP_KEEPIDLE)
+                if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+                               &val, sizeof(val)) != 0)
+                    ret = OFC_FALSE;
+#endif
+            }
+#if defined(TCP_KEEPINTVL)
+            if (profile->keepalive_interval > 0) {
+                val = profile->keepalive_interval;
+                if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+                               &val, sizeof(val)) != 0)
+                    ret = OFC_FALSE;
+            }
+#endif
+#if defined(TCP_KEEPCNT)
+            if (profile->keepalive_count > 0) {
+                val = profile->keepalive_count;
+                if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,
+                               &val, sizeof(val)) != 0)
+                    ret = OFC_FALSE;
+            }
+#endif
+        }
+
+#if defined(TCP_NOTSENT_LOWAT)
+        if (profile->notsent_lowat > 0) {
+            val = profile->notsent_lowat;
+            if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                           &val, sizeof(val)) != 0)
+                ret = OFC_FALSE;
+        }
+#endif
+
+        val = profile->cork;
+#if defined(TCP_NOPUSH)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &val, sizeof(val)) != 0)
+            ret = OFC_FALSE;
+#elif defined(TCP_CORK)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) != 0)
+            ret = OFC_FALSE;
+#endif
+    }
+    return (ret);
+}
+
+const OFC_SOCKET_PROFILE *ofc_socket_impl_profile(OFC_CCHAR *name) {
+    const OFC_SOCKET_PROFILE *ret;
+    OFC_INT i;
+
+    ret = OFC_NULL;
+    for (i = 0;
+         ret == OFC_NULL &&
+         i < (OFC_INT) (sizeof(socket_profiles) / sizeof(socket_profiles[0]));
+         i++) {
+        if (ofc_strcmp(socket_profiles[i].name, name) == 0)
+            ret = &socket_profiles[i].profile;
+    }
+    return (ret);
+}
+
+/*
+ * Every open socket, newest first.  Lock order is handle, then list.
+ * Snapshots take a reference on each socket under the list lock and
+ * query the kernel after dropping it, so the lock is only ever held for
+ * a walk of the list.  A socket leaves the list when it is closed.
+ */
+static pthread_mutex_t socket_live_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OFC_SOCKET_IMPL *socket_live_head = OFC_NULL;
+static OFC_INT socket_live_count = 0;
+
+static OFC_VOID socket_live_add(OFC_SOCKET_IMPL *sock) {
+    ofc_memset(&sock->stats, 0, sizeof(sock->stats));
+    sock->blocked_since = 0;
+
+    pthread_mutex_lock(&socket_live_mutex);
+    sock->live = OFC_TRUE;
+    socket_live_count++;
+    sock->live_prev = OFC_NULL;
+    sock->live_next = socket_live_head;
+    if (socket_live_head != OFC_NULL)
+        socket_live_head->live_prev = sock;
+    socket_live_head = sock;
+    pthread_mutex_unlock(&socket_live_mutex);
+}
+
+static OFC_VOID socket_live_remove(OFC_SOCKET_IMPL *sock) {
+    pthread_mutex_lock(&socket_live_mutex);
+    if (sock->live) {
+        if (sock->live_prev != OFC_NULL)
+            sock->live_prev->live_next = sock->live_next;
+        else
+            socket_live_head = sock->live_next;
+        if (sock->live_next != OFC_NULL)
+            sock->live_next->live_prev = sock->live_prev;
+        sock->live = OFC_FALSE;
+        socket_live_count--;
+    }
+    pthread_mutex_unlock(&socket_live_mutex);
+}
+
+/*
+ * Account for a send.  status is the raw result of the call with errno
+ * still as the call left it.  The clock is only read on the way into and
+ * out of backpressure, never on a send that simply succeeds.  Going in
+ * and out is a swap on blocked_since, so senders racing through the
+ * handle and a reference count a stall once.
+ */
+#define STATS_ADD(field, n) __atomic_add_fetch(&(field), (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static OFC_VOID stats_send(OFC_SOCKET_IMPL *sock, OFC_SIZET len,
+                           ssize_t status) {
+    OFC_MSTIME now;
+    OFC_MSTIME expected;
+    OFC_MSTIME since;
+
+    STATS_ADD(sock->stats.sends, 1);
+    if (status < 0) {
+        if (errno == EAGAIN) {
+            STATS_ADD(sock->stats.send_again, 1);
+            if (STATS_LOAD(sock->blocked_since) == 0) {
+                now = ofc_time_get_now();
+                expected = 0;
+                __atomic_compare_exchange_n(&sock->blocked_since, &expected,
+                                            now != 0 ? now : 1, OFC_FALSE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED);
+            }
+        } else
+            STATS_ADD(sock->stats.errors, 1);
+    } else {
+        STATS_ADD(sock->stats.bytes_out, status);
+        if ((OFC_SIZET) status < len)
+            STATS_ADD(sock->stats.short_writes, 1);
+        if (STATS_LOAD(sock->blocked_since) != 0) {
+            since = __atomic_exchange_n(&sock->blocked_since, 0,
+                                        __ATOMIC_RELAXED);
+            if (since != 0)
+                STATS_ADD(sock->stats.write_blocked_ms,
+                          ofc_time_get_now() - since);
+        }
+    }
+}
+
+static OFC_VOID stats_recv(OFC_SOCKET_IMPL *sock, ssize_t status) {
+    STATS_ADD(sock->stats.recvs, 1);
+    if (status < 0) {
+        if (errno == EAGAIN)
+            STATS_ADD(sock->stats.recv_again, 1);
+        else
+            STATS_ADD(sock->stats.errors, 1);
+    } else
+        STATS_ADD(sock->stats.bytes_in, status);
+}
+
+/*
+ * Kernel receive timestamps.  Darwin can stamp with the monotonic clock,
+ * which doesn't jump when the time of day is set.  Elsewhere the stamp
+ * is wall clock time.  Either way it is kept in microseconds.
+ */
+#if defined(SO_TIMESTAMP_MONOTONIC)
+#define SOCKET_STAMP_OPT SO_TIMESTAMP_MONOTONIC
+#define SOCKET_STAMP_SCM SCM_TIMESTAMP_MONOTONIC
+#else
+#define SOCKET_STAMP_OPT SO_TIMESTAMP
+#define SOCKET_STAMP_SCM SCM_TIMESTAMP
+#endif
+
+#if defined(SO_TIMESTAMP_MONOTONIC)
+static OFC_UINT64 stamp_ticks_us(uint64_t ticks) {
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return ((OFC_UINT64) (ticks * timebase.numer / timebase.denom) / 1000);
+}
+#endif
+
+OFC_UINT64 ofc_socket_impl_stamp_now(OFC_VOID) {
+#if defined(SO_TIMESTAMP_MONOTONIC)
+    return (stamp_ticks_us(mach_absolute_time()));
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((OFC_UINT64) tv.tv_sec * 1000000 + tv.tv_usec);
+#endif
+}
+
+/*
+ * Pull the arrival time out of a received message and count how long the
+ * data waited.  Returns 0 if the kernel didn't stamp it.
+ */
+static OFC_UINT64 stamp_record(OFC_SOCKET_IMPL *sock, struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    OFC_UINT64 arrival;
+    OFC_UINT64 delay;
+    OFC_UINT64 now;
+    OFC_INT bucket;
+#if defined(SO_TIMESTAMP_MONOTONIC)
+    uint64_t ticks;
+#else
+    struct timeval tv;
+#endif
+
+    arrival = 0;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != OFC_NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SOCKET_STAMP_SCM) {
+#if defined(SO_TIMESTAMP_MONOTONIC)
+            ofc_memcpy(&ticks, CMSG_DATA(cmsg), sizeof(ticks));
+            arrival = stamp_ticks_us(ticks);
+#else
+            ofc_memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+            arrival = (OFC_UINT64) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+        }
+    }
+
+    if (arrival != 0 && sock->delay != OFC_NULL) {
+        now = ofc_socket_impl_stamp_now();
+        /*
+         * A wall clock stamp can be ahead of now if the clock was set
+         * back in between
+         */
+        delay = now > arrival ? now - arrival : 0;
+        bucket = 0;
+        if (delay > 0)
+            bucket = 64 - __builtin_clzll(delay);
+        if (bucket >= OFC_SOCKET_DELAY_BUCKETS)
+            bucket = OFC_SOCKET_DELAY_BUCKETS - 1;
+        sock->delay->buckets[bucket]++;
+        sock->delay->count++;
+        sock->delay->total_us += delay;
+        if (delay > sock->delay->max_us)
+            sock->delay->max_us = delay;
+    }
+    return (arrival);
+}
+
+/*
+ * Turn kernel timestamps on or off for a locked socket
+ */
+static OFC_BOOL socket_stamp_enable(OFC_SOCKET_IMPL *sock, OFC_BOOL onoff) {
+    OFC_BOOL ret;
+    int on;
+
+    ret = OFC_FALSE;
+    on = onoff;
+    if (setsockopt(sock->socket, SOL_SOCKET, SOCKET_STAMP_OPT,
+                   &on, sizeof(on)) == 0) {
+        ret = OFC_TRUE;
+        if (onoff && sock->delay == OFC_NULL) {
+            sock->delay = ofc_malloc(sizeof(OFC_SOCKET_DELAY));
+            if (sock->delay != OFC_NULL)
+                ofc_memset(sock->delay, 0, sizeof(OFC_SOCKET_DELAY));
+            else
+                ret = OFC_FALSE;
+        } else if (!onoff && sock->delay != OFC_NULL) {
+            ofc_free(sock->delay);
+            sock->delay = OFC_NULL;
+        }
+    }
+    return (ret);
+}
+
+/*
+ * Socket structures are recycled through a short free list so that
+ * accepting a burst of connections doesn't go to the heap for each one.
+ */
+#define SOCKET_IMPL_CACHE_MAX 64
+/*
+ * How long a close waits for coalesced data to go when SO_LINGER isn't
+ * set, in milliseconds
+ */
+#define SOCKET_CLOSE_LINGER 1000
+
+static pthread_mutex_t socket_impl_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OFC_SOCKET_IMPL *socket_impl_cache[SOCKET_IMPL_CACHE_MAX];
+static OFC_INT socket_impl_cache_count = 0;
+
+static OFC_SOCKET_IMPL *socket_impl_alloc(OFC_VOID) {
+    OFC_SOCKET_IMPL *sock;
+
+    sock = OFC_NULL;
+    pthread_mutex_lock(&socket_impl_cache_mutex);
+    if (socket_impl_cache_count > 0)
+        sock = socket_impl_cache[--socket_impl_cache_count];
+    pthread_mutex_unlock(&socket_impl_cache_mutex);
+
+    if (sock == OFC_NULL)
+        sock = ofc_malloc(sizeof(OFC_SOCKET_IMPL));
+    return (sock);
+}
+
+static OFC_VOID socket_impl_free(OFC_SOCKET_IMPL *sock) {
+    pthread_mutex_destroy(&sock->io_mutex);
+
+    pthread_mutex_lock(&socket_impl_cache_mutex);
+    if (socket_impl_cache_count < SOCKET_IMPL_CACHE_MAX) {
+        socket_impl_cache[socket_impl_cache_count++] = sock;
+        sock = OFC_NULL;
+    }
+    pthread_mutex_unlock(&socket_impl_cache_mutex);
+
+    if (sock != OFC_NULL)
+        ofc_free(sock);
+}
+
+/*
+ * Reset the per-socket state of a structure fresh from socket_impl_alloc
+ */
+static OFC_VOID socket_impl_init(OFC_SOCKET_IMPL *sock,
+                                 OFC_SOCKET_TYPE socktype) {
+    sock->revents = 0;
+    sock->events = 0;
+    sock->poll_events = 0;
+    sock->refcount = 1;
+    sock->closed = OFC_FALSE;
+    pthread_mutex_init(&sock->io_mutex, OFC_NULL);
+    sock->local = OFC_FALSE;
+    sock->dual = OFC_FALSE;
+    sock->dest_socklen = 0;
+    sock->type = socktype;
+    sock->has_profile = OFC_FALSE;
+    sock->connect_state = OFC_SOCKET_CONNECT_NONE;
+    sock->connect_event = OFC_FALSE;
+    sock->drain_state = OFC_SOCKET_DRAIN_NONE;
+    sock->drain_event = OFC_FALSE;
+    sock->autotune = OFC_FALSE;
+    sock->delay = OFC_NULL;
+    sock->coalesce_buf = OFC_NULL;
+    sock->coalesce_size = 0;
+    sock->coalesce_len = 0;
+    sock->coalesce_error = 0;
+    sock->live = OFC_FALSE;
+}
+
+/*
+ * Buffer autotuning.  autotune_memory is the sum of the send and receive
+ * buffers currently granted to tuned sockets.
+ */
+static pthread_mutex_t autotune_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OFC_SOCKET_AUTOTUNE_CONFIG autotune_config = {
+        16 * 1024, 4 * 1024 * 1024, 64 * 1024 * 1024, 1000
+};
+static OFC_SIZET autotune_memory = 0;
+
+/*
+ * Read the connection's round trip time, bytes moved so far, congestion
+ * window and retransmit count.  Returns OFC_FALSE when the platform
+ * can't say.  bytes is left alone where the platform doesn't count them.
+ */
+static OFC_BOOL tcp_sample(int fd, OFC_UINT32 *rtt_us, OFC_UINT64 *bytes,
+                           OFC_UINT64 *window, OFC_UINT64 *retransmits) {
+    OFC_BOOL ret;
+#if defined(OFC_DARWIN_HAVE_TCP_CONNECTION_INFO)
+    struct tcp_connection_info info;
+    socklen_t len;
+
+    len = sizeof(info);
+    ret = OFC_FALSE;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len) == 0) {
+        *rtt_us = info.tcpi_srtt * 1000;
+        *bytes = info.tcpi_txbytes + info.tcpi_rxbytes;
+        *window = info.tcpi_snd_cwnd;
+        *retransmits = info.tcpi_txretransmitpackets;
+        ret = OFC_TRUE;
+    }
+#elif defined(OFC_DARWIN_HAVE_TCP_INFO)
+    struct tcp_info info;
+    socklen_t len;
+
+    len = sizeof(info);
+    ret = OFC_FALSE;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *rtt_us = info.tcpi_rtt;
+        *window = (OFC_UINT64) info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+        *retransmits = info.tcpi_total_retrans;
+        ret = OFC_TRUE;
+    }
+#else
+    ret = OFC_FALSE;
+#endif
+    return (ret);
+}
+
+/*
+ * Set both buffers and account for the change.  Called with the socket
+ * locked and autotune_mutex held.
+ */
+static OFC_VOID autotune_resize(OFC_SOCKET_IMPL *sock, OFC_INT size) {
+    int actual;
+    socklen_t len;
+
+    autotune_memory -= sock->tune.send_size + sock->tune.recv_size;
+    sock->tune_size = size;
+    /*
+     * Record what the kernel granted, which need not be what we asked
+     */
+    setsockopt(sock->socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    len = sizeof(actual);
+    if (getsockopt(sock->socket, SOL_SOCKET, SO_SNDBUF, &actual, &len) == 0)
+        sock->tune.send_size = actual;
+    setsockopt(sock->socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    len = sizeof(actual);
+    if (getsockopt(sock->socket, SOL_SOCKET, SO_RCVBUF, &actual, &len) == 0)
+        sock->tune.recv_size = actual;
+    autotune_memory += sock->tune.send_size + sock->tune.recv_size;
+}
+
+static OFC_VOID autotune_release(OFC_SOCKET_IMPL *sock) {
+    pthread_mutex_lock(&autotune_mutex);
+    autotune_memory -= sock->tune.send_size + sock->tune.recv_size;
+    pthread_mutex_unlock(&autotune_mutex);
+    sock->autotune = OFC_FALSE;
+}
+
+/*
+ * Take a sample and resize the buffers if the bandwidth-delay product
+ * calls for it.  Called with the socket locked.
+ */
+static OFC_BOOL autotune_sample(OFC_SOCKET_IMPL *sock) {
+    OFC_MSTIME now;
+    OFC_MSTIME elapsed;
+    OFC_UINT32 rtt_us;
+    OFC_UINT64 bytes;
+    OFC_UINT64 window;
+    OFC_UINT64 retransmits;
+    OFC_UINT64 bdp;
+    OFC_UINT64 target;
+    OFC_UINT64 current;
+    OFC_UINT64 avail;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    now = ofc_time_get_now();
+    elapsed = now - sock->tune_last;
+    if (elapsed < autotune_config.interval || elapsed == 0)
+        return (ret);
+
+    /*
+     * The kernel's byte count where the platform keeps one, otherwise
+     * our own
+     */
+    bytes = STATS_LOAD(sock->stats.bytes_in) +
+        STATS_LOAD(sock->stats.bytes_out);
+    if (!tcp_sample(sock->socket, &rtt_us, &bytes, &window, &retransmits))
+        return (ret);
+
+    sock->tune.throughput = (bytes - sock->tune_bytes) * 1000 / elapsed;
+    sock->tune_bytes = bytes;
+    sock->tune_last = now;
+
+    /*
+     * The congestion window is a floor only while data is moving.  An
+     * idle connection keeps its window, and taking that as demand would
+     * hold the buffers at their peak forever.
+     */
+    bdp = sock->tune.throughput * rtt_us / 1000000;
+    if (sock->tune.throughput != 0 && window > bdp)
+        bdp = window;
+    sock->tune.rtt_us = rtt_us;
+    sock->tune.bdp = bdp;
+    sock->tune.sampled = now;
+
+    current = sock->tune_size;
+    /*
+     * A connection moving close to a full buffer per round trip is held
+     * back by the buffer, so what it achieved understates the path.
+     * Grow it.  Otherwise aim for twice the BDP, shrinking only once
+     * the buffer is more than twice what's needed, and then by at most
+     * half a sample so a pause between bursts doesn't cost the buffer.
+     */
+    if (bdp * 4 >= current * 3)
+        target = current * 2;
+    else {
+        target = bdp * 2;
+        if (target * 2 > current)
+            target = current;
+        else if (target < current / 2)
+            target = current / 2;
+    }
+    if (target < (OFC_UINT64) autotune_config.min_buffer)
+        target = autotune_config.min_buffer;
+    if (target > (OFC_UINT64) autotune_config.max_buffer)
+        target = autotune_config.max_buffer;
+
+    pthread_mutex_lock(&autotune_mutex);
+    sock->tune.limited = OFC_FALSE;
+    if (target > current) {
+        avail = autotune_config.memory_limit + sock->tune.send_size +
+                sock->tune.recv_size;
+        avail = avail > autotune_memory ? avail - autotune_memory : 0;
+        if (target * 2 > avail) {
+            target = avail / 2;
+            sock->tune.limited = OFC_TRUE;
+        }
+    }
+    if (target != current &&
+        target >= (OFC_UINT64) autotune_config.min_buffer) {
+        autotune_resize(sock, (OFC_INT) target);
+        ret = OFC_TRUE;
+    }
+    pthread_mutex_unlock(&autotune_mutex);
+
+    return (ret);
+}
+
 OFC_HANDLE ofc_socket_impl_create(OFC_FAMILY_TYPE family,
                                   OFC_SOCKET_TYPE socktype) {
+    return (ofc_socket_impl_create_profile(family, socktype, OFC_NULL));
+}
+
+OFC_HANDLE ofc_socket_impl_create_profile(OFC_FAMILY_TYPE family,
+                                          OFC_SOCKET_TYPE socktype,
+                                          const OFC_SOCKET_PROFILE *profile) {
     OFC_HANDLE hSocket;
     OFC_SOCKET_IMPL *sock;
 
@@ -64,12 +756,11 @@ OFC_HANDLE ofc_socket_impl_create(OFC_FAMILY_TYPE family,
     int on;
 
     hSocket = OFC_HANDLE_NULL;
-    sock = ofc_malloc(sizeof(OFC_SOCKET_IMPL));
+    sock = socket_impl_alloc();
 
     if (sock != OFC_NULL) {
+        socket_impl_init(sock, socktype);
         sock->family = family;
-        sock->revents = 0;
-        sock->events = 0;
         if (sock->family == OFC_FAMILY_IP) {
             sock->ip.ip_version = OFC_FAMILY_IP;
             sock->ip.u.ipv4.addr = OFC_INADDR_ANY;
@@ -95,13 +786,20 @@ OFC_HANDLE ofc_socket_impl_create(OFC_FAMILY_TYPE family,
         }
 
         sock->socket = socket(fam, stype, proto);
+        /*
+         * Raw sockets need privilege.  Datagram ICMP sockets don't, and
+         * carry echo requests and replies, which is all we use ICMP for.
+         */
+        if (sock->socket < 0 && socktype == SOCKET_TYPE_ICMP &&
+            (errno == EPERM || errno == EACCES))
+            sock->socket = socket(fam, SOCK_DGRAM, proto);
 
         if (sock->socket < 0)
 	  {
 	    ofc_log(OFC_LOG_WARN, "socket error: %s, errno %d\n",
 		    fam == AF_INET ? "AF_INET" : "AF_INET6",
 		    errno);
-            ofc_free(sock);
+            socket_impl_free(sock);
         } else {
             on = OFC_TRUE;
             if (socktype == SOCKET_TYPE_DGRAM) {
@@ -111,22 +809,176 @@ OFC_HANDLE ofc_socket_impl_create(OFC_FAMILY_TYPE family,
             setsockopt(sock->socket, SOL_SOCKET, SO_NOSIGPIPE,
                        (char *) &on, sizeof(on));
 
+            if (profile != OFC_NULL) {
+                sock->profile = *profile;
+                sock->has_profile = OFC_TRUE;
+                apply_profile(sock->socket, socktype, profile);
+            }
+
+            socket_live_add(sock);
             hSocket = ofc_handle_create(OFC_HANDLE_SOCKET_IMPL, sock);
         }
     }
     return (hSocket);
 }
 
+/*
+ * Give coalesced data until the socket's linger time to go before it is
+ * closed.  Sends never block, and the wait for room is done with only a
+ * reference held, not the handle or io_mutex.
+ */
+static OFC_VOID coalesce_drain(OFC_SOCKET_IMPL *sock) {
+    struct linger linger;
+    socklen_t len;
+    struct pollfd pfd;
+    OFC_MSTIME deadline;
+    OFC_INT remaining;
+    ssize_t status;
+
+    remaining = SOCKET_CLOSE_LINGER;
+    len = sizeof(linger);
+    if (getsockopt(sock->socket, SOL_SOCKET, SO_LINGER, &linger,
+                   &len) == 0 && linger.l_onoff)
+        remaining = linger.l_linger * 1000;
+    deadline = ofc_time_get_now() + remaining;
+
+    pthread_mutex_lock(&sock->io_mutex);
+    while (sock->coalesce_len > 0 && sock->coalesce_error == 0 &&
+           remaining > 0) {
+        do {
+            status = send(sock->socket, sock->coalesce_buf,
+                          sock->coalesce_len, MSG_DONTWAIT);
+        } while (status == -1 && errno == EINTR);
+        stats_send(sock, sock->coalesce_len, status);
+        if (status >= 0) {
+            memmove(sock->coalesce_buf, sock->coalesce_buf + status,
+                    sock->coalesce_len - status);
+            sock->coalesce_len -= status;
+        } else if (errno != EAGAIN)
+            sock->coalesce_error = errno;
+        else {
+            remaining = (OFC_INT) (deadline - ofc_time_get_now());
+            if (remaining > 0) {
+                pfd.fd = sock->socket;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                pthread_mutex_unlock(&sock->io_mutex);
+                poll(&pfd, 1, remaining);
+                pthread_mutex_lock(&sock->io_mutex);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sock->io_mutex);
+}
+
+/*
+ * Account for coalesced data a close is about to lose, whether still
+ * held or dropped by an earlier failed write nobody has been told of.
+ * Returns OFC_FALSE, with errno set, if there was any.
+ */
+static OFC_BOOL coalesce_last(OFC_SOCKET_IMPL *sock) {
+    OFC_BOOL ret;
+
+    ret = OFC_TRUE;
+    pthread_mutex_lock(&sock->io_mutex);
+    if (sock->coalesce_len > 0) {
+        STATS_ADD(sock->stats.errors, 1);
+        errno = ETIMEDOUT;
+        ret = OFC_FALSE;
+    } else if (sock->coalesce_error != 0) {
+        errno = sock->coalesce_error;
+        ret = OFC_FALSE;
+    }
+    sock->coalesce_len = 0;
+    sock->coalesce_error = 0;
+    pthread_mutex_unlock(&sock->io_mutex);
+    return (ret);
+}
+
+/*
+ * Close the socket for the handle.  With no references but the handle's
+ * the descriptor is closed outright.  Otherwise their I/O may be in
+ * flight on it, so a dead socket is put in its place, which lets the
+ * endpoint go now and fails their I/O, and the number stays taken until
+ * the last reference goes.  Returns OFC_FALSE if coalesced data was
+ * lost.  Called with the handle locked.
+ */
+static OFC_BOOL socket_close(OFC_SOCKET_IMPL *sock) {
+    OFC_BOOL ret;
+    int dead;
+
+    ret = OFC_TRUE;
+    if (!__atomic_exchange_n(&sock->closed, OFC_TRUE, __ATOMIC_ACQ_REL)) {
+        socket_live_remove(sock);
+        ret = coalesce_last(sock);
+        if (__atomic_load_n(&sock->refcount, __ATOMIC_ACQUIRE) == 1) {
+            close(sock->socket);
+            sock->socket = -1;
+        } else {
+            dead = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (dead >= 0) {
+                dup2(dead, sock->socket);
+                close(dead);
+            } else
+                shutdown(sock->socket, SHUT_RDWR);
+        }
+    }
+    return (ret);
+}
+
+/*
+ * Drop a reference, closing the descriptor with the last one
+ */
+static OFC_VOID socket_unref(OFC_SOCKET_IMPL *sock) {
+    if (__atomic_sub_fetch(&sock->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (sock->autotune)
+            autotune_release(sock);
+        if (sock->delay != OFC_NULL)
+            ofc_free(sock->delay);
+        socket_live_remove(sock);
+        if (sock->coalesce_buf != OFC_NULL)
+            ofc_free(sock->coalesce_buf);
+        if (sock->socket >= 0)
+            close(sock->socket);
+        socket_impl_free(sock);
+    }
+}
+
+/*
+ * Let coalesced data drain before the handle closes the socket, holding
+ * a reference rather than the handle while waiting
+ */
+static OFC_VOID socket_linger(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL held;
+
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        held = (__atomic_load_n(&sock->coalesce_len, __ATOMIC_RELAXED) > 0);
+        if (held)
+            __atomic_add_fetch(&sock->refcount, 1, __ATOMIC_RELAXED);
+        ofc_handle_unlock(hSocket);
+        if (held) {
+            coalesce_drain(sock);
+            socket_unref(sock);
+        }
+    }
+}
+
 OFC_VOID ofc_socket_impl_destroy(OFC_HANDLE hSocket) {
     OFC_SOCKET_IMPL *sock;
 
+    socket_linger(hSocket);
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        if (sock->socket >= 0)
-            close(sock->socket);
-        ofc_free(sock);
+        /*
+         * Marked closed before the handle can be reused, so whoever
+         * holds a reference knows it no longer belongs to the handle
+         */
+        socket_close(sock);
         ofc_handle_destroy(hSocket);
         ofc_handle_unlock(hSocket);
+        socket_unref(sock);
     }
 }
 
@@ -141,26 +993,43 @@ OFC_VOID ofc_socket_impl_destroy(OFC_HANDLE hSocket) {
  * Returns:
  *    status (STATE_SUCCESS or STATE_FAIL)
  */
-static OFC_VOID make_sockaddr(struct sockaddr **mysockaddr,
+static OFC_VOID make_sockaddr(struct sockaddr_storage *mysockaddr,
                               socklen_t *mysocklen,
                               const OFC_IPADDR *ip,
-                              OFC_UINT16 port) {
+                              OFC_UINT16 port, OFC_BOOL dual) {
     struct sockaddr_in *mysockaddr_in;
     struct sockaddr_in6 *mysockaddr_in6;
     OFC_INT i;
 
-    if (ip->ip_version == OFC_FAMILY_IP) {
-        mysockaddr_in = ofc_malloc(sizeof(struct sockaddr_in));
+    if (ip->ip_version == OFC_FAMILY_IP && dual) {
+        /*
+         * A dual stack socket takes IPv4 as ::ffff:a.b.c.d, except that
+         * the IPv4 wildcard means both families
+         */
+        mysockaddr_in6 = (struct sockaddr_in6 *) mysockaddr;
+        ofc_memset(mysockaddr_in6, '\0', sizeof(struct sockaddr_in6));
+
+        mysockaddr_in6->sin6_len = sizeof(struct sockaddr_in6);
+        mysockaddr_in6->sin6_family = AF_INET6;
+        OFC_NET_STON (&mysockaddr_in6->sin6_port, 0, port);
+        if (ip->u.ipv4.addr != OFC_INADDR_ANY) {
+            mysockaddr_in6->sin6_addr.s6_addr[10] = 0xff;
+            mysockaddr_in6->sin6_addr.s6_addr[11] = 0xff;
+            OFC_NET_LTON (&mysockaddr_in6->sin6_addr.s6_addr[12], 0,
+                          ip->u.ipv4.addr);
+        }
+        *mysocklen = sizeof(struct sockaddr_in6);
+    } else if (ip->ip_version == OFC_FAMILY_IP) {
+        mysockaddr_in = (struct sockaddr_in *) mysockaddr;
         ofc_memset(mysockaddr_in, '\0', sizeof(struct sockaddr_in));
 
         mysockaddr_in->sin_family = AF_INET;
         OFC_NET_STON (&mysockaddr_in->sin_port, 0, port);
         OFC_NET_LTON (&mysockaddr_in->sin_addr.s_addr, 0,
                       ip->u.ipv4.addr);
-        *mysockaddr = (struct sockaddr *) mysockaddr_in;
         *mysocklen = sizeof(struct sockaddr_in);
     } else {
-        mysockaddr_in6 = ofc_malloc(sizeof(struct sockaddr_in6));
+        mysockaddr_in6 = (struct sockaddr_in6 *) mysockaddr;
         ofc_memset(mysockaddr_in6, '\0', sizeof(struct sockaddr_in6));
 
         mysockaddr_in6->sin6_len = sizeof(struct sockaddr_in6);
@@ -171,11 +1040,46 @@ static OFC_VOID make_sockaddr(struct sockaddr **mysockaddr,
         for (i = 0; i < 16; i++)
             mysockaddr_in6->sin6_addr.s6_addr[i] =
                     ip->u.ipv6._s6_addr[i];
-        *mysockaddr = (struct sockaddr *) mysockaddr_in6;
         *mysocklen = sizeof(struct sockaddr_in6);
     }
 }
 
+OFC_BOOL ofc_socket_impl_ip_equal(const OFC_IPADDR *a, const OFC_IPADDR *b,
+                                  OFC_BOOL scope) {
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    if (a->ip_version == b->ip_version) {
+        if (a->ip_version == OFC_FAMILY_IP)
+            ret = (a->u.ipv4.addr == b->u.ipv4.addr);
+        else
+            ret = ((!scope || a->u.ipv6.scope == b->u.ipv6.scope) &&
+                   ofc_memcmp(a->u.ipv6._s6_addr, b->u.ipv6._s6_addr,
+                              16) == 0);
+    }
+    return (ret);
+}
+
+/*
+ * Return the kernel form of a destination, building it only when it
+ * differs from the last one used on this socket.  Called with the socket
+ * locked.
+ */
+static const struct sockaddr *dest_sockaddr(OFC_SOCKET_IMPL *sock,
+                                            const OFC_IPADDR *ip,
+                                            OFC_UINT16 port,
+                                            socklen_t *mysocklen) {
+    if (sock->dest_socklen == 0 || sock->dest_port != port ||
+        !ofc_socket_impl_ip_equal(&sock->dest_ip, ip, OFC_TRUE)) {
+        make_sockaddr(&sock->dest_sockaddr, &sock->dest_socklen, ip, port,
+                      sock->dual);
+        sock->dest_ip = *ip;
+        sock->dest_port = port;
+    }
+    *mysocklen = sock->dest_socklen;
+    return ((const struct sockaddr *) &sock->dest_sockaddr);
+}
+
 OFC_VOID unmake_sockaddr(struct sockaddr *mysockaddr,
                          OFC_IPADDR *ip,
                          OFC_UINT16 *port) {
@@ -185,16 +1089,44 @@ OFC_VOID unmake_sockaddr(struct sockaddr *mysockaddr,
 
     if (mysockaddr->sa_family == AF_INET) {
         mysockaddr_in = (struct sockaddr_in *) mysockaddr;
-        ip->ip_version = OFC_FAMILY_IP;
-        *port = OFC_NET_NTOS (&mysockaddr_in->sin_port, 0);
-        ip->u.ipv4.addr = OFC_NET_NTOL (&mysockaddr_in->sin_addr.s_addr, 0);
+        if (ip != OFC_NULL) {
+            ip->ip_version = OFC_FAMILY_IP;
+            ip->u.ipv4.addr =
+                    OFC_NET_NTOL (&mysockaddr_in->sin_addr.s_addr, 0);
+        }
+        if (port != OFC_NULL)
+            *port = OFC_NET_NTOS (&mysockaddr_in->sin_port, 0);
+    } else if (mysockaddr->sa_family != AF_INET6) {
+        /*
+         * Local socket, or an unnamed datagram sender.  Report loopback.
+         */
+        if (ip != OFC_NULL) {
+            ip->ip_version = OFC_FAMILY_IP;
+            ip->u.ipv4.addr = OFC_INADDR_LOOPBACK;
+        }
+        if (port != OFC_NULL)
+            *port = 0;
     } else {
         mysockaddr_in6 = (struct sockaddr_in6 *) mysockaddr;
-        if (ip != OFC_NULL) {
+        if (ip == OFC_NULL)
+            ;
+        else if (IN6_IS_ADDR_V4MAPPED(&mysockaddr_in6->sin6_addr)) {
+            /*
+             * IPv4 peer of a dual stack socket
+             */
+            ip->ip_version = OFC_FAMILY_IP;
+            ip->u.ipv4.addr =
+                    OFC_NET_NTOL (&mysockaddr_in6->sin6_addr.s6_addr[12], 0);
+        } else {
             ip->ip_version = OFC_FAMILY_IPV6;
             for (i = 0; i < 16; i++)
                 ip->u.ipv6._s6_addr[i] =
                         mysockaddr_in6->sin6_addr.s6_addr[i];
+            /*
+             * Link local peers are only reachable through the interface
+             * they came in on
+             */
+            ip->u.ipv6.scope = mysockaddr_in6->sin6_scope_id;
         }
         if (port != OFC_NULL)
             *port = OFC_NET_NTOS (&mysockaddr_in6->sin6_port, 0);
@@ -207,16 +1139,17 @@ OFC_BOOL ofc_socket_impl_bind(OFC_HANDLE hSocket, const OFC_IPADDR *ip,
     OFC_BOOL ret;
 
     int status;
-    struct sockaddr *mysockaddr;
+    struct sockaddr_storage mysockaddr;
     socklen_t mysocklen;
 
     ret = OFC_FALSE;
 
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        make_sockaddr(&mysockaddr, &mysocklen, ip, port);
+        make_sockaddr(&mysockaddr, &mysocklen, ip, port, sock->dual);
 
-        status = bind(sock->socket, mysockaddr, mysocklen);
+        status = bind(sock->socket, (struct sockaddr *) &mysockaddr,
+                      mysocklen);
 
         if (status == 0)
             ret = OFC_TRUE;
@@ -225,9 +1158,9 @@ OFC_BOOL ofc_socket_impl_bind(OFC_HANDLE hSocket, const OFC_IPADDR *ip,
             OFC_CHAR errstr[80];
             strerror_r(errno, errstr, 80);
             ofc_log(OFC_LOG_WARN, "Bind Error: %.80s\n", errstr);
-            if (mysockaddr->sa_family == AF_INET) {
+            if (mysockaddr.ss_family == AF_INET) {
                 struct sockaddr_in *mysockaddr_in;
-                mysockaddr_in = (struct sockaddr_in *) mysockaddr;
+                mysockaddr_in = (struct sockaddr_in *) &mysockaddr;
                 inet_ntop(AF_INET, &mysockaddr_in->sin_addr,
                           ip_str, IP6STR_LEN);
                 ofc_log(OFC_LOG_WARN,
@@ -239,7 +1172,7 @@ OFC_BOOL ofc_socket_impl_bind(OFC_HANDLE hSocket, const OFC_IPADDR *ip,
 			ip_str);
             } else {
                 struct sockaddr_in6 *mysockaddr_in6;
-                mysockaddr_in6 = (struct sockaddr_in6 *) mysockaddr;
+                mysockaddr_in6 = (struct sockaddr_in6 *) &mysockaddr;
                 inet_ntop(AF_INET6, &mysockaddr_in6->sin6_addr,
                           ip_str, IP6STR_LEN);
                 ofc_log(OFC_LOG_WARN, "  len: %d\n"
@@ -257,8 +1190,6 @@ OFC_BOOL ofc_socket_impl_bind(OFC_HANDLE hSocket, const OFC_IPADDR *ip,
             }
         }
 
-        ofc_free(mysockaddr);
-
         ofc_handle_unlock(hSocket);
     }
     return (ret);
@@ -271,19 +1202,20 @@ OFC_BOOL ofc_socket_impl_bind(OFC_HANDLE hSocket, const OFC_IPADDR *ip,
  *    hSock - Socket handle to close
  *
  * Returns:
- *    status (STATE_SUCCESS or STATE_FAIL)
+ *    status (STATE_SUCCESS or STATE_FAIL).  The socket is closed even on
+ *    failure, which means coalesced data couldn't be sent in the linger
+ *    time (ETIMEDOUT) or a write of it had failed.
  */
 OFC_BOOL ofc_socket_impl_close(OFC_HANDLE hSocket) {
     OFC_SOCKET_IMPL *sock;
     OFC_BOOL ret;
 
     ret = OFC_FALSE;
+    socket_linger(hSocket);
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        close(sock->socket);
-        sock->socket = -1;
+        ret = socket_close(sock);
         ofc_handle_unlock(hSocket);
-        ret = OFC_TRUE;
     }
 
     return (ret);
@@ -306,7 +1238,7 @@ OFC_BOOL ofc_socket_impl_connect(OFC_HANDLE hSocket,
     OFC_BOOL ret;
 
     int status;
-    struct sockaddr *mysockaddr;
+    struct sockaddr_storage mysockaddr;
     socklen_t mysocklen;
 #if 0
     OFC_CHAR ip_str[IP6STR_LEN] ;
@@ -315,18 +1247,19 @@ OFC_BOOL ofc_socket_impl_connect(OFC_HANDLE hSocket,
     ret = OFC_FALSE;
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        make_sockaddr(&mysockaddr, &mysocklen, ip, port);
+        make_sockaddr(&mysockaddr, &mysocklen, ip, port, sock->dual);
 
-        status = connect(sock->socket, mysockaddr, mysocklen);
+        status = connect(sock->socket, (struct sockaddr *) &mysockaddr,
+                         mysocklen);
 
         if (((status != 0) && (errno == EINPROGRESS)) || (status == 0))
             ret = OFC_TRUE;
 #if 0
         else
-      if (mysockaddr->sa_family == AF_INET)
+      if (mysockaddr.ss_family == AF_INET)
         {
           struct sockaddr_in *sockaddrp ;
-          sockaddrp = (struct sockaddr_in *) mysockaddr ;
+          sockaddrp = (struct sockaddr_in *) &mysockaddr ;
 
           ofc_log(OFC_LOG_WARN,
 		  "connect error: %s %s(%d), errno %d\n",
@@ -338,28 +1271,328 @@ OFC_BOOL ofc_socket_impl_connect(OFC_HANDLE hSocket,
         }
 #endif
 
-        ofc_free(mysockaddr);
-
         ofc_handle_unlock(hSocket);
     }
 
     return (ret);
 }
 
+static OFC_VOID update_poll_events(OFC_SOCKET_IMPL *sock) {
+    OFC_UINT16 poll_events;
+
+    poll_events = sock->events;
+    if (sock->connect_state == OFC_SOCKET_CONNECT_PENDING)
+        poll_events |= POLLOUT;
+    if (sock->drain_state == OFC_SOCKET_DRAIN_PENDING)
+        poll_events |= POLLIN;
+    /*
+     * Coalesced data still held after a flush is waiting for room
+     */
+    if (sock->coalesce_len > 0)
+        poll_events |= POLLOUT;
+    sock->poll_events = poll_events;
+}
+
 /*
- * PSP_Listen - Listen for a connection from remote
- *
- * Accepts:
- *    hSock - Handle of Socket to set to listen
- *    backlog - Number of simultaneous open connections to accept
- *
- * Returns:
- *    status (STATE_SUCCESS or STATE_FAIL)
+ * Settle a pending connect.  revents are the poll results for the
+ * socket, zero if it has not been polled.  Called with the handle locked.
  */
-OFC_BOOL ofc_socket_impl_listen(OFC_HANDLE hSocket, OFC_INT backlog) {
-    OFC_SOCKET_IMPL *sock;
-    OFC_BOOL ret;
-    int status;
+static OFC_VOID connect_resolve(OFC_SOCKET_IMPL *sock, OFC_UINT16 revents) {
+    int err;
+    socklen_t errlen;
+
+    if (sock->connect_state != OFC_SOCKET_CONNECT_PENDING)
+        return;
+
+    if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+        err = 0;
+        errlen = sizeof(err);
+        if (getsockopt(sock->socket, SOL_SOCKET, SO_ERROR, &err,
+                       &errlen) != 0)
+            err = errno;
+        if (err == 0)
+            sock->connect_state = OFC_SOCKET_CONNECT_DONE;
+        else {
+            sock->connect_state = OFC_SOCKET_CONNECT_FAILED;
+            sock->connect_error = err;
+        }
+        sock->connect_event = OFC_TRUE;
+    } else if (sock->connect_timed &&
+               (OFC_INT) (sock->connect_deadline - ofc_time_get_now()) <= 0) {
+        sock->connect_state = OFC_SOCKET_CONNECT_TIMEDOUT;
+        sock->connect_error = ETIMEDOUT;
+        sock->connect_event = OFC_TRUE;
+    }
+    update_poll_events(sock);
+}
+
+/*
+ * Advance a graceful close: discard what the peer sends until its FIN,
+ * or give up at the deadline and arrange for a reset.  Called with the
+ * handle locked.
+ */
+static OFC_VOID drain_resolve(OFC_SOCKET_IMPL *sock, OFC_UINT16 revents) {
+    OFC_CHAR discard[4096];
+    ssize_t status;
+    struct linger linger;
+
+    if (sock->drain_state != OFC_SOCKET_DRAIN_PENDING)
+        return;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        do {
+            status = recv(sock->socket, discard, sizeof(discard), 0);
+        } while (status > 0 || (status == -1 && errno == EINTR));
+        if (status == 0 || (status == -1 && errno != EAGAIN)) {
+            sock->drain_state = OFC_SOCKET_DRAIN_DONE;
+            sock->drain_event = OFC_TRUE;
+        }
+    }
+    if (sock->drain_state == OFC_SOCKET_DRAIN_PENDING && sock->drain_timed &&
+        (OFC_INT) (sock->drain_deadline - ofc_time_get_now()) <= 0) {
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(sock->socket, SOL_SOCKET, SO_LINGER, &linger,
+                   sizeof(linger));
+        sock->drain_state = OFC_SOCKET_DRAIN_TIMEDOUT;
+        sock->drain_event = OFC_TRUE;
+    }
+    update_poll_events(sock);
+}
+
+/*
+ * Record the outcome of starting an asynchronous connect.  status is
+ * what connect returned, with errno set if it failed.  Called with the
+ * handle locked.
+ */
+static OFC_BOOL connect_begin(OFC_SOCKET_IMPL *sock, int status,
+                              OFC_MSTIME timeout) {
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    sock->connect_error = 0;
+    sock->connect_event = OFC_FALSE;
+    sock->connect_timed = (timeout != 0);
+    sock->connect_deadline = ofc_time_get_now() + timeout;
+
+    if (status == 0) {
+        /*
+         * Loopback connects can complete immediately.  Still report
+         * the event so callers have a single completion path.
+         */
+        sock->connect_state = OFC_SOCKET_CONNECT_DONE;
+        sock->connect_event = OFC_TRUE;
+        ret = OFC_TRUE;
+    } else if (errno == EINPROGRESS || errno == EINTR) {
+        sock->connect_state = OFC_SOCKET_CONNECT_PENDING;
+        ret = OFC_TRUE;
+    } else {
+        sock->connect_state = OFC_SOCKET_CONNECT_FAILED;
+        sock->connect_error = errno;
+    }
+    update_poll_events(sock);
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_connect_async(OFC_HANDLE hSocket,
+                                       const OFC_IPADDR *ip,
+                                       OFC_UINT16 port,
+                                       OFC_MSTIME timeout) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+
+    int status;
+    int flags;
+    struct sockaddr_storage mysockaddr;
+    socklen_t mysocklen;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        flags = fcntl(sock->socket, F_GETFL);
+        fcntl(sock->socket, F_SETFL, flags | O_NONBLOCK);
+
+        make_sockaddr(&mysockaddr, &mysocklen, ip, port, sock->dual);
+        status = connect(sock->socket, (struct sockaddr *) &mysockaddr,
+                         mysocklen);
+
+        ret = connect_begin(sock, status, timeout);
+
+        ofc_handle_unlock(hSocket);
+    }
+
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_connect_data(OFC_HANDLE hSocket,
+                                       const OFC_IPADDR *ip,
+                                       OFC_UINT16 port,
+                                       const OFC_VOID *data,
+                                       OFC_SIZET len,
+                                       OFC_MSTIME timeout) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+
+    int status;
+    int flags;
+    ssize_t sent;
+    OFC_BOOL fallback;
+    struct sockaddr_storage mysockaddr;
+    socklen_t mysocklen;
+#if defined(OFC_DARWIN_HAVE_CONNECTX) && defined(CONNECT_DATA_IDEMPOTENT)
+    sa_endpoints_t endpoints;
+    struct iovec iov;
+    size_t outlen;
+#endif
+
+    ret = -1;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        flags = fcntl(sock->socket, F_GETFL);
+        fcntl(sock->socket, F_SETFL, flags | O_NONBLOCK);
+
+        make_sockaddr(&mysockaddr, &mysocklen, ip, port, sock->dual);
+        sent = 0;
+        fallback = OFC_TRUE;
+#if defined(OFC_DARWIN_HAVE_CONNECTX) && defined(CONNECT_DATA_IDEMPOTENT)
+        /*
+         * Darwin puts the data in the SYN when it holds a cookie for the
+         * server, and queues it behind the handshake when it doesn't.
+         */
+        ofc_memset(&endpoints, 0, sizeof(endpoints));
+        endpoints.sae_dstaddr = (struct sockaddr *) &mysockaddr;
+        endpoints.sae_dstaddrlen = mysocklen;
+        iov.iov_base = (OFC_VOID *) data;
+        iov.iov_len = len;
+        outlen = 0;
+        status = connectx(sock->socket, &endpoints, SAE_ASSOCID_ANY,
+                          CONNECT_DATA_IDEMPOTENT, &iov, 1, &outlen, NULL);
+        if (status == 0 || errno == EINPROGRESS) {
+            sent = outlen;
+            fallback = OFC_FALSE;
+        } else if (errno != ENOTSUP && errno != EOPNOTSUPP)
+            fallback = OFC_FALSE;
+#elif defined(MSG_FASTOPEN)
+        /*
+         * Linux sends the data in the SYN with a cookie.  Without one
+         * it asks for one and the data has to be sent again once
+         * connected.  EOPNOTSUPP when client fast open is turned off.
+         */
+        sent = sendto(sock->socket, data, len, MSG_FASTOPEN,
+                      (struct sockaddr *) &mysockaddr, mysocklen);
+        if (sent >= 0) {
+            /*
+             * The connect itself may still be in progress
+             */
+            status = -1;
+            errno = EINPROGRESS;
+            fallback = OFC_FALSE;
+        } else {
+            status = -1;
+            sent = 0;
+            if (errno != EOPNOTSUPP)
+                fallback = OFC_FALSE;
+        }
+#endif
+        if (fallback) {
+            status = connect(sock->socket, (struct sockaddr *) &mysockaddr,
+                             mysocklen);
+            if (status == 0) {
+                sent = send(sock->socket, data, len, 0);
+                if (sent < 0)
+                    sent = 0;
+            }
+        }
+
+        if (connect_begin(sock, status, timeout))
+            ret = sent;
+
+        ofc_handle_unlock(hSocket);
+    }
+
+    return (ret);
+}
+
+OFC_SOCKET_CONNECT_STATE ofc_socket_impl_connect_state(OFC_HANDLE hSocket,
+                                                       OFC_INT *error) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SOCKET_CONNECT_STATE ret;
+    struct pollfd pfd;
+
+    ret = OFC_SOCKET_CONNECT_NONE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->connect_state == OFC_SOCKET_CONNECT_PENDING) {
+            pfd.fd = sock->socket;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) < 0)
+                pfd.revents = 0;
+            connect_resolve(sock, pfd.revents);
+        }
+        ret = sock->connect_state;
+        /*
+         * The caller has the outcome, so a later test must not report it
+         */
+        if (ret != OFC_SOCKET_CONNECT_PENDING)
+            sock->connect_event = OFC_FALSE;
+        if (error != OFC_NULL)
+            *error = sock->connect_error;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+static OFC_MSTIME socket_wait_time(OFC_SOCKET_IMPL *sock) {
+    OFC_MSTIME ret;
+    OFC_INT remaining;
+
+    ret = OFC_MAX_SCHED_WAIT;
+    if (sock->connect_state == OFC_SOCKET_CONNECT_PENDING &&
+        sock->connect_timed) {
+        remaining = (OFC_INT) (sock->connect_deadline - ofc_time_get_now());
+        if (remaining <= 0)
+            ret = 0;
+        else if ((OFC_MSTIME) remaining < ret)
+            ret = remaining;
+    }
+    if (sock->drain_state == OFC_SOCKET_DRAIN_PENDING && sock->drain_timed) {
+        remaining = (OFC_INT) (sock->drain_deadline - ofc_time_get_now());
+        if (remaining <= 0)
+            ret = 0;
+        else if ((OFC_MSTIME) remaining < ret)
+            ret = remaining;
+    }
+    return (ret);
+}
+
+OFC_MSTIME ofc_socket_impl_get_wait_time(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_MSTIME ret;
+
+    ret = OFC_MAX_SCHED_WAIT;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        ret = socket_wait_time(sock);
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+/*
+ * PSP_Listen - Listen for a connection from remote
+ *
+ * Accepts:
+ *    hSock - Handle of Socket to set to listen
+ *    backlog - Number of simultaneous open connections to accept
+ *
+ * Returns:
+ *    status (STATE_SUCCESS or STATE_FAIL)
+ */
+OFC_BOOL ofc_socket_impl_listen(OFC_HANDLE hSocket, OFC_INT backlog) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    int status;
 
     ret = OFC_FALSE;
     sock = ofc_handle_lock(hSocket);
@@ -372,6 +1605,153 @@ OFC_BOOL ofc_socket_impl_listen(OFC_HANDLE hSocket, OFC_INT backlog) {
     return (ret);
 }
 
+OFC_BOOL ofc_socket_impl_listen_defer(OFC_HANDLE hSocket, OFC_INT backlog,
+                                      OFC_INT seconds,
+                                      OFC_BOOL *deferred) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    OFC_BOOL defer;
+    int status;
+#if defined(TCP_DEFER_ACCEPT)
+    int val;
+#elif defined(SO_ACCEPTFILTER)
+    struct accept_filter_arg afa;
+#endif
+
+    ret = OFC_FALSE;
+    defer = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+#if defined(TCP_DEFER_ACCEPT)
+        /*
+         * Linux holds the connection for up to this long waiting for
+         * data, then hands it over anyway
+         */
+        val = seconds > 0 ? seconds : 1;
+        if (setsockopt(sock->socket, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       &val, sizeof(val)) == 0)
+            defer = OFC_TRUE;
+#endif
+        status = listen(sock->socket, (int) backlog);
+        if (status != -1) {
+            ret = OFC_TRUE;
+#if !defined(TCP_DEFER_ACCEPT) && defined(SO_ACCEPTFILTER)
+            /*
+             * BSD accept filters attach to a listening socket and fail
+             * when the filter module isn't loaded.  They have no
+             * timeout.
+             */
+            ofc_memset(&afa, 0, sizeof(afa));
+            ofc_strncpy(afa.af_name, "dataready", sizeof(afa.af_name) - 1);
+            if (setsockopt(sock->socket, SOL_SOCKET, SO_ACCEPTFILTER,
+                           &afa, sizeof(afa)) == 0)
+                defer = OFC_TRUE;
+#endif
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    if (deferred != OFC_NULL)
+        *deferred = ret && defer;
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_fastopen(OFC_HANDLE hSocket, OFC_INT qlen) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+#if defined(TCP_FASTOPEN)
+    int val;
+#endif
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+#if defined(TCP_FASTOPEN)
+        /*
+         * Linux takes the queue length, Darwin just on or off
+         */
+        val = qlen > 0 ? qlen : 1;
+        if (setsockopt(sock->socket, IPPROTO_TCP, TCP_FASTOPEN,
+                       &val, sizeof(val)) == 0)
+            ret = OFC_TRUE;
+#endif
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+/*
+ * Accept one connection from a listening socket, which must be locked.
+ * The new descriptor is created close-on-exec, and non-blocking if asked,
+ * in the same call where the platform allows.
+ *
+ * Returns the new handle, or OFC_HANDLE_NULL with errno set.
+ */
+static OFC_HANDLE accept_one(OFC_SOCKET_IMPL *sock, OFC_BOOL nonblock,
+                             OFC_IPADDR *ip, OFC_UINT16 *port) {
+    OFC_SOCKET_IMPL *newsock;
+    OFC_HANDLE hNewSock;
+    int fd;
+    int on;
+    int flags;
+
+    socklen_t addrlen;
+    struct sockaddr_storage mysockaddr;
+
+    hNewSock = OFC_HANDLE_NULL;
+
+    addrlen = sizeof(mysockaddr);
+#if defined(OFC_DARWIN_HAVE_ACCEPT4)
+    flags = SOCK_CLOEXEC;
+    if (nonblock)
+        flags |= SOCK_NONBLOCK;
+    do {
+        fd = accept4(sock->socket, (struct sockaddr *) &mysockaddr,
+                     &addrlen, flags);
+    } while (fd == -1 && errno == EINTR);
+#else
+    do {
+        fd = accept(sock->socket, (struct sockaddr *) &mysockaddr, &addrlen);
+    } while (fd == -1 && errno == EINTR);
+    if (fd != -1) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (nonblock) {
+            flags = fcntl(fd, F_GETFL);
+            if (flags >= 0)
+                fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+#endif
+
+    if (fd != -1) {
+        newsock = socket_impl_alloc();
+        if (newsock == OFC_NULL) {
+            close(fd);
+            errno = ENOMEM;
+        } else {
+            socket_impl_init(newsock, SOCKET_TYPE_STREAM);
+            newsock->socket = fd;
+            newsock->family = sock->family;
+            newsock->local = sock->local;
+            newsock->dual = sock->dual;
+            newsock->ip = sock->ip;
+            newsock->has_profile = sock->has_profile;
+            if (sock->has_profile) {
+                newsock->profile = sock->profile;
+                apply_profile(fd, SOCKET_TYPE_STREAM, &newsock->profile);
+            }
+            if (sock->delay != OFC_NULL)
+                socket_stamp_enable(newsock, OFC_TRUE);
+
+            on = OFC_TRUE;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char *) &on, sizeof(on));
+            unmake_sockaddr((struct sockaddr *) &mysockaddr, ip, port);
+            socket_live_add(newsock);
+            hNewSock = ofc_handle_create(OFC_HANDLE_SOCKET_IMPL, newsock);
+        }
+    }
+    return (hNewSock);
+}
+
 /*
  * PSP_Accept - Accept a connection on socket
  * 
@@ -385,38 +1765,62 @@ OFC_BOOL ofc_socket_impl_listen(OFC_HANDLE hSocket, OFC_INT backlog) {
 OFC_HANDLE ofc_socket_impl_accept(OFC_HANDLE hSocket,
                                   OFC_IPADDR *ip, OFC_UINT16 *port) {
     OFC_SOCKET_IMPL *sock;
-    OFC_SOCKET_IMPL *newsock;
     OFC_HANDLE hNewSock;
 
-    socklen_t addrlen;
-    struct sockaddr *mysockaddr;
-
     hNewSock = OFC_HANDLE_NULL;
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        newsock = ofc_malloc(sizeof(OFC_SOCKET_IMPL));
-
-        addrlen = (OFC_MAX (sizeof(struct sockaddr_in6),
-                            sizeof(struct sockaddr_in)));
-
-        mysockaddr = ofc_malloc(addrlen);
-        newsock->socket = accept(sock->socket, mysockaddr, &addrlen);
+        hNewSock = accept_one(sock, OFC_FALSE, ip, port);
+        ofc_handle_unlock(hSocket);
+    }
+    return (hNewSock);
+}
 
-        if (newsock->socket != -1) {
-            int on;
+OFC_INT ofc_socket_impl_accept_many(OFC_HANDLE hSocket, OFC_HANDLE *sockets,
+                                    OFC_IPADDR *ips, OFC_UINT16 *ports,
+                                    OFC_INT max) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_INT count;
+    OFC_BOOL blocking;
+    OFC_BOOL done;
+    OFC_HANDLE hNewSock;
+    struct pollfd pfd;
 
-            on = OFC_TRUE;
-            setsockopt(sock->socket, SOL_SOCKET, SO_NOSIGPIPE,
-                       (char *) &on, sizeof(on));
-            unmake_sockaddr(mysockaddr, ip, port);
-            hNewSock = ofc_handle_create(OFC_HANDLE_SOCKET_IMPL, newsock);
-        } else
-            ofc_free(newsock);
+    count = 0;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        blocking = !(fcntl(sock->socket, F_GETFL) & O_NONBLOCK);
+        done = OFC_FALSE;
+
+        while (count < max && !done) {
+            /*
+             * On a blocking listener, only the first accept may wait.
+             * Check the backlog before each of the rest.
+             */
+            if (blocking && count > 0) {
+                pfd.fd = sock->socket;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+                    break;
+            }
 
-        ofc_free(mysockaddr);
+            hNewSock = accept_one(sock, OFC_TRUE,
+                                  ips == OFC_NULL ? OFC_NULL : &ips[count],
+                                  ports == OFC_NULL ?
+                                  OFC_NULL : &ports[count]);
+            if (hNewSock != OFC_HANDLE_NULL)
+                sockets[count++] = hNewSock;
+            else if (errno != ECONNABORTED && errno != EPROTO)
+                /*
+                 * Backlog empty, or out of descriptors or memory.  A
+                 * connection reset while queued is skipped.
+                 */
+                done = OFC_TRUE;
+        }
         ofc_handle_unlock(hSocket);
     }
-    return (hNewSock);
+    return (count);
 }
 
 /*
@@ -461,13 +1865,13 @@ OFC_BOOL ofc_socket_impl_connected(OFC_HANDLE hSocket) {
 
     int status;
     socklen_t namelen;
-    struct sockaddr sa;
+    struct sockaddr_storage sa;
 
     ret = OFC_FALSE;
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
         namelen = sizeof(sa);
-        status = getpeername(sock->socket, &sa, &namelen);
+        status = getpeername(sock->socket, (struct sockaddr *) &sa, &namelen);
         if (status != -1)
             ret = OFC_TRUE;
         ofc_handle_unlock(hSocket);
@@ -506,6 +1910,139 @@ OFC_BOOL ofc_socket_impl_no_block(OFC_HANDLE hSocket, OFC_BOOL onoff) {
     return (ret);
 }
 
+/*
+ * Drop the first count bytes of the coalescing buffer
+ */
+static OFC_VOID coalesce_consume(OFC_SOCKET_IMPL *sock, OFC_SIZET count) {
+    if (count < sock->coalesce_len)
+        memmove(sock->coalesce_buf, sock->coalesce_buf + count,
+                sock->coalesce_len - count);
+    sock->coalesce_len -= OFC_MIN(count, sock->coalesce_len);
+}
+
+/*
+ * Write out coalesced data.  Returns OFC_TRUE once nothing is held back.
+ * On a hard error the data is dropped and the error kept for the next
+ * send or flush.  Called with io_mutex held.
+ */
+static OFC_BOOL coalesce_write(OFC_SOCKET_IMPL *sock) {
+    ssize_t status;
+
+    if (sock->coalesce_len > 0) {
+        do {
+            status = send(sock->socket, sock->coalesce_buf,
+                          sock->coalesce_len, 0);
+        } while (status == -1 && errno == EINTR);
+        stats_send(sock, sock->coalesce_len, status);
+        if (status >= 0)
+            coalesce_consume(sock, status);
+        else if (errno != EAGAIN) {
+            sock->coalesce_error = errno;
+            sock->coalesce_len = 0;
+        }
+        update_poll_events(sock);
+    }
+    return (sock->coalesce_len == 0);
+}
+
+/*
+ * Hand a pending coalescing error to the caller through errno, clearing
+ * it if take.  Called with io_mutex held.
+ */
+static OFC_BOOL coalesce_report(OFC_SOCKET_IMPL *sock, OFC_BOOL take) {
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    if (sock->coalesce_error != 0) {
+        errno = sock->coalesce_error;
+        if (take)
+            sock->coalesce_error = 0;
+        ret = OFC_TRUE;
+    }
+    return (ret);
+}
+
+static OFC_BOOL coalesce_flush(OFC_SOCKET_IMPL *sock) {
+    OFC_BOOL ret;
+
+    pthread_mutex_lock(&sock->io_mutex);
+    ret = coalesce_write(sock);
+    pthread_mutex_unlock(&sock->io_mutex);
+    return (ret);
+}
+
+/*
+ * Flush for a caller, who also hears about data lost since the last
+ * send
+ */
+static OFC_BOOL socket_flush(OFC_SOCKET_IMPL *sock) {
+    OFC_BOOL ret;
+
+    pthread_mutex_lock(&sock->io_mutex);
+    ret = coalesce_write(sock);
+    if (coalesce_report(sock, OFC_FALSE))
+        ret = OFC_FALSE;
+    pthread_mutex_unlock(&sock->io_mutex);
+    return (ret);
+}
+
+/*
+ * Send on a coalescing socket.  Data that fits is held.  Data that
+ * doesn't goes out in one writev behind whatever is held, and what the
+ * kernel doesn't take is held if it fits.  Called with io_mutex held.
+ */
+static OFC_SIZET coalesce_send(OFC_SOCKET_IMPL *sock, const OFC_VOID *buf,
+                               OFC_SIZET len) {
+    OFC_SIZET ret;
+    OFC_SIZET held;
+    OFC_SIZET taken;
+    OFC_SIZET room;
+    ssize_t status;
+    struct iovec iov[2];
+
+    ret = len;
+    if (len <= sock->coalesce_size - sock->coalesce_len) {
+        ofc_memcpy(sock->coalesce_buf + sock->coalesce_len, buf, len);
+        sock->coalesce_len += len;
+    } else {
+        held = sock->coalesce_len;
+        iov[0].iov_base = sock->coalesce_buf;
+        iov[0].iov_len = held;
+        iov[1].iov_base = (OFC_VOID *) buf;
+        iov[1].iov_len = len;
+        do {
+            status = writev(sock->socket, iov, 2);
+        } while (status == -1 && errno == EINTR);
+        stats_send(sock, held + len, status);
+        if (status == -1 && errno != EAGAIN)
+            ret = -1;
+        else {
+            if (status == -1)
+                status = 0;
+            taken = 0;
+            if ((OFC_SIZET) status < held)
+                coalesce_consume(sock, status);
+            else {
+                sock->coalesce_len = 0;
+                taken = status - held;
+            }
+            /*
+             * Hold what's left of the caller's data if it fits.
+             * Otherwise report a short send.
+             */
+            room = sock->coalesce_size - sock->coalesce_len;
+            if (len - taken <= room) {
+                ofc_memcpy(sock->coalesce_buf + sock->coalesce_len,
+                           (const OFC_UINT8 *) buf + taken, len - taken);
+                sock->coalesce_len += len - taken;
+            } else
+                ret = taken;
+        }
+    }
+    update_poll_events(sock);
+    return (ret);
+}
+
 /*
  * PSP_Send - Send data on a socket
  *
@@ -517,21 +2054,40 @@ OFC_BOOL ofc_socket_impl_no_block(OFC_HANDLE hSocket, OFC_BOOL onoff) {
  * Returns:
  *    Number of bytes written
  */
-OFC_SIZET ofc_socket_impl_send(OFC_HANDLE hSocket, const OFC_VOID *buf,
-                               OFC_SIZET len) {
-    OFC_SOCKET_IMPL *sock;
+static OFC_SIZET socket_send(OFC_SOCKET_IMPL *sock, const OFC_VOID *buf,
+                             OFC_SIZET len) {
     OFC_SIZET ret;
-
     OFC_SIZET status;
 
     ret = -1;
-    sock = ofc_handle_lock(hSocket);
-    if (sock != OFC_NULL) {
+    pthread_mutex_lock(&sock->io_mutex);
+    if (__atomic_load_n(&sock->closed, __ATOMIC_ACQUIRE))
+        errno = EBADF;
+    else if (coalesce_report(sock, OFC_TRUE))
+        ret = -1;
+    else if (sock->coalesce_size != 0)
+        ret = coalesce_send(sock, buf, len);
+    else {
         status = send(sock->socket, (const char *) buf, (int) len, 0);
+        stats_send(sock, len, status);
         if ((status == -1) && (errno == EAGAIN))
             ret = 0;
         else if (status >= 0)
             ret = status;
+    }
+    pthread_mutex_unlock(&sock->io_mutex);
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_send(OFC_HANDLE hSocket, const OFC_VOID *buf,
+                               OFC_SIZET len) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+
+    ret = -1;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        ret = socket_send(sock, buf, len);
         ofc_handle_unlock(hSocket);
     }
     return (ret);
@@ -558,16 +2114,17 @@ OFC_SIZET ofc_socket_impl_sendto(OFC_HANDLE hSocket, const OFC_VOID *buf,
     OFC_SIZET ret;
 
     OFC_SIZET status;
-    struct sockaddr *mysockaddr;
+    const struct sockaddr *mysockaddr;
     socklen_t mysocklen;
 
     ret = -1;
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        make_sockaddr(&mysockaddr, &mysocklen, ip, port);
+        mysockaddr = dest_sockaddr(sock, ip, port, &mysocklen);
 
         status = sendto(sock->socket, (const char *) buf, (int) len, 0,
                         mysockaddr, mysocklen);
+        stats_send(sock, len, status);
 
         if ((status == -1) && (errno == EAGAIN))
             ret = 0;
@@ -579,7 +2136,9 @@ OFC_SIZET ofc_socket_impl_sendto(OFC_HANDLE hSocket, const OFC_VOID *buf,
             OFC_SOCKADDR local;
             OFC_SOCKADDR remote;
             OFC_CHAR errstr[80];
+            int error;
 
+            error = errno;
             strerror_r(errno, errstr, 80);
             ofc_log(OFC_LOG_WARN, "Sendto Error: %.80s\n", errstr);
             ofc_socket_impl_get_addresses(hSocket, &local, &remote);
@@ -592,9 +2151,12 @@ OFC_SIZET ofc_socket_impl_sendto(OFC_HANDLE hSocket, const OFC_VOID *buf,
 		    "  errno: %d\n"
 		    "  local ip: %s\n"
 		    "  remote ip: %s\n",
-		    status, len, errno, local_ip, remote_ip);
+		    status, len, error, local_ip, remote_ip);
+            /*
+             * Leave the send's errno for the caller, not the logging's
+             */
+            errno = error;
         }
-        ofc_free(mysockaddr);
         ofc_handle_unlock(hSocket);
     }
 
@@ -602,34 +2164,103 @@ OFC_SIZET ofc_socket_impl_sendto(OFC_HANDLE hSocket, const OFC_VOID *buf,
 }
 
 /*
- * PSP_Recv - Receive bytes from a socket
- *
- * Accepts:
- *    hSock - Socket to read from
- *    buf - pointer to buffer to store data
- *    len - size of buffer
- *
- * Returns:
- *    number of bytes read
+ * Receive with the kernel's timestamp.  Called with the handle locked or
+ * a reference held.
  */
-OFC_SIZET ofc_socket_impl_recv(OFC_HANDLE hSocket,
-                               OFC_VOID *buf,
-                               OFC_SIZET len) {
-    OFC_SOCKET_IMPL *sock;
+static OFC_SIZET socket_recv_stamped(OFC_SOCKET_IMPL *sock, OFC_VOID *buf,
+                                     OFC_SIZET len, OFC_IPADDR *ip,
+                                     OFC_UINT16 *port, OFC_UINT64 *arrival) {
     OFC_SIZET ret;
+    ssize_t status;
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage mysockaddr;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(struct timeval)) +
+                 CMSG_SPACE(sizeof(OFC_UINT64))];
+    } control;
+    OFC_UINT64 stamp;
+
+    ret = -1;
+    stamp = 0;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_name = &mysockaddr;
+    msg.msg_namelen = sizeof(mysockaddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    msg.msg_flags = 0;
+    mysockaddr.ss_family = AF_UNSPEC;
+
+    pthread_mutex_lock(&sock->io_mutex);
+    status = recvmsg(sock->socket, &msg, 0);
+    stats_recv(sock, status);
+
+    if ((status == -1) && (errno == EAGAIN))
+        ret = 0;
+    else if (status >= 0) {
+        if (msg.msg_controllen > 0)
+            stamp = stamp_record(sock, &msg);
+        if (msg.msg_namelen > 0 && (ip != OFC_NULL || port != OFC_NULL))
+            unmake_sockaddr((struct sockaddr *) &mysockaddr, ip, port);
+        ret = status;
+    }
+    pthread_mutex_unlock(&sock->io_mutex);
+    if (arrival != OFC_NULL)
+        *arrival = stamp;
+    return (ret);
+}
 
+/*
+ * PSP_Recv - Receive bytes from a socket
+ *
+ * Accepts:
+ *    hSock - Socket to read from
+ *    buf - pointer to buffer to store data
+ *    len - size of buffer
+ *
+ * Returns:
+ *    number of bytes read
+ */
+static OFC_SIZET socket_recv(OFC_SOCKET_IMPL *sock, OFC_VOID *buf,
+                             OFC_SIZET len) {
+    OFC_SIZET ret;
     OFC_SIZET status;
 
-    sock = ofc_handle_lock(hSocket);
     ret = -1;
-    if (sock != OFC_NULL) {
+    if (__atomic_load_n(&sock->closed, __ATOMIC_ACQUIRE))
+        errno = EBADF;
+    else if (sock->delay != OFC_NULL)
+        ret = socket_recv_stamped(sock, buf, len, OFC_NULL, OFC_NULL,
+                                  OFC_NULL);
+    else {
+        /*
+         * A plain receive touches nothing but the atomic counters
+         */
         status = recv(sock->socket, (char *) buf, (int) len, 0);
+        stats_recv(sock, status);
 
         if ((status == -1) && (errno == EAGAIN))
             ret = 0;
-        else if (status >= 0) {
+        else if (status >= 0)
             ret = status;
-        }
+    }
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_recv(OFC_HANDLE hSocket,
+                               OFC_VOID *buf,
+                               OFC_SIZET len) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+
+    sock = ofc_handle_lock(hSocket);
+    ret = -1;
+    if (sock != OFC_NULL) {
+        ret = socket_recv(sock, buf, len);
         ofc_handle_unlock(hSocket);
     }
 
@@ -657,205 +2288,1779 @@ OFC_SIZET ofc_socket_impl_recv_from(OFC_HANDLE hSocket,
     OFC_SOCKET_IMPL *sock;
     OFC_SIZET ret;
 
-    struct sockaddr *mysockaddr;
+    struct sockaddr_storage mysockaddr;
     socklen_t mysize;
     OFC_SIZET status;
 
     ret = -1;
     sock = ofc_handle_lock(hSocket);
-    if (sock != OFC_NULL) {
-        mysize = (OFC_MAX (sizeof(struct sockaddr_in6),
-                           sizeof(struct sockaddr_in)));
-
-        mysockaddr = ofc_malloc(mysize);
-        ofc_memset(mysockaddr, '\0', mysize);
+    if (sock != OFC_NULL && sock->delay != OFC_NULL) {
+        ret = socket_recv_stamped(sock, buf, len, ip, port, OFC_NULL);
+        ofc_handle_unlock(hSocket);
+    } else if (sock != OFC_NULL) {
+        mysize = sizeof(mysockaddr);
+        mysockaddr.ss_family = AF_UNSPEC;
 
         status = recvfrom(sock->socket, (char *) buf, (int) len, 0,
-                          mysockaddr, &mysize);
+                          (struct sockaddr *) &mysockaddr, &mysize);
+        stats_recv(sock, status);
 
         if ((status == -1) && (errno == EAGAIN))
             ret = 0;
         else if (status >= 0) {
-            unmake_sockaddr(mysockaddr, ip, port);
+            unmake_sockaddr((struct sockaddr *) &mysockaddr, ip, port);
             ret = status;
         }
-        ofc_free(mysockaddr);
         ofc_handle_unlock(hSocket);
     }
     return (ret);
 }
 
-OFC_VOID ofc_socket_impl_set_event(OFC_HANDLE hSocket,
-                                   OFC_UINT16 revents) {
-    OFC_SOCKET_IMPL *pSocket;
+OFC_SIZET ofc_socket_impl_recv_stamped(OFC_HANDLE hSocket,
+                                       OFC_VOID *buf, OFC_SIZET len,
+                                       OFC_IPADDR *ip, OFC_UINT16 *port,
+                                       OFC_UINT64 *arrival) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
 
-    pSocket = ofc_handle_lock(hSocket);
-    if (pSocket != OFC_NULL) {
-        pSocket->revents = revents;
+    ret = -1;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        ret = socket_recv_stamped(sock, buf, len, ip, port, arrival);
         ofc_handle_unlock(hSocket);
     }
+    return (ret);
 }
 
-OFC_UINT16 ofc_socket_impl_get_event(OFC_HANDLE hSocket) {
-    OFC_SOCKET_IMPL *pSocket;
-    OFC_UINT16 ret;
+OFC_BOOL ofc_socket_impl_timestamps(OFC_HANDLE hSocket, OFC_BOOL onoff) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
 
-    pSocket = ofc_handle_lock(hSocket);
-    ret = 0;
-    if (pSocket != OFC_NULL) {
-        ret = pSocket->events;
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        ret = socket_stamp_enable(sock, onoff);
         ofc_handle_unlock(hSocket);
     }
     return (ret);
 }
 
-int ofc_socket_impl_get_fd(OFC_HANDLE hSocket) {
-    OFC_SOCKET_IMPL *pSocket;
-    int fd;
-
-    fd = -1;
+OFC_BOOL ofc_socket_impl_delay(OFC_HANDLE hSocket, OFC_SOCKET_DELAY *delay,
+                               OFC_BOOL reset) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
 
-    pSocket = ofc_handle_lock(hSocket);
-    if (pSocket != OFC_NULL) {
-        fd = pSocket->socket;
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->delay != OFC_NULL) {
+            if (delay != OFC_NULL)
+                *delay = *sock->delay;
+            if (reset)
+                ofc_memset(sock->delay, 0, sizeof(OFC_SOCKET_DELAY));
+            ret = OFC_TRUE;
+        }
         ofc_handle_unlock(hSocket);
     }
-    return (fd);
+    return (ret);
 }
 
-OFC_SOCKET_EVENT_TYPE ofc_socket_impl_test(OFC_HANDLE hSocket) {
-    OFC_SOCKET_IMPL *pSocket;
-    OFC_SOCKET_EVENT_TYPE EventTest;
+OFC_SIZET ofc_socket_impl_recv_buf(OFC_HANDLE hSocket, OFC_RXBUF *buf) {
+    OFC_SIZET ret;
 
-    EventTest = 0;
+    ret = 0;
+    if (buf->len < buf->size) {
+        ret = ofc_socket_impl_recv(hSocket, buf->data + buf->len,
+                                   buf->size - buf->len);
+        if (ret != (OFC_SIZET) -1)
+            buf->len += ret;
+    }
+    return (ret);
+}
 
-    pSocket = ofc_handle_lock(hSocket);
-    if (pSocket != OFC_NULL) {
+OFC_SIZET ofc_socket_impl_recv_from_buf(OFC_HANDLE hSocket, OFC_RXBUF *buf,
+                                        OFC_IPADDR *ip, OFC_UINT16 *port) {
+    OFC_SIZET ret;
 
-        if (pSocket->revents & POLLHUP)
-            EventTest |= OFC_SOCKET_EVENT_CLOSE;
-        if (pSocket->revents & POLLIN)
-            EventTest |= (OFC_SOCKET_EVENT_ACCEPT | OFC_SOCKET_EVENT_READ);
-        if (pSocket->revents & POLLERR)
-            EventTest |= OFC_SOCKET_EVENT_ADDRESSCHANGE;
-        if (pSocket->revents & POLLPRI)
-            EventTest |= OFC_SOCKET_EVENT_QOS;
-        if (pSocket->revents & (POLLRDBAND | POLLWRBAND))
-            EventTest |= OFC_SOCKET_EVENT_QOB;
-        if (pSocket->revents & POLLOUT)
-            EventTest |= OFC_SOCKET_EVENT_WRITE;
+    buf->len = 0;
+    ret = ofc_socket_impl_recv_from(hSocket, buf->data, buf->size, ip, port);
+    if (ret != (OFC_SIZET) -1)
+        buf->len = ret;
+    return (ret);
+}
 
-        ofc_handle_unlock(hSocket);
+/*
+ * Copy caller segments into the kernel's iovec form.  Returns the
+ * number of segments copied, clamped to OFC_SOCKET_IOV_MAX.
+ */
+static int iov_import(struct iovec *kiov, const OFC_IOVEC *iov,
+                      OFC_INT iovcnt) {
+    int i;
+
+    if (iovcnt > OFC_SOCKET_IOV_MAX)
+        iovcnt = OFC_SOCKET_IOV_MAX;
+    for (i = 0; i < iovcnt; i++) {
+        kiov[i].iov_base = iov[i].base;
+        kiov[i].iov_len = (size_t) iov[i].len;
     }
-
-    return (EventTest);
+    return (i);
 }
 
-OFC_BOOL ofc_socket_impl_enable(OFC_HANDLE hSocket,
-                                OFC_SOCKET_EVENT_TYPE type) {
-    OFC_SOCKET_IMPL *pSocket;
-    OFC_INT EventTest;
-    OFC_BOOL ret;
+static OFC_SIZET msg_len(const struct msghdr *msg) {
+    OFC_SIZET total;
+    int i;
 
-    ret = OFC_FALSE;
-    pSocket = ofc_handle_lock(hSocket);
-    if (pSocket != OFC_NULL) {
-        EventTest = 0;
+    total = 0;
+    for (i = 0; i < (int) msg->msg_iovlen; i++)
+        total += msg->msg_iov[i].iov_len;
+    return (total);
+}
 
-        if (type & OFC_SOCKET_EVENT_CLOSE)
-            EventTest |= POLLHUP;
-        if (type & OFC_SOCKET_EVENT_ACCEPT)
-            EventTest |= POLLIN;
-        if (type & OFC_SOCKET_EVENT_ADDRESSCHANGE)
-            EventTest |= POLLERR;
-        if (type & OFC_SOCKET_EVENT_QOS)
-            EventTest |= POLLPRI;
-        if (type & OFC_SOCKET_EVENT_QOB)
-            EventTest |= (POLLRDBAND | POLLWRBAND);
-        if (type & OFC_SOCKET_EVENT_READ)
-            EventTest |= POLLIN;
-        if (type & OFC_SOCKET_EVENT_WRITE)
-            EventTest |= POLLOUT;
+/*
+ * Common sendmsg/recvmsg wrapper.  msg_iov and msg_iovlen must already
+ * be set.  Maps EAGAIN to 0 the way send and recv do.
+ */
+static OFC_SIZET msg_io(OFC_HANDLE hSocket, struct msghdr *msg,
+                        const OFC_IPADDR *ip, OFC_UINT16 port,
+                        OFC_IPADDR *from_ip, OFC_UINT16 *from_port,
+                        OFC_BOOL sending) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+    ssize_t status;
+    struct sockaddr_storage mysockaddr;
+    socklen_t mysocklen;
 
-        pSocket->events = EventTest;
+    ret = -1;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        msg->msg_name = OFC_NULL;
+        msg->msg_namelen = 0;
+        msg->msg_control = OFC_NULL;
+        msg->msg_controllen = 0;
+        msg->msg_flags = 0;
+
+        if (sending && !coalesce_flush(sock)) {
+            /*
+             * Held data has to go first
+             */
+            status = -1;
+            errno = EAGAIN;
+        } else if (sending) {
+            if (ip != OFC_NULL) {
+                msg->msg_name = (OFC_VOID *) dest_sockaddr(sock, ip, port,
+                                                           &mysocklen);
+                msg->msg_namelen = mysocklen;
+            }
+            status = sendmsg(sock->socket, msg, 0);
+            stats_send(sock, msg_len(msg), status);
+        } else {
+            msg->msg_name = &mysockaddr;
+            msg->msg_namelen = sizeof(mysockaddr);
+            mysockaddr.ss_family = AF_UNSPEC;
+            status = recvmsg(sock->socket, msg, 0);
+            stats_recv(sock, status);
+            if (status >= 0 && msg->msg_namelen > 0 &&
+                (from_ip != OFC_NULL || from_port != OFC_NULL))
+                unmake_sockaddr((struct sockaddr *) &mysockaddr,
+                                from_ip, from_port);
+        }
+
+        if ((status == -1) && (errno == EAGAIN))
+            ret = 0;
+        else if (status >= 0)
+            ret = (OFC_SIZET) status;
         ofc_handle_unlock(hSocket);
-        ret = OFC_TRUE;
     }
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_sendv(OFC_HANDLE hSocket,
+                                const OFC_IOVEC *iov, OFC_INT iovcnt) {
+    struct iovec kiov[OFC_SOCKET_IOV_MAX];
+    struct msghdr msg;
 
+    msg.msg_iov = kiov;
+    msg.msg_iovlen = iov_import(kiov, iov, iovcnt);
+    return (msg_io(hSocket, &msg, OFC_NULL, 0, OFC_NULL, OFC_NULL,
+                   OFC_TRUE));
+}
+
+OFC_SIZET ofc_socket_impl_recvv(OFC_HANDLE hSocket,
+                                const OFC_IOVEC *iov, OFC_INT iovcnt) {
+    struct iovec kiov[OFC_SOCKET_IOV_MAX];
+    struct msghdr msg;
+
+    msg.msg_iov = kiov;
+    msg.msg_iovlen = iov_import(kiov, iov, iovcnt);
+    return (msg_io(hSocket, &msg, OFC_NULL, 0, OFC_NULL, OFC_NULL,
+                   OFC_FALSE));
+}
+
+OFC_SIZET ofc_socket_impl_sendtov(OFC_HANDLE hSocket,
+                                  const OFC_IOVEC *iov, OFC_INT iovcnt,
+                                  const OFC_IPADDR *ip, OFC_UINT16 port) {
+    struct iovec kiov[OFC_SOCKET_IOV_MAX];
+    struct msghdr msg;
+    OFC_SIZET ret;
+
+    /*
+     * A datagram can't be split across calls
+     */
+    ret = -1;
+    if (iovcnt <= OFC_SOCKET_IOV_MAX) {
+        msg.msg_iov = kiov;
+        msg.msg_iovlen = iov_import(kiov, iov, iovcnt);
+        ret = msg_io(hSocket, &msg, ip, port, OFC_NULL, OFC_NULL, OFC_TRUE);
+    }
     return (ret);
 }
 
-OFC_VOID ofc_socket_impl_set_send_size(OFC_HANDLE hSocket, OFC_INT size) {
+OFC_SIZET ofc_socket_impl_recv_fromv(OFC_HANDLE hSocket,
+                                     const OFC_IOVEC *iov, OFC_INT iovcnt,
+                                     OFC_IPADDR *ip, OFC_UINT16 *port) {
+    struct iovec kiov[OFC_SOCKET_IOV_MAX];
+    struct msghdr msg;
+
+    msg.msg_iov = kiov;
+    msg.msg_iovlen = iov_import(kiov, iov, iovcnt);
+    return (msg_io(hSocket, &msg, OFC_NULL, 0, ip, port, OFC_FALSE));
+}
+
+OFC_INT ofc_socket_impl_iov_advance(OFC_IOVEC *iov, OFC_INT iovcnt,
+                                    OFC_SIZET count) {
+    OFC_INT i;
+
+    for (i = 0; i < iovcnt && count >= iov[i].len; i++) {
+        count -= iov[i].len;
+        iov[i].base = (OFC_CHAR *) iov[i].base + iov[i].len;
+        iov[i].len = 0;
+    }
+    if (i < iovcnt && count > 0) {
+        iov[i].base = (OFC_CHAR *) iov[i].base + count;
+        iov[i].len -= count;
+    }
+    return (i);
+}
+
+#if defined(OFC_DARWIN_HAVE_SENDMMSG) || defined(OFC_DARWIN_HAVE_RECVMMSG)
+/*
+ * Scratch state for one kernel batch call.  Lives on the stack.
+ */
+typedef struct {
+    struct mmsghdr msgs[OFC_SOCKET_BATCH_MAX];
+    struct iovec iov[OFC_SOCKET_BATCH_MAX];
+    struct sockaddr_storage addrs[OFC_SOCKET_BATCH_MAX];
+} DGRAM_BATCH;
+#endif
+
+OFC_INT ofc_socket_impl_sendto_batch(OFC_HANDLE hSocket,
+                                     OFC_SOCKET_DATAGRAM *dgrams,
+                                     OFC_INT count) {
     OFC_SOCKET_IMPL *sock;
+    OFC_INT sent;
+    OFC_INT i;
+    OFC_BOOL blocked;
+#if defined(OFC_DARWIN_HAVE_SENDMMSG)
+    DGRAM_BATCH batch;
+    OFC_INT chunk;
+    int status;
+#else
+    const struct sockaddr *mysockaddr;
+    socklen_t mysocklen;
+    ssize_t status;
+#endif
+
+    sent = 0;
+    for (i = 0; i < count; i++)
+        dgrams[i].status = 0;
 
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        setsockopt(sock->socket, SOL_SOCKET, SO_SNDBUF,
-                   (const char *) &size, sizeof(size));
+        blocked = OFC_FALSE;
+#if defined(OFC_DARWIN_HAVE_SENDMMSG)
+        while (sent < count && !blocked) {
+            chunk = OFC_MIN(count - sent, OFC_SOCKET_BATCH_MAX);
+            for (i = 0; i < chunk; i++) {
+                OFC_SOCKET_DATAGRAM *dgram;
+
+                dgram = &dgrams[sent + i];
+                make_sockaddr(&batch.addrs[i], &batch.msgs[i].msg_hdr.msg_namelen,
+                              &dgram->ip, dgram->port, sock->dual);
+                batch.iov[i].iov_base = dgram->buf;
+                batch.iov[i].iov_len = (size_t) dgram->len;
+                batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+                batch.msgs[i].msg_hdr.msg_iov = &batch.iov[i];
+                batch.msgs[i].msg_hdr.msg_iovlen = 1;
+                batch.msgs[i].msg_hdr.msg_control = OFC_NULL;
+                batch.msgs[i].msg_hdr.msg_controllen = 0;
+                batch.msgs[i].msg_hdr.msg_flags = 0;
+                batch.msgs[i].msg_len = 0;
+            }
+
+            status = sendmmsg(sock->socket, batch.msgs, chunk, 0);
+            if (status < 0) {
+                stats_send(sock, 0, -1);
+                dgrams[sent].status = (errno == EAGAIN) ? 0 : -1;
+                blocked = OFC_TRUE;
+            } else {
+                for (i = 0; i < status; i++) {
+                    dgrams[sent + i].status = batch.msgs[i].msg_len;
+                    stats_send(sock, dgrams[sent + i].len,
+                               batch.msgs[i].msg_len);
+                }
+                sent += status;
+                /*
+                 * A short batch means the kernel hit a problem on the
+                 * next one.  Let the next call report it.
+                 */
+                if (status < chunk)
+                    blocked = OFC_TRUE;
+            }
+        }
+#else
+        /*
+         * No batch syscall.  Loop, but with the handle locked once and
+         * the destination cache doing the address work.
+         */
+        for (i = 0; i < count && !blocked; i++) {
+            mysockaddr = dest_sockaddr(sock, &dgrams[i].ip, dgrams[i].port,
+                                       &mysocklen);
+            status = sendto(sock->socket, dgrams[i].buf,
+                            (size_t) dgrams[i].len, 0,
+                            mysockaddr, mysocklen);
+            stats_send(sock, dgrams[i].len, status);
+            if (status < 0) {
+                dgrams[i].status = (errno == EAGAIN) ? 0 : -1;
+                blocked = OFC_TRUE;
+            } else {
+                dgrams[i].status = status;
+                sent++;
+            }
+        }
+#endif
         ofc_handle_unlock(hSocket);
     }
+    return (sent);
 }
 
-OFC_VOID ofc_socket_impl_set_recv_size(OFC_HANDLE hSocket, OFC_INT size) {
+OFC_INT ofc_socket_impl_recv_from_batch(OFC_HANDLE hSocket,
+                                        OFC_SOCKET_DATAGRAM *dgrams,
+                                        OFC_INT count) {
     OFC_SOCKET_IMPL *sock;
+    OFC_INT received;
+    OFC_INT i;
+#if defined(OFC_DARWIN_HAVE_RECVMMSG)
+    DGRAM_BATCH batch;
+    int status;
+#else
+    struct sockaddr_storage mysockaddr;
+    socklen_t mysize;
+    ssize_t status;
+    OFC_BOOL blocked;
+#endif
+
+    received = 0;
+    for (i = 0; i < count; i++)
+        dgrams[i].status = 0;
 
     sock = ofc_handle_lock(hSocket);
     if (sock != OFC_NULL) {
-        setsockopt(sock->socket, SOL_SOCKET, SO_RCVBUF,
-                   (const char *) &size, sizeof(size));
+#if defined(OFC_DARWIN_HAVE_RECVMMSG)
+        count = OFC_MIN(count, OFC_SOCKET_BATCH_MAX);
+        for (i = 0; i < count; i++) {
+            batch.iov[i].iov_base = dgrams[i].buf;
+            batch.iov[i].iov_len = (size_t) dgrams[i].len;
+            batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+            batch.msgs[i].msg_hdr.msg_namelen = sizeof(batch.addrs[i]);
+            batch.msgs[i].msg_hdr.msg_iov = &batch.iov[i];
+            batch.msgs[i].msg_hdr.msg_iovlen = 1;
+            batch.msgs[i].msg_hdr.msg_control = OFC_NULL;
+            batch.msgs[i].msg_hdr.msg_controllen = 0;
+            batch.msgs[i].msg_hdr.msg_flags = 0;
+            batch.msgs[i].msg_len = 0;
+        }
+        status = recvmmsg(sock->socket, batch.msgs, count, MSG_WAITFORONE,
+                          OFC_NULL);
+        if (status < 0) {
+            stats_recv(sock, -1);
+            if (count > 0)
+                dgrams[0].status = (errno == EAGAIN) ? 0 : -1;
+        } else {
+            for (i = 0; i < status; i++) {
+                stats_recv(sock, batch.msgs[i].msg_len);
+                dgrams[i].len = batch.msgs[i].msg_len;
+                dgrams[i].status = batch.msgs[i].msg_len;
+                unmake_sockaddr((struct sockaddr *) &batch.addrs[i],
+                                &dgrams[i].ip, &dgrams[i].port);
+            }
+            received = status;
+        }
+#else
+        blocked = OFC_FALSE;
+        for (i = 0; i < count && !blocked; i++) {
+            mysize = sizeof(mysockaddr);
+            mysockaddr.ss_family = AF_UNSPEC;
+            /*
+             * Only the first receive honours the blocking mode
+             */
+            status = recvfrom(sock->socket, dgrams[i].buf,
+                              (size_t) dgrams[i].len,
+                              i == 0 ? 0 : MSG_DONTWAIT,
+                              (struct sockaddr *) &mysockaddr, &mysize);
+            stats_recv(sock, status);
+            if (status < 0) {
+                dgrams[i].status = (errno == EAGAIN) ? 0 : -1;
+                blocked = OFC_TRUE;
+            } else {
+                dgrams[i].len = status;
+                dgrams[i].status = status;
+                unmake_sockaddr((struct sockaddr *) &mysockaddr,
+                                &dgrams[i].ip, &dgrams[i].port);
+                received++;
+            }
+        }
+#endif
         ofc_handle_unlock(hSocket);
     }
+    return (received);
 }
 
-OFC_BOOL ofc_socket_impl_get_addresses(OFC_HANDLE hSock,
-                                       OFC_SOCKADDR *local,
-                                       OFC_SOCKADDR *remote) {
-    OFC_SOCKET_IMPL *sock;
-    OFC_BOOL ret;
-    int darwin_status;
-    struct sockaddr *local_sockaddr;
-    struct sockaddr *remote_sockaddr;
-    socklen_t local_sockaddr_size;
-    socklen_t remote_sockaddr_size;
+#define SENDFILE_WINDOW (1024 * 1024)
 
-    ret = OFC_FALSE;
-    sock = ofc_handle_lock(hSock);
-    if (sock != OFC_NULL) {
-        local_sockaddr_size = (OFC_MAX (sizeof(struct sockaddr_in6),
-                                        sizeof(struct sockaddr_in)));
-        local_sockaddr = ofc_malloc(local_sockaddr_size);
-        darwin_status = getsockname(sock->socket, local_sockaddr,
-                                    &local_sockaddr_size);
-        if (darwin_status == 0) {
-            if (local_sockaddr->sa_family == AF_INET)
-                local->sin_family = OFC_FAMILY_IP;
-            else
-                local->sin_family = OFC_FAMILY_IPV6;
-            unmake_sockaddr(local_sockaddr,
-                            &local->sin_addr, &local->sin_port);
+static OFC_SIZET iov_total(const OFC_IOVEC *iov, OFC_INT iovcnt) {
+    OFC_SIZET total;
+    OFC_INT i;
 
-            remote_sockaddr_size = (OFC_MAX (sizeof(struct sockaddr_in6),
-                                             sizeof(struct sockaddr_in)));
-            remote_sockaddr = ofc_malloc(remote_sockaddr_size);
+    total = 0;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].len;
+    return (total);
+}
 
-            darwin_status = getpeername(sock->socket,
-                                        remote_sockaddr,
-                                        &remote_sockaddr_size);
-            if (darwin_status == 0) {
-                if (remote_sockaddr->sa_family == AF_INET)
-                    remote->sin_family = OFC_FAMILY_IP;
-                else
-                    remote->sin_family = OFC_FAMILY_IPV6;
-                unmake_sockaddr(remote_sockaddr, &remote->sin_addr,
-                                &remote->sin_port);
-                ret = OFC_TRUE;
-            }
-            ofc_free(remote_sockaddr);
+/*
+ * Account for bytes the kernel took: header first, then file data, then
+ * trailer.
+ */
+static OFC_VOID sendfile_consume(OFC_SOCKET_SENDFILE *xfer, OFC_SIZET count) {
+    OFC_SIZET part;
+
+    part = OFC_MIN(count, iov_total(xfer->header, xfer->header_count));
+    ofc_socket_impl_iov_advance(xfer->header, xfer->header_count, part);
+    count -= part;
+
+    part = (OFC_SIZET) OFC_MIN((OFC_OFFT) count, xfer->remaining);
+    xfer->offset += part;
+    xfer->remaining -= part;
+    count -= part;
+
+    ofc_socket_impl_iov_advance(xfer->trailer, xfer->trailer_count, count);
+}
+
+OFC_VOID ofc_socket_impl_sendfile_init(OFC_SOCKET_SENDFILE *xfer, int fd,
+                                       OFC_OFFT offset, OFC_OFFT length,
+                                       OFC_IOVEC *header,
+                                       OFC_INT header_count,
+                                       OFC_IOVEC *trailer,
+                                       OFC_INT trailer_count) {
+    xfer->fd = fd;
+    xfer->offset = offset;
+    xfer->remaining = length;
+    xfer->header = header;
+    xfer->header_count = header == OFC_NULL ? 0 : header_count;
+    xfer->trailer = trailer;
+    xfer->trailer_count = trailer == OFC_NULL ? 0 : trailer_count;
+    xfer->map = OFC_NULL;
+    xfer->map_offset = 0;
+    xfer->map_len = 0;
+}
+
+OFC_BOOL ofc_socket_impl_sendfile_done(OFC_SOCKET_SENDFILE *xfer) {
+    return (xfer->remaining == 0 &&
+            iov_total(xfer->header, xfer->header_count) == 0 &&
+            iov_total(xfer->trailer, xfer->trailer_count) == 0);
+}
+
+OFC_VOID ofc_socket_impl_sendfile_cleanup(OFC_SOCKET_SENDFILE *xfer) {
+    if (xfer->map != OFC_NULL) {
+        munmap(xfer->map, xfer->map_len);
+        xfer->map = OFC_NULL;
+        xfer->map_len = 0;
+    }
+}
+
+/*
+ * Make sure the mapped window covers the next file byte
+ *
+ * The fallback maps the file rather than reading it into a pooled
+ * buffer.  Sending from the mapping copies page cache to socket once,
+ * where a read into a buffer would copy it twice, which is the copy this
+ * call exists to save.  A mapping is tied to its file, so windows can't
+ * be pooled across transfers.  The window lives in the transfer and is
+ * reused until the data moves past it, so one map and unmap covers 1MB
+ * of sends.
+ */
+static OFC_BOOL sendfile_map(OFC_SOCKET_SENDFILE *xfer) {
+    OFC_OFFT page;
+    OFC_OFFT map_offset;
+    OFC_OFFT end;
+    OFC_BOOL ret;
+    OFC_VOID *map;
+
+    ret = OFC_TRUE;
+    if (xfer->map == OFC_NULL ||
+        xfer->offset < xfer->map_offset ||
+        xfer->offset >= xfer->map_offset + (OFC_OFFT) xfer->map_len) {
+        ofc_socket_impl_sendfile_cleanup(xfer);
+
+        page = (OFC_OFFT) sysconf(_SC_PAGESIZE);
+        map_offset = xfer->offset & ~(page - 1);
+        end = OFC_MIN(xfer->offset + xfer->remaining,
+                      map_offset + SENDFILE_WINDOW);
+
+        map = mmap(NULL, (size_t) (end - map_offset), PROT_READ, MAP_SHARED,
+                   xfer->fd, (off_t) map_offset);
+        if (map == MAP_FAILED)
+            ret = OFC_FALSE;
+        else {
+            /*
+             * Read ahead aggressively, and let pages go once sent
+             */
+            posix_madvise(map, (size_t) (end - map_offset),
+                          POSIX_MADV_SEQUENTIAL);
+            xfer->map = map;
+            xfer->map_offset = map_offset;
+            xfer->map_len = (OFC_SIZET) (end - map_offset);
         }
-        ofc_free(local_sockaddr);
-        ofc_handle_unlock(hSock);
     }
     return (ret);
 }
 
+OFC_SIZET ofc_socket_impl_sendfile(OFC_HANDLE hSocket,
+                                   OFC_SOCKET_SENDFILE *xfer) {
+    OFC_SIZET ret;
+    OFC_IOVEC iov[OFC_SOCKET_IOV_MAX];
+    OFC_INT iovcnt;
+    OFC_INT i;
+#if defined(OFC_DARWIN_HAVE_SENDFILE)
+    OFC_SOCKET_IMPL *sock;
+    struct iovec hdr[OFC_SOCKET_IOV_MAX];
+    struct iovec trl[OFC_SOCKET_IOV_MAX];
+    struct sf_hdtr hdtr;
+    OFC_SIZET hdr_len;
+    off_t len;
+    int status;
+#endif
+
+    ret = -1;
+    if (ofc_socket_impl_sendfile_done(xfer))
+        ret = 0;
+    else if (xfer->remaining == 0) {
+        /*
+         * Only header and trailer bytes left.  Nothing for the file
+         * path to do.
+         */
+        iovcnt = 0;
+        for (i = 0; i < xfer->header_count && iovcnt < OFC_SOCKET_IOV_MAX;
+             i++)
+            if (xfer->header[i].len > 0)
+                iov[iovcnt++] = xfer->header[i];
+        for (i = 0; i < xfer->trailer_count && iovcnt < OFC_SOCKET_IOV_MAX;
+             i++)
+            if (xfer->trailer[i].len > 0)
+                iov[iovcnt++] = xfer->trailer[i];
+        ret = ofc_socket_impl_sendv(hSocket, iov, iovcnt);
+        if (ret != (OFC_SIZET) -1)
+            sendfile_consume(xfer, ret);
+    } else {
+#if defined(OFC_DARWIN_HAVE_SENDFILE)
+        sock = ofc_handle_lock(hSocket);
+        if (sock != OFC_NULL && xfer->header_count > OFC_SOCKET_IOV_MAX) {
+            /*
+             * More header than sendfile can take in one go.  Send the
+             * header on its own until it fits.
+             */
+            ret = ofc_socket_impl_sendv(hSocket, xfer->header,
+                                        xfer->header_count);
+            if (ret != (OFC_SIZET) -1)
+                sendfile_consume(xfer, ret);
+            ofc_handle_unlock(hSocket);
+        } else if (sock != OFC_NULL && !coalesce_flush(sock)) {
+            ret = 0;
+            ofc_handle_unlock(hSocket);
+        } else if (sock != OFC_NULL) {
+            hdr_len = iov_total(xfer->header, xfer->header_count);
+            hdtr.headers = hdr;
+            hdtr.hdr_cnt = iov_import(hdr, xfer->header, xfer->header_count);
+            /*
+             * An oversized trailer is left for the header/trailer only
+             * path once the file data is out
+             */
+            hdtr.trailers = trl;
+            hdtr.trl_cnt = 0;
+            if (xfer->trailer_count <= OFC_SOCKET_IOV_MAX)
+                hdtr.trl_cnt = iov_import(trl, xfer->trailer,
+                                          xfer->trailer_count);
+            /*
+             * With a header present, len bounds header plus file bytes.
+             * On return it holds everything sent, trailer included.
+             */
+            len = (off_t) (hdr_len + xfer->remaining);
+            status = sendfile(xfer->fd, sock->socket, (off_t) xfer->offset,
+                              &len, &hdtr, 0);
+            stats_send(sock, hdr_len + (OFC_SIZET) xfer->remaining,
+                       (status == 0 || len > 0) ? (ssize_t) len : -1);
+            if (status == 0 ||
+                ((errno == EAGAIN || errno == EINTR) && len > 0)) {
+                ret = (OFC_SIZET) len;
+                sendfile_consume(xfer, ret);
+            } else if (errno == EAGAIN)
+                ret = 0;
+            ofc_handle_unlock(hSocket);
+        }
+#else
+        if (sendfile_map(xfer)) {
+            OFC_SIZET chunk;
+
+            iovcnt = 0;
+            for (i = 0; i < xfer->header_count && iovcnt < OFC_SOCKET_IOV_MAX;
+                 i++)
+                if (xfer->header[i].len > 0)
+                    iov[iovcnt++] = xfer->header[i];
+
+            chunk = (OFC_SIZET)
+                    OFC_MIN(xfer->remaining,
+                            xfer->map_offset + (OFC_OFFT) xfer->map_len -
+                            xfer->offset);
+            if (iovcnt < OFC_SOCKET_IOV_MAX) {
+                iov[iovcnt].base = (OFC_CHAR *) xfer->map +
+                                   (xfer->offset - xfer->map_offset);
+                iov[iovcnt].len = chunk;
+                iovcnt++;
+            }
+            /*
+             * Trailer rides along only with the last of the file
+             */
+            if ((OFC_OFFT) chunk == xfer->remaining) {
+                for (i = 0; i < xfer->trailer_count &&
+                            iovcnt < OFC_SOCKET_IOV_MAX; i++)
+                    if (xfer->trailer[i].len > 0)
+                        iov[iovcnt++] = xfer->trailer[i];
+            }
+
+            ret = ofc_socket_impl_sendv(hSocket, iov, iovcnt);
+            if (ret != (OFC_SIZET) -1)
+                sendfile_consume(xfer, ret);
+        }
+#endif
+    }
+    return (ret);
+}
+
+OFC_SOCKET_REF *ofc_socket_impl_ref(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        __atomic_add_fetch(&sock->refcount, 1, __ATOMIC_RELAXED);
+        ofc_handle_unlock(hSocket);
+    }
+    return (sock);
+}
+
+OFC_VOID ofc_socket_impl_ref_release(OFC_SOCKET_REF *ref) {
+    socket_unref(ref);
+}
+
+OFC_SIZET ofc_socket_impl_ref_send(OFC_SOCKET_REF *ref, const OFC_VOID *buf,
+                                   OFC_SIZET len) {
+    return (socket_send(ref, buf, len));
+}
+
+OFC_SIZET ofc_socket_impl_ref_recv(OFC_SOCKET_REF *ref, OFC_VOID *buf,
+                                   OFC_SIZET len) {
+    return (socket_recv(ref, buf, len));
+}
+
+int ofc_socket_impl_ref_fd(OFC_SOCKET_REF *ref) {
+    int fd;
+
+    fd = ref->socket;
+    if (__atomic_load_n(&ref->closed, __ATOMIC_ACQUIRE))
+        fd = -1;
+    return (fd);
+}
+
+OFC_UINT16 ofc_socket_impl_ref_get_event(OFC_SOCKET_REF *ref) {
+    return (__atomic_load_n(&ref->poll_events, __ATOMIC_RELAXED));
+}
+
+OFC_VOID ofc_socket_impl_ref_set_event(OFC_SOCKET_REF *ref,
+                                       OFC_UINT16 revents) {
+    __atomic_store_n(&ref->revents, revents, __ATOMIC_RELAXED);
+}
+
+OFC_MSTIME ofc_socket_impl_ref_wait_time(OFC_SOCKET_REF *ref) {
+    return (socket_wait_time(ref));
+}
+
+OFC_VOID ofc_socket_impl_set_event(OFC_HANDLE hSocket,
+                                   OFC_UINT16 revents) {
+    OFC_SOCKET_IMPL *pSocket;
+
+    pSocket = ofc_handle_lock(hSocket);
+    if (pSocket != OFC_NULL) {
+        pSocket->revents = revents;
+        ofc_handle_unlock(hSocket);
+    }
+}
+
+OFC_UINT16 ofc_socket_impl_get_event(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *pSocket;
+    OFC_UINT16 ret;
+
+    pSocket = ofc_handle_lock(hSocket);
+    ret = 0;
+    if (pSocket != OFC_NULL) {
+        ret = pSocket->poll_events;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+int ofc_socket_impl_get_fd(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *pSocket;
+    int fd;
+
+    fd = -1;
+
+    pSocket = ofc_handle_lock(hSocket);
+    if (pSocket != OFC_NULL) {
+        fd = pSocket->socket;
+        ofc_handle_unlock(hSocket);
+    }
+    return (fd);
+}
+
+OFC_SOCKET_EVENT_TYPE ofc_socket_impl_test(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *pSocket;
+    OFC_SOCKET_EVENT_TYPE EventTest;
+    OFC_UINT16 revents;
+
+    EventTest = 0;
+
+    pSocket = ofc_handle_lock(hSocket);
+    if (pSocket != OFC_NULL) {
+        if (pSocket->autotune)
+            autotune_sample(pSocket);
+        connect_resolve(pSocket, pSocket->revents);
+        if (pSocket->coalesce_len > 0 && (pSocket->revents & POLLOUT))
+            coalesce_flush(pSocket);
+        if (pSocket->connect_event) {
+            EventTest |= OFC_SOCKET_EVENT_CONNECT;
+            pSocket->connect_event = OFC_FALSE;
+        }
+        if (pSocket->drain_state != OFC_SOCKET_DRAIN_NONE) {
+            /*
+             * Whatever a draining socket reads is thrown away.  Report
+             * only the end of the drain.
+             */
+            drain_resolve(pSocket, pSocket->revents);
+            pSocket->revents &= ~(POLLIN | POLLHUP);
+            if (pSocket->drain_event) {
+                EventTest |= OFC_SOCKET_EVENT_CLOSE;
+                pSocket->drain_event = OFC_FALSE;
+            }
+        }
+        /*
+         * Don't report a write the caller didn't ask for just because
+         * a pending connect had us poll for it
+         */
+        revents = pSocket->revents;
+        if (!(pSocket->events & POLLOUT))
+            revents &= ~POLLOUT;
+
+        if (revents & POLLHUP)
+            EventTest |= OFC_SOCKET_EVENT_CLOSE;
+        if (revents & POLLIN)
+            EventTest |= (OFC_SOCKET_EVENT_ACCEPT | OFC_SOCKET_EVENT_READ);
+        if (revents & POLLERR)
+            EventTest |= OFC_SOCKET_EVENT_ADDRESSCHANGE;
+        if (revents & POLLPRI)
+            EventTest |= OFC_SOCKET_EVENT_QOS;
+        if (revents & (POLLRDBAND | POLLWRBAND))
+            EventTest |= OFC_SOCKET_EVENT_QOB;
+        if (revents & POLLOUT)
+            EventTest |= OFC_SOCKET_EVENT_WRITE;
+
+        ofc_handle_unlock(hSocket);
+    }
+
+    return (EventTest);
+}
+
+OFC_BOOL ofc_socket_impl_enable(OFC_HANDLE hSocket,
+                                OFC_SOCKET_EVENT_TYPE type) {
+    OFC_SOCKET_IMPL *pSocket;
+    OFC_INT EventTest;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    pSocket = ofc_handle_lock(hSocket);
+    if (pSocket != OFC_NULL) {
+        EventTest = 0;
+
+        if (type & OFC_SOCKET_EVENT_CLOSE)
+            EventTest |= POLLHUP;
+        if (type & OFC_SOCKET_EVENT_ACCEPT)
+            EventTest |= POLLIN;
+        if (type & OFC_SOCKET_EVENT_ADDRESSCHANGE)
+            EventTest |= POLLERR;
+        if (type & OFC_SOCKET_EVENT_QOS)
+            EventTest |= POLLPRI;
+        if (type & OFC_SOCKET_EVENT_QOB)
+            EventTest |= (POLLRDBAND | POLLWRBAND);
+        if (type & OFC_SOCKET_EVENT_READ)
+            EventTest |= POLLIN;
+        if (type & OFC_SOCKET_EVENT_WRITE)
+            EventTest |= POLLOUT;
+
+        pSocket->events = EventTest;
+        update_poll_events(pSocket);
+        ofc_handle_unlock(hSocket);
+        ret = OFC_TRUE;
+    }
+
+    return (ret);
+}
+
+OFC_VOID ofc_socket_impl_set_send_size(OFC_HANDLE hSocket, OFC_INT size) {
+    OFC_SOCKET_IMPL *sock;
+
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        setsockopt(sock->socket, SOL_SOCKET, SO_SNDBUF,
+                   (const char *) &size, sizeof(size));
+        ofc_handle_unlock(hSocket);
+    }
+}
+
+OFC_VOID ofc_socket_impl_set_recv_size(OFC_HANDLE hSocket, OFC_INT size) {
+    OFC_SOCKET_IMPL *sock;
+
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        setsockopt(sock->socket, SOL_SOCKET, SO_RCVBUF,
+                   (const char *) &size, sizeof(size));
+        ofc_handle_unlock(hSocket);
+    }
+}
+
+OFC_VOID
+ofc_socket_impl_autotune_config(const OFC_SOCKET_AUTOTUNE_CONFIG *config) {
+    pthread_mutex_lock(&autotune_mutex);
+    autotune_config = *config;
+    pthread_mutex_unlock(&autotune_mutex);
+}
+
+OFC_SIZET ofc_socket_impl_autotune_memory(OFC_VOID) {
+    OFC_SIZET ret;
+
+    pthread_mutex_lock(&autotune_mutex);
+    ret = autotune_memory;
+    pthread_mutex_unlock(&autotune_mutex);
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_autotune(OFC_HANDLE hSocket, OFC_BOOL onoff) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    OFC_UINT32 rtt_us;
+    OFC_UINT64 window;
+    OFC_UINT64 retransmits;
+    int size;
+    socklen_t len;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (!onoff) {
+            if (sock->autotune)
+                autotune_release(sock);
+            ret = OFC_TRUE;
+        } else if (sock->autotune)
+            ret = OFC_TRUE;
+        else if (sock->type == SOCKET_TYPE_STREAM) {
+            /*
+             * Start from whatever the buffers are now and take the
+             * baseline for the first throughput sample
+             */
+            ofc_memset(&sock->tune, 0, sizeof(sock->tune));
+            sock->tune_bytes = STATS_LOAD(sock->stats.bytes_in) +
+                STATS_LOAD(sock->stats.bytes_out);
+            if (tcp_sample(sock->socket, &rtt_us, &sock->tune_bytes,
+                           &window, &retransmits)) {
+                len = sizeof(size);
+                if (getsockopt(sock->socket, SOL_SOCKET, SO_SNDBUF,
+                               &size, &len) == 0)
+                    sock->tune.send_size = size;
+                len = sizeof(size);
+                if (getsockopt(sock->socket, SOL_SOCKET, SO_RCVBUF,
+                               &size, &len) == 0)
+                    sock->tune.recv_size = size;
+                sock->tune_size = sock->tune.send_size > sock->tune.recv_size ?
+                                  sock->tune.send_size : sock->tune.recv_size;
+                sock->tune.enabled = OFC_TRUE;
+                sock->tune_last = ofc_time_get_now();
+                sock->autotune = OFC_TRUE;
+
+                pthread_mutex_lock(&autotune_mutex);
+                autotune_memory += sock->tune.send_size + sock->tune.recv_size;
+                pthread_mutex_unlock(&autotune_mutex);
+                ret = OFC_TRUE;
+            }
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_autotune_sample(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->autotune)
+            ret = autotune_sample(sock);
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_autotune_state(OFC_HANDLE hSocket,
+                                        OFC_SOCKET_AUTOTUNE *state) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->autotune) {
+            *state = sock->tune;
+            ret = OFC_TRUE;
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+/*
+ * Fill in the parts of a snapshot that come from the kernel
+ */
+static OFC_VOID stats_kernel(int fd, OFC_SOCKET_STATS *stats) {
+    struct sockaddr_storage local;
+    socklen_t len;
+    OFC_UINT32 rtt_us;
+    OFC_UINT64 bytes;
+    OFC_UINT64 window;
+    OFC_UINT64 retransmits;
+    OFC_IPADDR ip;
+
+    len = sizeof(local);
+    stats->local_port = 0;
+    if (getsockname(fd, (struct sockaddr *) &local, &len) == 0)
+        unmake_sockaddr((struct sockaddr *) &local, &ip, &stats->local_port);
+    stats->rtt_us = 0;
+    stats->retransmits = 0;
+    bytes = 0;
+    if (tcp_sample(fd, &rtt_us, &bytes, &window, &retransmits)) {
+        stats->rtt_us = rtt_us;
+        stats->retransmits = retransmits;
+    }
+}
+
+/*
+ * Copy a socket's counters, counting a write stall still in progress.
+ * The caller holds the socket's handle or a reference on it.
+ */
+static OFC_VOID stats_copy(OFC_SOCKET_IMPL *sock, OFC_SOCKET_STATS *stats,
+                           OFC_MSTIME now) {
+    OFC_MSTIME since;
+
+    ofc_memset(stats, 0, sizeof(OFC_SOCKET_STATS));
+    stats->count = 1;
+    stats->bytes_out = STATS_LOAD(sock->stats.bytes_out);
+    stats->bytes_in = STATS_LOAD(sock->stats.bytes_in);
+    stats->sends = STATS_LOAD(sock->stats.sends);
+    stats->recvs = STATS_LOAD(sock->stats.recvs);
+    stats->send_again = STATS_LOAD(sock->stats.send_again);
+    stats->recv_again = STATS_LOAD(sock->stats.recv_again);
+    stats->short_writes = STATS_LOAD(sock->stats.short_writes);
+    stats->errors = STATS_LOAD(sock->stats.errors);
+    stats->write_blocked_ms = STATS_LOAD(sock->stats.write_blocked_ms);
+    since = STATS_LOAD(sock->blocked_since);
+    if (since != 0)
+        stats->write_blocked_ms += now - since;
+    stats_kernel(sock->socket, stats);
+}
+
+/*
+ * Take a reference on every live socket, so each keeps its descriptor
+ * while the kernel is asked about it with the list unlocked.  A socket
+ * whose last reference is already gone is on its way out and skipped.
+ * Returns the sockets, OFC_NULL with a count of 0 if there are none or
+ * memory is short.
+ */
+static OFC_SOCKET_IMPL **stats_hold(OFC_INT *count) {
+    OFC_SOCKET_IMPL **socks;
+    OFC_SOCKET_IMPL *sock;
+    OFC_INT refs;
+
+    *count = 0;
+    pthread_mutex_lock(&socket_live_mutex);
+    socks = OFC_NULL;
+    if (socket_live_count > 0)
+        socks = ofc_malloc(sizeof(OFC_SOCKET_IMPL *) * socket_live_count);
+    if (socks != OFC_NULL) {
+        for (sock = socket_live_head; sock != OFC_NULL;
+             sock = sock->live_next) {
+            refs = __atomic_load_n(&sock->refcount, __ATOMIC_ACQUIRE);
+            while (refs > 0 &&
+                   !__atomic_compare_exchange_n(&sock->refcount, &refs,
+                                                refs + 1, OFC_FALSE,
+                                                __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE));
+            if (refs > 0)
+                socks[(*count)++] = sock;
+        }
+    }
+    pthread_mutex_unlock(&socket_live_mutex);
+    return (socks);
+}
+
+static OFC_VOID stats_release(OFC_SOCKET_IMPL **socks, OFC_INT count) {
+    OFC_INT i;
+
+    for (i = 0; i < count; i++)
+        socket_unref(socks[i]);
+    ofc_free(socks);
+}
+
+OFC_BOOL ofc_socket_impl_stats(OFC_HANDLE hSocket, OFC_SOCKET_STATS *stats) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        stats_copy(sock, stats, ofc_time_get_now());
+        ret = OFC_TRUE;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_INT ofc_socket_impl_stats_snapshot(OFC_SOCKET_STATS *stats, OFC_INT max) {
+    OFC_SOCKET_IMPL **socks;
+    OFC_INT count;
+    OFC_INT i;
+    OFC_MSTIME now;
+
+    socks = stats_hold(&count);
+    now = ofc_time_get_now();
+    for (i = 0; i < count && i < max; i++)
+        stats_copy(socks[i], &stats[i], now);
+    stats_release(socks, count);
+    return (count);
+}
+
+OFC_INT ofc_socket_impl_stats_by_port(OFC_SOCKET_STATS *stats, OFC_INT max) {
+    OFC_SOCKET_IMPL **socks;
+    OFC_SOCKET_STATS one;
+    OFC_SOCKET_STATS *agg;
+    OFC_INT *rtt_count;
+    OFC_INT count;
+    OFC_INT held;
+    OFC_INT i;
+    OFC_INT j;
+    OFC_MSTIME now;
+
+    count = 0;
+    if (max <= 0)
+        return (count);
+    /*
+     * Number of sockets behind each entry's RTT, for the mean
+     */
+    rtt_count = ofc_malloc(sizeof(OFC_INT) * max);
+    if (rtt_count == OFC_NULL)
+        return (count);
+
+    socks = stats_hold(&held);
+    now = ofc_time_get_now();
+    for (j = 0; j < held; j++) {
+        stats_copy(socks[j], &one, now);
+
+        for (i = 0; i < count && stats[i].local_port != one.local_port; i++);
+        if (i == count) {
+            if (count == max)
+                continue;
+            rtt_count[count] = one.rtt_us != 0;
+            stats[count++] = one;
+        } else {
+            agg = &stats[i];
+            if (one.rtt_us != 0) {
+                rtt_count[i]++;
+                agg->rtt_us = (OFC_UINT32)
+                        (((OFC_UINT64) agg->rtt_us * (rtt_count[i] - 1) +
+                          one.rtt_us) / rtt_count[i]);
+            }
+            agg->count++;
+            agg->bytes_out += one.bytes_out;
+            agg->bytes_in += one.bytes_in;
+            agg->sends += one.sends;
+            agg->recvs += one.recvs;
+            agg->send_again += one.send_again;
+            agg->recv_again += one.recv_again;
+            agg->short_writes += one.short_writes;
+            agg->errors += one.errors;
+            agg->write_blocked_ms += one.write_blocked_ms;
+            agg->retransmits += one.retransmits;
+        }
+    }
+    stats_release(socks, held);
+    ofc_free(rtt_count);
+    return (count);
+}
+
+OFC_BOOL ofc_socket_impl_set_profile(OFC_HANDLE hSocket,
+                                     const OFC_SOCKET_PROFILE *profile) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        sock->profile = *profile;
+        sock->has_profile = OFC_TRUE;
+        ret = apply_profile(sock->socket, sock->type, profile);
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_cork(OFC_HANDLE hSocket, OFC_BOOL onoff) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    int val;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        val = onoff;
+#if defined(TCP_NOPUSH)
+        if (setsockopt(sock->socket, IPPROTO_TCP, TCP_NOPUSH,
+                       &val, sizeof(val)) == 0)
+            ret = OFC_TRUE;
+        /*
+         * Clearing TCP_NOPUSH doesn't flush what's already queued on
+         * Darwin.  A zero length send does.
+         */
+        if (ret && !onoff)
+            send(sock->socket, "", 0, 0);
+#elif defined(TCP_CORK)
+        if (setsockopt(sock->socket, IPPROTO_TCP, TCP_CORK,
+                       &val, sizeof(val)) == 0)
+            ret = OFC_TRUE;
+#endif
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_get_addresses(OFC_HANDLE hSock,
+                                       OFC_SOCKADDR *local,
+                                       OFC_SOCKADDR *remote) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    int darwin_status;
+    struct sockaddr_storage local_sockaddr;
+    struct sockaddr_storage remote_sockaddr;
+    socklen_t local_sockaddr_size;
+    socklen_t remote_sockaddr_size;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSock);
+    if (sock != OFC_NULL) {
+        local_sockaddr_size = sizeof(local_sockaddr);
+        darwin_status = getsockname(sock->socket,
+                                    (struct sockaddr *) &local_sockaddr,
+                                    &local_sockaddr_size);
+        if (darwin_status == 0) {
+            unmake_sockaddr((struct sockaddr *) &local_sockaddr,
+                            &local->sin_addr, &local->sin_port);
+            /*
+             * Mapped IPv4 on a dual stack socket reports as IPv4
+             */
+            local->sin_family = local->sin_addr.ip_version;
+
+            remote_sockaddr_size = sizeof(remote_sockaddr);
+            darwin_status = getpeername(sock->socket,
+                                        (struct sockaddr *) &remote_sockaddr,
+                                        &remote_sockaddr_size);
+            if (darwin_status == 0) {
+                unmake_sockaddr((struct sockaddr *) &remote_sockaddr,
+                                &remote->sin_addr, &remote->sin_port);
+                remote->sin_family = remote->sin_addr.ip_version;
+                ret = OFC_TRUE;
+            }
+        }
+        ofc_handle_unlock(hSock);
+    }
+    return (ret);
+}
+
+OFC_HANDLE ofc_socket_impl_create_dual(OFC_SOCKET_TYPE socktype,
+                                       const OFC_SOCKET_PROFILE *profile) {
+    OFC_HANDLE hSocket;
+    OFC_SOCKET_IMPL *sock;
+    int off;
+
+    hSocket = OFC_HANDLE_NULL;
+    if (socktype != SOCKET_TYPE_ICMP)
+        hSocket = ofc_socket_impl_create_profile(OFC_FAMILY_IPV6, socktype,
+                                                 profile);
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        off = 0;
+        if (setsockopt(sock->socket, IPPROTO_IPV6, IPV6_V6ONLY,
+                       &off, sizeof(off)) == 0) {
+            sock->dual = OFC_TRUE;
+            ofc_handle_unlock(hSocket);
+        } else {
+            ofc_handle_unlock(hSocket);
+            ofc_socket_impl_destroy(hSocket);
+            hSocket = OFC_HANDLE_NULL;
+        }
+    }
+    return (hSocket);
+}
+
+OFC_HANDLE ofc_socket_impl_dup(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SOCKET_IMPL *newsock;
+    OFC_HANDLE hNewSock;
+    int fd;
+
+    hNewSock = OFC_HANDLE_NULL;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        fd = fcntl(sock->socket, F_DUPFD_CLOEXEC, 0);
+        if (fd >= 0) {
+            newsock = socket_impl_alloc();
+            if (newsock == OFC_NULL)
+                close(fd);
+            else {
+                socket_impl_init(newsock, sock->type);
+                newsock->socket = fd;
+                newsock->family = sock->family;
+                newsock->local = sock->local;
+                newsock->dual = sock->dual;
+                newsock->ip = sock->ip;
+                newsock->has_profile = sock->has_profile;
+                newsock->profile = sock->profile;
+                socket_live_add(newsock);
+                hNewSock = ofc_handle_create(OFC_HANDLE_SOCKET_IMPL, newsock);
+            }
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (hNewSock);
+}
+
+/*
+ * Local sockets
+ */
+static OFC_BOOL local_sockaddr(struct sockaddr_un *mysockaddr,
+                               socklen_t *mysocklen, OFC_CCHAR *path) {
+    OFC_SIZET len;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    len = ofc_strlen(path);
+    if (len < sizeof(mysockaddr->sun_path)) {
+        ofc_memset(mysockaddr, '\0', sizeof(struct sockaddr_un));
+        mysockaddr->sun_family = AF_UNIX;
+        ofc_memcpy(mysockaddr->sun_path, path, len);
+        *mysocklen = (socklen_t) (offsetof(struct sockaddr_un, sun_path) +
+                                  len + 1);
+        ret = OFC_TRUE;
+    } else
+        errno = ENAMETOOLONG;
+    return (ret);
+}
+
+/*
+ * Wrap a local socket descriptor in a handle.  The descriptor is closed
+ * on failure.
+ */
+static OFC_HANDLE local_handle(int fd, OFC_SOCKET_TYPE socktype) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_HANDLE hSocket;
+    int on;
+
+    hSocket = OFC_HANDLE_NULL;
+    sock = socket_impl_alloc();
+    if (sock == OFC_NULL)
+        close(fd);
+    else {
+        socket_impl_init(sock, socktype);
+        sock->socket = fd;
+        sock->local = OFC_TRUE;
+        sock->family = OFC_FAMILY_IP;
+        sock->ip.ip_version = OFC_FAMILY_IP;
+        sock->ip.u.ipv4.addr = OFC_INADDR_LOOPBACK;
+
+        on = OFC_TRUE;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char *) &on, sizeof(on));
+
+        socket_live_add(sock);
+        hSocket = ofc_handle_create(OFC_HANDLE_SOCKET_IMPL, sock);
+    }
+    return (hSocket);
+}
+
+OFC_HANDLE ofc_socket_impl_create_local(OFC_SOCKET_TYPE socktype) {
+    OFC_HANDLE hSocket;
+    int fd;
+
+    hSocket = OFC_HANDLE_NULL;
+    if (socktype != SOCKET_TYPE_ICMP) {
+        fd = socket(AF_UNIX, socktype == SOCKET_TYPE_STREAM ?
+                             SOCK_STREAM : SOCK_DGRAM, 0);
+        if (fd < 0)
+            ofc_log(OFC_LOG_WARN, "socket error: AF_UNIX, errno %d\n",
+                    errno);
+        else
+            hSocket = local_handle(fd, socktype);
+    }
+    return (hSocket);
+}
+
+OFC_BOOL ofc_socket_impl_pair(OFC_SOCKET_TYPE socktype,
+                              OFC_HANDLE hSockets[2]) {
+    OFC_BOOL ret;
+    int fds[2];
+
+    ret = OFC_FALSE;
+    if (socktype != SOCKET_TYPE_ICMP &&
+        socketpair(AF_UNIX, socktype == SOCKET_TYPE_STREAM ?
+                            SOCK_STREAM : SOCK_DGRAM, 0, fds) == 0) {
+        hSockets[0] = local_handle(fds[0], socktype);
+        hSockets[1] = local_handle(fds[1], socktype);
+        if (hSockets[0] != OFC_HANDLE_NULL && hSockets[1] != OFC_HANDLE_NULL)
+            ret = OFC_TRUE;
+        else {
+            if (hSockets[0] != OFC_HANDLE_NULL)
+                ofc_socket_impl_destroy(hSockets[0]);
+            if (hSockets[1] != OFC_HANDLE_NULL)
+                ofc_socket_impl_destroy(hSockets[1]);
+        }
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_bind_local(OFC_HANDLE hSocket, OFC_CCHAR *path) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    struct sockaddr_un mysockaddr;
+    socklen_t mysocklen;
+    struct stat st;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->local && local_sockaddr(&mysockaddr, &mysocklen, path)) {
+            if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(path);
+            if (bind(sock->socket, (struct sockaddr *) &mysockaddr,
+                     mysocklen) == 0)
+                ret = OFC_TRUE;
+            else
+                ofc_log(OFC_LOG_WARN, "Bind Error: %s, errno %d\n",
+                        path, errno);
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_connect_local(OFC_HANDLE hSocket, OFC_CCHAR *path) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    int status;
+    struct sockaddr_un mysockaddr;
+    socklen_t mysocklen;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->local && local_sockaddr(&mysockaddr, &mysocklen, path)) {
+            status = connect(sock->socket, (struct sockaddr *) &mysockaddr,
+                             mysocklen);
+            if (status == 0 || errno == EINPROGRESS)
+                ret = OFC_TRUE;
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_sendto_local(OFC_HANDLE hSocket,
+                                       const OFC_VOID *buf, OFC_SIZET len,
+                                       OFC_CCHAR *path) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+    OFC_SIZET status;
+    struct sockaddr_un mysockaddr;
+    socklen_t mysocklen;
+
+    ret = -1;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->local && local_sockaddr(&mysockaddr, &mysocklen, path)) {
+            status = sendto(sock->socket, (const char *) buf, len, 0,
+                            (struct sockaddr *) &mysockaddr, mysocklen);
+            stats_send(sock, len, status);
+            if ((status == -1) && (errno == EAGAIN))
+                ret = 0;
+            else if (status >= 0)
+                ret = status;
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_peer_cred(OFC_HANDLE hSocket,
+                                   OFC_SOCKET_PEER_CRED *cred) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    socklen_t len;
+#if defined(SO_PEERCRED)
+    struct ucred ucred;
+#elif defined(OFC_DARWIN_HAVE_GETPEEREID)
+    uid_t uid;
+    gid_t gid;
+#if defined(LOCAL_PEERPID)
+    pid_t pid;
+#endif
+#endif
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->local) {
+#if defined(SO_PEERCRED)
+            len = sizeof(ucred);
+            if (getsockopt(sock->socket, SOL_SOCKET, SO_PEERCRED,
+                           &ucred, &len) == 0) {
+                cred->pid = ucred.pid;
+                cred->uid = ucred.uid;
+                cred->gid = ucred.gid;
+                ret = OFC_TRUE;
+            }
+#elif defined(OFC_DARWIN_HAVE_GETPEEREID)
+            if (getpeereid(sock->socket, &uid, &gid) == 0) {
+                cred->pid = -1;
+                cred->uid = uid;
+                cred->gid = gid;
+#if defined(LOCAL_PEERPID)
+                len = sizeof(pid);
+                if (getsockopt(sock->socket, SOL_LOCAL, LOCAL_PEERPID,
+                               &pid, &len) == 0)
+                    cred->pid = pid;
+#endif
+                ret = OFC_TRUE;
+            }
+#endif
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_send_fds(OFC_HANDLE hSocket,
+                                   const OFC_VOID *buf, OFC_SIZET len,
+                                   const int *fds, OFC_INT nfds) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+    OFC_SIZET status;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * OFC_SOCKET_FDS_MAX)];
+    } control;
+
+    ret = -1;
+    if (nfds < 0 || nfds > OFC_SOCKET_FDS_MAX)
+        return (ret);
+
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL && !coalesce_flush(sock)) {
+        ret = 0;
+        ofc_handle_unlock(hSocket);
+    } else if (sock != OFC_NULL) {
+        iov.iov_base = (OFC_VOID *) buf;
+        iov.iov_len = len;
+        ofc_memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (nfds > 0) {
+            ofc_memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+            ofc_memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+        }
+
+        status = sendmsg(sock->socket, &msg, 0);
+        stats_send(sock, len, status);
+        if ((status == -1) && (errno == EAGAIN))
+            ret = 0;
+        else if (status >= 0)
+            ret = status;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_SIZET ofc_socket_impl_recv_fds(OFC_HANDLE hSocket,
+                                   OFC_VOID *buf, OFC_SIZET len,
+                                   int *fds, OFC_INT *nfds) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SIZET ret;
+    OFC_SIZET status;
+    OFC_INT count;
+    OFC_INT n;
+    OFC_INT i;
+    int fd;
+    int flags;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * OFC_SOCKET_FDS_MAX)];
+    } control;
+
+    ret = -1;
+    count = 0;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        ofc_memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+        status = recvmsg(sock->socket, &msg, flags);
+        stats_recv(sock, status);
+
+        if ((status == -1) && (errno == EAGAIN))
+            ret = 0;
+        else if (status >= 0) {
+            ret = status;
+            for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != OFC_NULL;
+                 cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_RIGHTS)
+                    continue;
+                n = (OFC_INT) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                for (i = 0; i < n; i++) {
+                    ofc_memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+                               sizeof(int));
+                    if (count < *nfds) {
+#if !defined(MSG_CMSG_CLOEXEC)
+                        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+                        fds[count++] = fd;
+                    } else
+                        close(fd);
+                }
+            }
+        }
+        ofc_handle_unlock(hSocket);
+    }
+    *nfds = count;
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_shutdown(OFC_HANDLE hSocket,
+                                  OFC_SOCKET_SHUTDOWN how) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    int darwin_how;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (how == OFC_SOCKET_SHUTDOWN_READ)
+            darwin_how = SHUT_RD;
+        else if (how == OFC_SOCKET_SHUTDOWN_WRITE)
+            darwin_how = SHUT_WR;
+        else
+            darwin_how = SHUT_RDWR;
+        if (darwin_how != SHUT_RD && !coalesce_flush(sock))
+            errno = EAGAIN;
+        else if (shutdown(sock->socket, darwin_how) == 0)
+            ret = OFC_TRUE;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_linger(OFC_HANDLE hSocket, OFC_BOOL onoff,
+                                OFC_INT seconds) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    struct linger linger;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        linger.l_onoff = onoff ? 1 : 0;
+        linger.l_linger = seconds;
+        if (setsockopt(sock->socket, SOL_SOCKET, SO_LINGER, &linger,
+                       sizeof(linger)) == 0)
+            ret = OFC_TRUE;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_VOID ofc_socket_impl_abort(OFC_HANDLE hSocket) {
+    ofc_socket_impl_linger(hSocket, OFC_TRUE, 0);
+    ofc_socket_impl_destroy(hSocket);
+}
+
+OFC_BOOL ofc_socket_impl_close_graceful(OFC_HANDLE hSocket,
+                                        OFC_MSTIME timeout) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    int flags;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        flags = fcntl(sock->socket, F_GETFL);
+        if (flags >= 0)
+            fcntl(sock->socket, F_SETFL, flags | O_NONBLOCK);
+
+        if (!coalesce_flush(sock))
+            errno = EAGAIN;
+        else if (shutdown(sock->socket, SHUT_WR) == 0) {
+            sock->drain_state = OFC_SOCKET_DRAIN_PENDING;
+            sock->drain_event = OFC_FALSE;
+            sock->drain_timed = (timeout != 0);
+            sock->drain_deadline = ofc_time_get_now() + timeout;
+            ret = OFC_TRUE;
+        } else if (errno == ENOTCONN) {
+            /*
+             * Already gone.  Nothing to wait for.
+             */
+            sock->drain_state = OFC_SOCKET_DRAIN_DONE;
+            sock->drain_event = OFC_TRUE;
+            ret = OFC_TRUE;
+        }
+        update_poll_events(sock);
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_SOCKET_DRAIN_STATE ofc_socket_impl_drain_state(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_SOCKET_DRAIN_STATE ret;
+    struct pollfd pfd;
+
+    ret = OFC_SOCKET_DRAIN_NONE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        if (sock->drain_state == OFC_SOCKET_DRAIN_PENDING) {
+            pfd.fd = sock->socket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) < 0)
+                pfd.revents = 0;
+            drain_resolve(sock, pfd.revents);
+        }
+        ret = sock->drain_state;
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_coalesce(OFC_HANDLE hSocket, OFC_SIZET threshold) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+    OFC_UINT8 *coalesce_buf;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        pthread_mutex_lock(&sock->io_mutex);
+        if (sock->type == SOCKET_TYPE_STREAM && coalesce_write(sock)) {
+            /*
+             * Resized or turned off only when empty
+             */
+            coalesce_buf = OFC_NULL;
+            if (threshold > 0)
+                coalesce_buf = ofc_malloc(threshold);
+            if (threshold == 0 || coalesce_buf != OFC_NULL) {
+                if (sock->coalesce_buf != OFC_NULL)
+                    ofc_free(sock->coalesce_buf);
+                sock->coalesce_buf = coalesce_buf;
+                sock->coalesce_size = threshold;
+                ret = OFC_TRUE;
+            }
+        }
+        pthread_mutex_unlock(&sock->io_mutex);
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_flush(OFC_HANDLE hSocket) {
+    OFC_SOCKET_IMPL *sock;
+    OFC_BOOL ret;
+
+    ret = OFC_FALSE;
+    sock = ofc_handle_lock(hSocket);
+    if (sock != OFC_NULL) {
+        ret = socket_flush(sock);
+        ofc_handle_unlock(hSocket);
+    }
+    return (ret);
+}
+
+OFC_BOOL ofc_socket_impl_ref_flush(OFC_SOCKET_REF *ref) {
+    return (socket_flush(ref));
+}
+
+OFC_SIZET ofc_socket_impl_ref_pending(OFC_SOCKET_REF *ref) {
+    return (__atomic_load_n(&ref->coalesce_len, __ATOMIC_RELAXED));
+}
+
 /** \} */
@@ -31,6 +31,7 @@
 #include "ofc/file.h"
 
 #include "ofc_darwin/fs_darwin.h"
+#include "ofc_darwin/socket_darwin.h"
 
 /**
  * \defgroup waitset_darwin Darwin Dependent Scheduler Handling
@@ -39,8 +40,27 @@
 
 /** \{ */
 
+/*
+ * A socket in the wait set, with the reference the wait set holds on it.
+ * pass is the last wait that found the socket still in the set.
+ */
+typedef struct {
+    OFC_HANDLE hSocket;
+    OFC_SOCKET_REF *ref;
+    OFC_UINT32 pass;
+} WAIT_SOCKET;
+
 typedef struct {
     int pipe_files[2];
+    /*
+     * References on the set's sockets, taken the first time a wait sees
+     * each one and kept until a wait no longer finds it in the set.
+     * Only the waiting thread touches these.
+     */
+    WAIT_SOCKET *sockets;
+    OFC_INT socket_count;
+    OFC_INT socket_size;
+    OFC_UINT32 pass;
 } DARWIN_WAIT_SET;
 
 OFC_VOID ofc_waitset_create_impl(WAIT_SET *pWaitSet) {
@@ -48,6 +68,10 @@ OFC_VOID ofc_waitset_create_impl(WAIT_SET *pWaitSet) {
 
     DarwinWaitSet = ofc_malloc(sizeof(DARWIN_WAIT_SET));
     pWaitSet->impl = DarwinWaitSet;
+    DarwinWaitSet->sockets = OFC_NULL;
+    DarwinWaitSet->socket_count = 0;
+    DarwinWaitSet->socket_size = 0;
+    DarwinWaitSet->pass = 0;
     pipe(DarwinWaitSet->pipe_files);
     fcntl(DarwinWaitSet->pipe_files[0], F_SETFL,
           fcntl(DarwinWaitSet->pipe_files[0], F_GETFL) | O_NONBLOCK);
@@ -57,10 +81,15 @@ OFC_VOID ofc_waitset_create_impl(WAIT_SET *pWaitSet) {
 
 OFC_VOID ofc_waitset_destroy_impl(WAIT_SET *pWaitSet) {
     DARWIN_WAIT_SET *DarwinWaitSet;
+    OFC_INT i;
 
     DarwinWaitSet = pWaitSet->impl;
     close(DarwinWaitSet->pipe_files[0]);
     close(DarwinWaitSet->pipe_files[1]);
+    for (i = 0; i < DarwinWaitSet->socket_count; i++)
+        ofc_socket_impl_ref_release(DarwinWaitSet->sockets[i].ref);
+    if (DarwinWaitSet->sockets != OFC_NULL)
+        ofc_free(DarwinWaitSet->sockets);
     ofc_free(pWaitSet->impl);
     pWaitSet->impl = OFC_NULL;
 }
@@ -70,6 +99,88 @@ typedef struct {
     OFC_HANDLE hAssoc;
 } EVENT_ELEMENT;
 
+/*
+ * Return the wait set's reference on a socket, taking one the first time
+ * the socket is seen.  A socket is marked closed before its handle is
+ * destroyed, so a reference on a closed socket may belong to a handle
+ * since reused.  It is dropped and the handle looked up again, and a
+ * socket that is closed all the same isn't polled.
+ */
+static OFC_SOCKET_REF *waitset_socket_ref(DARWIN_WAIT_SET *DarwinWaitSet,
+                                          OFC_HANDLE hSocket) {
+    WAIT_SOCKET *entry;
+    WAIT_SOCKET *sockets;
+    OFC_SOCKET_REF *ret;
+    OFC_INT i;
+
+    ret = OFC_NULL;
+    entry = OFC_NULL;
+    for (i = 0; i < DarwinWaitSet->socket_count && entry == OFC_NULL; i++)
+        if (DarwinWaitSet->sockets[i].hSocket == hSocket)
+            entry = &DarwinWaitSet->sockets[i];
+
+    if (entry != OFC_NULL) {
+        entry->pass = DarwinWaitSet->pass;
+        if (ofc_socket_impl_ref_fd(entry->ref) >= 0)
+            ret = entry->ref;
+        else {
+            ofc_socket_impl_ref_release(entry->ref);
+            *entry = DarwinWaitSet->sockets[--DarwinWaitSet->socket_count];
+        }
+    }
+
+    if (ret == OFC_NULL) {
+        ret = ofc_socket_impl_ref(ofc_socket_get_impl(hSocket));
+        if (ret != OFC_NULL && ofc_socket_impl_ref_fd(ret) < 0) {
+            ofc_socket_impl_ref_release(ret);
+            ret = OFC_NULL;
+        }
+        if (ret != OFC_NULL &&
+            DarwinWaitSet->socket_count == DarwinWaitSet->socket_size) {
+            sockets = ofc_realloc(DarwinWaitSet->sockets,
+                                  sizeof(WAIT_SOCKET) *
+                                  (DarwinWaitSet->socket_size + 16));
+            if (sockets == OFC_NULL) {
+                ofc_socket_impl_ref_release(ret);
+                ret = OFC_NULL;
+            } else {
+                DarwinWaitSet->sockets = sockets;
+                DarwinWaitSet->socket_size += 16;
+            }
+        }
+        if (ret != OFC_NULL) {
+            entry = &DarwinWaitSet->sockets[DarwinWaitSet->socket_count++];
+            entry->hSocket = hSocket;
+            entry->ref = ret;
+            entry->pass = DarwinWaitSet->pass;
+        }
+    }
+    return (ret);
+}
+
+/*
+ * Drop the references this wait isn't using on closed sockets and, after
+ * a full pass over the set, on sockets the pass didn't see
+ */
+static OFC_VOID waitset_socket_prune(DARWIN_WAIT_SET *DarwinWaitSet,
+                                     OFC_BOOL full) {
+    WAIT_SOCKET *entry;
+    OFC_INT i;
+
+    i = 0;
+    while (i < DarwinWaitSet->socket_count) {
+        entry = &DarwinWaitSet->sockets[i];
+        if (entry->pass == DarwinWaitSet->pass ||
+            (!full && ofc_socket_impl_ref_fd(entry->ref) >= 0))
+            i++;
+        else {
+            ofc_socket_impl_ref_release(DarwinWaitSet->sockets[i].ref);
+            DarwinWaitSet->sockets[i] =
+                    DarwinWaitSet->sockets[--DarwinWaitSet->socket_count];
+        }
+    }
+}
+
 OFC_VOID ofc_waitset_signal_impl(OFC_HANDLE handle, OFC_HANDLE hEvent) {
     WAIT_SET *pWaitSet;
     DARWIN_WAIT_SET *DarwinWaitSet;
@@ -133,13 +244,15 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
     OFC_HANDLE hEventHandle;
     OFC_HANDLE triggered_event;
     OFC_HANDLE timer_event;
-    OFC_HANDLE darwinHandle;
+    OFC_SOCKET_REF *timer_ref;
 #if defined(OFC_FS_DARWIN)
     OFC_HANDLE fsHandle;
     OFC_FST_TYPE fsType;
 #endif
     struct pollfd *darwin_handle_list;
     OFC_HANDLE *ofc_handle_list;
+    OFC_SOCKET_REF **socket_ref_list;
+    OFC_SOCKET_REF *socket_ref;
 
     nfds_t wait_count;
     int wait_index;
@@ -158,12 +271,20 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
         eventQueue = ofc_queue_create();
         leastWait = OFC_MAX_SCHED_WAIT;
         timer_event = OFC_HANDLE_NULL;
+        timer_ref = OFC_NULL;
 
         wait_count = 0;
         darwin_handle_list = ofc_malloc(sizeof(struct pollfd));
         ofc_handle_list = ofc_malloc(sizeof(OFC_HANDLE));
+        /*
+         * The wait set's references on its sockets, so descriptors and
+         * events can be read, and results stored, without going back
+         * through the handle table
+         */
+        socket_ref_list = ofc_malloc(sizeof(OFC_SOCKET_REF *));
 
         DarwinWaitSet = pWaitSet->impl;
+        DarwinWaitSet->pass++;
 
         /*
          * Purge any additional queued events.  We'll get these before we
@@ -175,6 +296,7 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
         darwin_handle_list[wait_count].events = POLLIN;
         darwin_handle_list[wait_count].revents = 0;
         ofc_handle_list[wait_count] = OFC_HANDLE_NULL;
+        socket_ref_list[wait_count] = OFC_NULL;
 
         wait_count++;
 
@@ -224,12 +346,17 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
                         ofc_handle_list =
                                 ofc_realloc(ofc_handle_list,
                                             sizeof(OFC_HANDLE) * (wait_count + 1));
+                        socket_ref_list =
+                                ofc_realloc(socket_ref_list,
+                                            sizeof(OFC_SOCKET_REF *) *
+                                            (wait_count + 1));
                         fsHandle = OfcFileGetFSHandle(hEventHandle);
                         darwin_handle_list[wait_count].fd =
                                 OfcFSDarwinGetFD(fsHandle);
                         darwin_handle_list[wait_count].events = 0;
                         darwin_handle_list[wait_count].revents = 0;
                         ofc_handle_list[wait_count] = hEventHandle;
+                        socket_ref_list[wait_count] = OFC_NULL;
                         wait_count++;
                     }
 #endif
@@ -244,15 +371,41 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
                     ofc_handle_list =
                             ofc_realloc(ofc_handle_list,
                                         sizeof(OFC_HANDLE) * (wait_count + 1));
-
-                    darwinHandle = ofc_socket_get_impl(hEventHandle);
-                    darwin_handle_list[wait_count].fd =
-                            ofc_socket_impl_get_fd(darwinHandle);
-                    darwin_handle_list[wait_count].events =
-                            ofc_socket_impl_get_event(darwinHandle);
+                    socket_ref_list =
+                            ofc_realloc(socket_ref_list,
+                                        sizeof(OFC_SOCKET_REF *) *
+                                        (wait_count + 1));
+
+                    socket_ref = waitset_socket_ref(DarwinWaitSet,
+                                                    hEventHandle);
+                    darwin_handle_list[wait_count].fd = -1;
+                    darwin_handle_list[wait_count].events = 0;
                     darwin_handle_list[wait_count].revents = 0;
                     ofc_handle_list[wait_count] = hEventHandle;
+                    socket_ref_list[wait_count] = socket_ref;
                     wait_count++;
+                    if (socket_ref != OFC_NULL) {
+                        /*
+                         * Last chance to send coalesced writes before
+                         * sleeping
+                         */
+                        if (ofc_socket_impl_ref_pending(socket_ref) > 0)
+                            ofc_socket_impl_ref_flush(socket_ref);
+                        darwin_handle_list[wait_count - 1].fd =
+                                ofc_socket_impl_ref_fd(socket_ref);
+                        darwin_handle_list[wait_count - 1].events =
+                                ofc_socket_impl_ref_get_event(socket_ref);
+                        /*
+                         * A pending connect with a deadline bounds the
+                         * wait like a timer
+                         */
+                        wait_time = ofc_socket_impl_ref_wait_time(socket_ref);
+                        if (wait_time < leastWait) {
+                            leastWait = wait_time;
+                            timer_event = hEventHandle;
+                            timer_ref = socket_ref;
+                        }
+                    }
                     break;
 
                 case OFC_HANDLE_FSDARWIN_OVERLAPPED:
@@ -303,6 +456,7 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
                         if (wait_time < leastWait) {
                             leastWait = wait_time;
                             timer_event = hEventHandle;
+                            timer_ref = OFC_NULL;
                         }
                     }
                     break;
@@ -310,13 +464,22 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
             }
         }
 
+        /*
+         * Sockets no longer in the set are only known to be gone after a
+         * pass that looked at every handle.  Closed ones can go anyway.
+         */
+        waitset_socket_prune(DarwinWaitSet, hEventHandle == OFC_HANDLE_NULL);
+
         ofc_handle_unlock(handle);
 
         if (triggered_event == OFC_HANDLE_NULL)
 	  {
             poll_count = poll(darwin_handle_list, wait_count, leastWait);
-            if (poll_count == 0 && timer_event != OFC_HANDLE_NULL)
+            if (poll_count == 0 && timer_event != OFC_HANDLE_NULL) {
+                if (timer_ref != OFC_NULL)
+                    ofc_socket_impl_ref_set_event(timer_ref, 0);
                 triggered_event = timer_event;
+            }
             else if (poll_count > 0) {
                 for (wait_index = 0;
                      (wait_index < wait_count &&
@@ -327,9 +490,10 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
                     triggered_event =
                             PollEvent(DarwinWaitSet->pipe_files[0], eventQueue);
                 else if (wait_index < wait_count) {
-                    ofc_socket_impl_set_event
-                            (ofc_socket_get_impl(ofc_handle_list[wait_index]),
-                             darwin_handle_list[wait_index].revents);
+                    if (socket_ref_list[wait_index] != OFC_NULL)
+                        ofc_socket_impl_ref_set_event
+                                (socket_ref_list[wait_index],
+                                 darwin_handle_list[wait_index].revents);
 
                     if (darwin_handle_list[wait_index].revents != 0)
                         triggered_event = ofc_handle_list[wait_index];
@@ -346,6 +510,7 @@ OFC_HANDLE ofc_waitset_wait_impl(OFC_HANDLE handle) {
 
         ofc_free(darwin_handle_list);
         ofc_free(ofc_handle_list);
+        ofc_free(socket_ref_list);
 
     }
     return (triggered_event);